@@ -0,0 +1,1628 @@
+//Loopback benchmarks for the JSTP stack. Both ends of every connection live in
+//this one process and talk to each other over localhost, loss is simulated by
+//the udp_socket loss model exactly as it is for the client and server.
+//
+//Usage, <executable> benchmark [benchmark args...]
+//    recovery [bytes] [window] [port]
+//        Goodput of Go-Back-N vs selective repeat for loss from 0 to 20%
+//    congestion [bytes] [window] [port]
+//        Several flows at once under each congestion controller, window caps
+//        how far any controller may open its window
+//    tail [bytes] [window] [port]
+//        Delivery latency percentiles of a large transfer at 1% loss
+//    throughput [bytes] [window] [port]
+//        Raw bytes/sec through send, segmentation and recv with no loss, and
+//        what it costs in syscalls per MB and CPU seconds per GB, both with
+//        and without UDP segmentation offload
+//    mss [bytes] [window] [port]
+//        Goodput at several segment sizes and with path MTU probing
+//    streams [bytes] [window] [port]
+//        Memory and CPU of 1 vs 10000 streams, each running its own threads,
+//        all of them on one reactor, and on one reactor with the server side
+//        sharing the acceptor's socket. Both ends of a connection count, so
+//        10000 streams is 5000 connections. Idle is the CPU used by open
+//        streams doing nothing, active has every connection move bytes.
+//        Threads stop at 2000 streams, any more and they never finish
+//        connecting on a single core.
+//    workers [bytes] [window] [port]
+//        Aggregate goodput of a server split into 1, 2, 4 and 8 workers, each
+//        pinned to a core with its own reactor and SO_REUSEPORT socket
+//    pipeline [bytes] [window] [port]
+//        Goodput when the data is handed over in chunks of several sizes,
+//        each send waiting for its chunk to be acked vs a few async sends
+//        kept in flight at once
+//    stripes [bytes] [window] [port]
+//        Time to fetch one file split between 1, 2, 4 and 8 streams, each
+//        asking for its own byte range, on a lossy link
+//    resume [bytes] [window] [port]
+//        Time to get a 5GB file through when the connection is cut halfway,
+//        starting over vs picking up from the client's checkpoint
+//    delta [bytes] [window] [port]
+//        Bytes on the wire and time taken to update a 1GB file with 1% of its
+//        blocks changed, sending all of it vs sending a delta
+//    checksum [bytes] [window] [port]
+//        Speed of the CRC32C kernels, table vs SSE4.2, and the goodput of a
+//        lossless transfer with and without a checksum on every segment. Then
+//        the same with some segments corrupted on the way in.
+//    compress [bytes] [window] [port]
+//        Goodput of fetching a log-like text file and a file of random bytes,
+//        which is what anything already compressed looks like, with the body
+//        sent as it is vs as compressed blocks. Also the bytes on the wire
+//        and the CPU used by both ends.
+//    cache [bytes] [window] [port]
+//        Repeated pulls of a 1GB file with the server mapping it for every
+//        request vs serving it out of its file cache, then two files taking
+//        turns in a cache with room for one. Page faults, CPU and the cache's
+//        counters for each.
+//    handshake [bytes] [window] [port]
+//        Time to connect and move bytes both ways when the first 0, 1 and 3
+//        SYN-ACKs are lost, on threads, on a reactor and on a shared socket.
+//        Exits non zero if any of them hangs or comes up short.
+
+#include <iostream>
+using std::cout; using std::cerr; using std::endl; using std::istream;
+#include <iomanip>
+using std::setw; using std::fixed; using std::setprecision;
+#include <string>
+using std::string; using std::stoul;
+#include <vector>
+using std::vector;
+#include <memory>
+using std::unique_ptr; using std::shared_ptr;
+#include <thread>
+using std::thread;
+#include <atomic>
+using std::atomic;
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+using std::max; using std::min; using std::sort;
+#include <fstream>
+using std::ifstream;
+#include <deque>
+using std::deque;
+#include <future>
+using std::future;
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "jstp_streams.hpp"
+#include "file_layer.hpp"
+#include "mapped_file.hpp"
+#include "striped_fetch.hpp"
+#include "resumable_fetch.hpp"
+#include "delta_sync.hpp"
+#include "crc32c.hpp"
+#include "file_cache.hpp"
+
+//Defaults used when the user doesn't specify otherwise
+static const size_t DEFAULT_BYTES = 1000000;
+static const size_t DEFAULT_WINDOW = 64000;
+static const uint16_t DEFAULT_PORT = 9400;
+
+//How many flows share loopback in the congestion benchmark
+static const size_t CONGESTION_FLOWS = 4;
+
+//The tail latency benchmark moves a lot more data by default
+static const size_t TAIL_BYTES = 100000000;
+
+//The throughput benchmark moves this much and repeats it a few times
+static const size_t THROUGHPUT_BYTES = 50000000;
+static const size_t THROUGHPUT_RUNS = 3;
+
+//Big segments need a big window to get more than a couple of them in flight
+static const size_t MSS_WINDOW = 2000000;
+
+//Data is handed to the stream in pieces no bigger than this unless the
+//benchmark says otherwise.
+static const size_t SEND_CHUNK = 16000000;
+
+//Delivery latency is measured per block of this many bytes
+static const size_t LATENCY_BLOCK = 64000;
+
+//The streams benchmark runs at these sizes, in connections, and moves this
+//much over each one by default. Blocking sends go out from a handful of
+//threads since every send waits for its stream to flush.
+static const size_t STREAMS_CONNECTIONS[] = {1, 1000, 5000};
+static const size_t STREAMS_BYTES = 64000;
+static const size_t STREAMS_SENDERS = 16;
+static const size_t STREAMS_IDLE_SECONDS = 2;
+
+//Every stream on its own wakes up twice every IDLE_WAIT_USECS even with
+//nothing to do, past this many connections the threads alone eat a whole CPU
+//and the handshakes for the rest never get a look in.
+static const size_t STREAMS_THREADED_LIMIT = 1000;
+
+//The workers benchmark splits this many clients between the workers, each
+//gets bytes from whichever worker the kernel hands it to.
+static const size_t WORKER_COUNTS[] = {1, 2, 4, 8};
+static const size_t WORKERS_CLIENTS = 64;
+static const size_t WORKERS_BYTES = 4000000;
+
+//The pipeline benchmark hands data over in chunks of these sizes, and keeps
+//this many async sends out at once just like the file layer does.
+static const size_t PIPELINE_CHUNKS[] = {16000, 64000, 256000, 1000000};
+static const size_t PIPELINE_DEPTH = 4;
+static const size_t PIPELINE_BYTES = 20000000;
+
+//The stripes benchmark splits a file of this size between these many streams
+//at each of the loss rates
+static const size_t STRIPE_COUNTS[] = {1, 2, 4, 8};
+static const double STRIPE_LOSSES[] = {0.01, 0.05};
+static const size_t STRIPES_BYTES = 30000000;
+
+//The resume benchmark moves a file this big, and cuts the first connection
+//off after this much of it
+static const size_t RESUME_BYTES = 5000000000;
+static const double RESUME_CUT = 0.5;
+
+//The delta benchmark updates a file this big, which has this share of its
+//blocks changed since the client's copy
+static const size_t DELTA_BYTES = 1000000000;
+static const double DELTA_CHANGED = 0.01;
+
+//The checksum benchmark runs each kernel over this much data in buffers of
+//each size, then corrupts this share of the segments in a transfer
+static const size_t CHECKSUM_KERNEL_BYTES = 2000000000;
+static const size_t CHECKSUM_BUFFERS[] = {64, 1500, 65536, 4194304};
+static const double CHECKSUM_CORRUPTION = 0.001;
+
+//The compression benchmark fetches files this big
+static const size_t COMPRESS_BYTES = 200000000;
+
+//The cache benchmark pulls a file this big this many times, over streams with
+//big segments so the pulls don't take all day
+static const size_t CACHE_BYTES = 1000000000;
+static const size_t CACHE_PULLS = 4;
+static const size_t CACHE_SEGMENT = 65000;
+
+//The handshake benchmark throws away this many SYN-ACKs in a row, and gives up
+//on a connection that takes longer than the timeout.
+static const size_t HANDSHAKE_DROPS[] = {0, 1, 3};
+static const size_t HANDSHAKE_BYTES = 64000;
+static const size_t HANDSHAKE_TIMEOUT_SECONDS = 30;
+
+//Everything that describes one connection in a benchmark
+struct transfer_config{
+    uint16_t port;
+    size_t bytes;
+    size_t window;
+    double loss;
+    recovery_mode::Enum mode;
+    congestion_type::Enum congestion;
+    bool offload;
+
+    //Biggest segment either end will take, 0 for the default, and whether
+    //the sender probes its way up to it.
+    size_t segment_size;
+    bool probe;
+
+    //Size of the pieces the data is sent in, 0 for SEND_CHUNK, and how many
+    //of them go out with send_async before waiting on the oldest. 0 means
+    //every piece uses a blocking send.
+    size_t send_chunk;
+    size_t pipeline;
+
+    //Whether segments carry checksums, and the share of them which get a bit
+    //flipped on the way into either end
+    bool checksums;
+    double corruption;
+};
+
+//The outcome of moving a block of data across one connection
+struct transfer_result{
+    double seconds;
+    size_t bytes;
+    uint64_t retransmitted;
+    bool intact;
+
+    //How long each LATENCY_BLOCK took to show up after the one before it
+    vector<double> block_seconds;
+    rtt_stats rtt;
+
+    //Syscalls made by both ends' sockets and CPU time used by the whole
+    //process, user and system, while the data was moving.
+    uint64_t syscalls;
+    double cpu_seconds;
+
+    //Segment size the sender ended up using
+    size_t segment_size;
+};
+
+//User plus system CPU time used by this process so far
+double cpu_seconds(){
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+//A field out of /proc/self/status, in whatever units it is listed in
+static size_t proc_status(const string& field){
+    ifstream status("/proc/self/status");
+    string line;
+    while(getline(status, line)){
+        if(line.compare(0, field.size() + 1, field + ":") == 0){
+            return stoul(line.substr(field.size() + 1));
+        }
+    }
+    return 0;
+}
+
+//How many descriptors this process has open
+static size_t open_fds(){
+    size_t count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    while(dir && readdir(dir)){
+        count++;
+    }
+    if(dir){
+        closedir(dir);
+    }
+    return count > 2 ? count - 2 : 0;
+}
+
+//Move bytes of data from a server side stream to a client side stream over
+//loopback and time how long it takes for all of it to show up.
+transfer_result run_transfer(const transfer_config& c){
+    size_t bytes = c.bytes;
+
+    //The acceptor blocks until the connector shows up, so it needs a thread
+    size_t segment = c.segment_size ? c.segment_size 
+                                    : jstp_segment::DEFAULT_SEGMENT_SIZE;
+    jstp_acceptor acceptor(c.port);
+    unique_ptr<jstp_stream> server;
+    thread accept_thread([&](){
+        server.reset(new jstp_stream(acceptor, c.loss, c.window, c.mode,
+                                     c.congestion, segment));
+    });
+    jstp_connector connector("localhost", c.port, nullptr, c.checksums);
+    jstp_stream client(connector, c.loss, c.window, c.mode, c.congestion,
+                       segment);
+    accept_thread.join();
+    server->set_corruption_probability(c.corruption);
+    client.set_corruption_probability(c.corruption);
+    if(c.offload){
+        server->enable_offload();
+        client.enable_offload();
+    }
+    if(c.probe){
+        server->enable_mss_probing();
+    }
+
+    //Fill the payload with a pattern so we can tell if it arrives mangled
+    vector<uint8_t> payload(bytes);
+    for(size_t i = 0; i < bytes; i++){
+        payload[i] = i % 251;
+    }
+
+    //Send blocks until everything is acked, give it its own thread
+    uint64_t syscalls_before = server->get_syscalls() + client.get_syscalls();
+    double cpu_before = cpu_seconds();
+    auto start = std::chrono::steady_clock::now();
+    size_t send_chunk = c.send_chunk ? c.send_chunk : SEND_CHUNK;
+    thread send_thread([&](){
+        deque<future<bool>> in_flight;
+        for(size_t sent = 0; sent < bytes; sent += send_chunk){
+            size_t n = min(send_chunk, bytes - sent);
+            vector<uint8_t> chunk(payload.begin() + sent, 
+                                  payload.begin() + sent + n);
+            if(c.pipeline == 0){
+                server->send(chunk);
+                continue;
+            }
+            if(in_flight.size() == c.pipeline){
+                in_flight.front().wait();
+                in_flight.pop_front();
+            }
+            in_flight.push_back(server->send_async(std::move(chunk)));
+        }
+        server->flush();
+    });
+
+    //Wait on the client until every byte has arrived
+    transfer_result result;
+    result.bytes = 0;
+    result.intact = true;
+    auto last_block = start;
+    while(result.bytes < bytes){
+        vector<uint8_t> v = client.recv_wait(std::chrono::milliseconds(100));
+        for(size_t i = 0; i < v.size(); i++){
+            if(v[i] != (result.bytes + i) % 251){
+                result.intact = false;
+            }
+        }
+
+        //Note the time whenever another latency block is complete
+        size_t before = result.bytes / LATENCY_BLOCK;
+        result.bytes += v.size();
+        if(result.bytes / LATENCY_BLOCK != before){
+            auto now = std::chrono::steady_clock::now();
+            result.block_seconds.push_back(
+                std::chrono::duration<double>(now - last_block).count());
+            last_block = now;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    send_thread.join();
+
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    result.retransmitted = server->get_retransmitted_bytes();
+    result.rtt = server->get_rtt_stats();
+    result.syscalls = server->get_syscalls() + client.get_syscalls() - 
+                      syscalls_before;
+    result.cpu_seconds = cpu_seconds() - cpu_before;
+    result.segment_size = server->get_segment_size();
+    return result;
+}
+
+//Run several transfers side by side, each on its own port starting at the
+//configured one.
+vector<transfer_result> run_concurrent(transfer_config c, size_t flows){
+    vector<transfer_result> results(flows);
+    vector<thread> threads;
+    for(size_t i = 0; i < flows; i++){
+        transfer_config flow = c;
+        flow.port = c.port + i;
+        threads.push_back(thread([flow, i, &results](){
+            results[i] = run_transfer(flow);
+        }));
+    }
+    for(thread& t: threads){
+        t.join();
+    }
+    return results;
+}
+
+//Compare the goodput of the two recovery modes across a range of loss rates
+int bench_recovery(size_t bytes, size_t window, uint16_t port){
+    const double losses[] = {0, 0.01, 0.02, 0.05, 0.1, 0.15, 0.2};
+    const recovery_mode::Enum modes[] = {recovery_mode::GO_BACK_N,
+                                         recovery_mode::SELECTIVE_REPEAT};
+
+    cout << "Transfer of " << bytes << " bytes, window " << window << endl;
+    cout << setw(8) << "loss" << setw(28) << "go-back-n MB/s (resent kB)"
+         << setw(28) << "selective MB/s (resent kB)" << endl;
+
+    for(double loss: losses){
+        cout << setw(8) << fixed << setprecision(2) << loss;
+        for(recovery_mode::Enum mode: modes){
+            transfer_config c = {port, bytes, window, loss, mode, 
+                                 congestion_type::NONE, false};
+            transfer_result r = run_transfer(c);
+            double goodput = r.bytes / r.seconds / 1000000;
+            cout << setw(14) << setprecision(3) << goodput << setw(14) 
+                 << setprecision(1) << r.retransmitted / 1000.0;
+            if(!r.intact){
+                cout << " (corrupt!)";
+            }
+            cout.flush();
+        }
+        cout << endl;
+    }
+    return 0;
+}
+
+//Compare the congestion controllers with several flows sharing loopback.
+//Reports the aggregate goodput, how evenly the flows shared it (Jain's index,
+//1 is perfectly fair) and how much was resent.
+int bench_congestion(size_t bytes, size_t window, uint16_t port){
+    const double losses[] = {0, 0.005, 0.01, 0.02, 0.05};
+    const congestion_type::Enum types[] = {congestion_type::NONE,
+                                           congestion_type::RENO,
+                                           congestion_type::CUBIC};
+    const char* names[] = {"fixed", "reno", "cubic"};
+
+    cout << CONGESTION_FLOWS << " flows of " << bytes << " bytes, window cap " 
+         << window << ", selective repeat" << endl;
+    cout << setw(8) << "cc" << setw(8) << "loss" << setw(12) << "MB/s" 
+         << setw(10) << "fairness" << setw(10) << "resent%" << endl;
+
+    for(size_t t = 0; t < 3; t++){
+        for(double loss: losses){
+            transfer_config c = {port, bytes, window, loss, 
+                                 recovery_mode::SELECTIVE_REPEAT, types[t], 
+                                 false};
+            vector<transfer_result> rs = run_concurrent(c, CONGESTION_FLOWS);
+
+            //Aggregate over every flow
+            double longest = 0, sum = 0, sum_squares = 0, resent = 0;
+            size_t total = 0;
+            bool intact = true;
+            for(transfer_result& r: rs){
+                double goodput = r.bytes / r.seconds;
+                longest = max(longest, r.seconds);
+                sum += goodput;
+                sum_squares += goodput * goodput;
+                resent += r.retransmitted;
+                total += r.bytes;
+                intact = intact && r.intact;
+            }
+            double fairness = sum * sum / (rs.size() * sum_squares);
+
+            cout << setw(8) << names[t] << setw(8) << fixed << setprecision(3) 
+                 << loss << setw(12) << total / longest / 1000000 
+                 << setw(10) << fairness << setw(10) << setprecision(1) 
+                 << 100.0 * resent / total;
+            if(!intact){
+                cout << " (corrupt!)";
+            }
+            cout << endl;
+        }
+    }
+    return 0;
+}
+
+//Look at the worst delivery stalls in a big transfer at 1% loss. Stalls come
+//from losses which had to wait for the retransmission timer.
+int bench_tail(size_t bytes, size_t window, uint16_t port){
+    transfer_config c = {port, bytes, window, 0.01, 
+                         recovery_mode::SELECTIVE_REPEAT, 
+                         congestion_type::NONE, false};
+    transfer_result r = run_transfer(c);
+
+    vector<double> blocks = r.block_seconds;
+    sort(blocks.begin(), blocks.end());
+    auto percentile = [&](double p){
+        return blocks[min(blocks.size() - 1, (size_t)(p * blocks.size()))];
+    };
+
+    cout << "Transfer of " << bytes << " bytes, window " << window 
+         << ", 1% loss, selective repeat" << endl;
+    cout << "    Completion time = " << fixed << setprecision(3) 
+         << r.seconds << " s" << (r.intact ? "" : " (corrupt!)") << endl;
+    cout << "    Timeouts        = " << r.rtt.timeouts << endl;
+    cout << "    Latency per " << LATENCY_BLOCK << " byte block (ms):" << endl;
+    cout << "        p50 = " << percentile(0.5) * 1000 << endl;
+    cout << "        p99 = " << percentile(0.99) * 1000 << endl;
+    cout << "      p99.9 = " << percentile(0.999) * 1000 << endl;
+    cout << "        max = " << blocks.back() * 1000 << endl;
+    return 0;
+}
+
+//Push data through the whole stack with no loss to see how fast the buffers
+//and segmentation can go, and what it costs in syscalls and CPU. Runs both
+//without and with UDP segmentation offload.
+int bench_throughput(size_t bytes, size_t window, uint16_t port){
+    cout << "Transfer of " << bytes << " bytes, window " << window 
+         << ", no loss" << endl;
+    for(size_t i = 0; i < 2 * THROUGHPUT_RUNS; i++){
+        bool offload = i >= THROUGHPUT_RUNS;
+        transfer_config c = {port, bytes, window, 0, recovery_mode::GO_BACK_N,
+                             congestion_type::NONE, offload};
+        transfer_result r = run_transfer(c);
+        cout << "    Run " << i % THROUGHPUT_RUNS + 1 
+             << (offload ? " (offload): " : ":           ") << fixed 
+             << setprecision(3) 
+             << r.seconds << " s, " << r.bytes / r.seconds / 1000000 
+             << " MB/s, " << setprecision(0) 
+             << r.syscalls / (r.bytes / 1000000.0) << " syscalls/MB, " 
+             << setprecision(2) << r.cpu_seconds / (r.bytes / 1e9) 
+             << " CPU s/GB" << (r.intact ? "" : " (corrupt!)") << endl;
+    }
+    return 0;
+}
+
+//Goodput at a range of segment sizes on loopback, whose MTU is 64KiB. The last
+//row starts at the base size and lets probing find the biggest one that works.
+int bench_mss(size_t bytes, size_t window, uint16_t port){
+    const size_t sizes[] = {1200, 1472, 8972, 65000};
+
+    cout << "Transfer of " << bytes << " bytes, window " << window 
+         << ", no loss" << endl;
+    cout << setw(10) << "segment" << setw(12) << "MB/s" << setw(14) 
+         << "syscalls/MB" << endl;
+    for(size_t i = 0; i < 5; i++){
+        bool probe = i == 4;
+        transfer_config c = {port, bytes, window, 0, recovery_mode::GO_BACK_N,
+                             congestion_type::NONE, false, 
+                             probe ? sizes[3] : sizes[i], probe};
+        transfer_result r = run_transfer(c);
+        cout << setw(10) << r.segment_size << setw(12) << fixed 
+             << setprecision(3) << r.bytes / r.seconds / 1000000 
+             << setw(14) << setprecision(0) 
+             << r.syscalls / (r.bytes / 1000000.0) 
+             << (probe ? " (probed)" : "") 
+             << (r.intact ? "" : " (corrupt!)") << endl;
+    }
+    return 0;
+}
+
+//Open connections over loopback either with threads or on a reactor, see what
+//they cost sitting idle and then with every one of them moving data. Shared
+//puts the server side streams on the acceptor's socket.
+static void streams_row(size_t connections, size_t bytes, size_t window,
+                        uint16_t port, bool use_reactor, bool share){
+    unique_ptr<jstp_reactor> reactor;
+    if(use_reactor){
+        reactor.reset(new jstp_reactor());
+    }
+    size_t rss_before = proc_status("VmRSS");
+
+    //Handshakes go one at a time, so the streams line up in order on both
+    //sides.
+    vector<unique_ptr<jstp_stream>> servers(connections);
+    vector<unique_ptr<jstp_stream>> clients(connections);
+    jstp_acceptor acceptor(port, reactor.get(), share);
+    auto start = std::chrono::steady_clock::now();
+    {
+        jstp_connector connector("localhost", port, reactor.get());
+        thread accept_thread([&](){
+            for(size_t i = 0; i < connections; i++){
+                servers[i].reset(new jstp_stream(acceptor, 0, window));
+            }
+        });
+        for(size_t i = 0; i < connections; i++){
+            clients[i].reset(new jstp_stream(connector, 0, window));
+        }
+        accept_thread.join();
+    }
+    double setup = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    //Idle, nobody sends anything
+    double cpu_before = cpu_seconds();
+    std::this_thread::sleep_for(std::chrono::seconds(STREAMS_IDLE_SECONDS));
+    double idle_cpu = (cpu_seconds() - cpu_before) / STREAMS_IDLE_SECONDS;
+    size_t rss = proc_status("VmRSS") - rss_before;
+    size_t threads = proc_status("Threads");
+    size_t fds = open_fds();
+
+    //Active, every server sends bytes and every client gets them
+    vector<uint8_t> payload(bytes, 42);
+    vector<thread> senders;
+    cpu_before = cpu_seconds();
+    start = std::chrono::steady_clock::now();
+    for(size_t t = 0; t < STREAMS_SENDERS; t++){
+        senders.push_back(thread([&, t](){
+            for(size_t i = t; i < connections; i += STREAMS_SENDERS){
+                servers[i]->send(payload);
+            }
+        }));
+    }
+    for(thread& t: senders){
+        t.join();
+    }
+    size_t received = 0;
+    for(size_t i = 0; i < connections; i++){
+        size_t got = 0;
+        while(got < bytes){
+            vector<uint8_t> v = clients[i]->recv_wait(
+                std::chrono::milliseconds(100));
+            if(v.empty()){
+                break;
+            }
+            got += v.size();
+        }
+        received += got;
+    }
+    double active = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    double active_cpu = cpu_seconds() - cpu_before;
+
+    cout << setw(8) << (share ? "shared" : use_reactor ? "reactor" : "threads")
+         << setw(8) << 2 * connections << setw(9) << threads << setw(8) 
+         << fds << fixed 
+         << setprecision(2) << setw(9) << setup << setw(9) 
+         << rss / 1024.0 << setw(10) << setprecision(1) << 100 * idle_cpu 
+         << setw(9) << setprecision(2) << received / active / 1000000 
+         << setw(10) << active_cpu / (received / 1e9) 
+         << (received == bytes * connections ? "" : " (short!)") << endl;
+
+    //Both ends close at the same time so their exits cross, otherwise every
+    //close waits out its own handshake one after the other.
+    vector<thread> closers;
+    for(size_t t = 0; t < STREAMS_SENDERS; t++){
+        closers.push_back(thread([&, t](){
+            for(size_t i = t; i < connections; i += STREAMS_SENDERS){
+                clients[i].reset();
+                servers[i].reset();
+            }
+        }));
+    }
+    for(thread& t: closers){
+        t.join();
+    }
+}
+
+//Compare the cost of streams running their own threads against streams on one
+//reactor, at a single connection and at thousands.
+int bench_streams(size_t bytes, size_t window, uint16_t port){
+    //Every connection is two sockets, ask for as many descriptors as we can
+    rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    cout << bytes << " bytes per connection, window " << window 
+         << ", no loss" << endl;
+    cout << setw(8) << "mode" << setw(8) << "streams" << setw(9) << "threads"
+         << setw(8) << "fds" << setw(9) << "setup s" << setw(9) << "RSS MB" << setw(10) 
+         << "idle CPU%" << setw(9) << "MB/s" << setw(10) << "CPU s/GB" 
+         << endl;
+    for(size_t mode = 0; mode < 3; mode++){
+        bool use_reactor = mode > 0;
+        for(size_t connections: STREAMS_CONNECTIONS){
+            if(!use_reactor && connections > STREAMS_THREADED_LIMIT){
+                cout << setw(8) << "threads" << setw(8) << 2 * connections 
+                     << setw(9) << 4 * connections << "  skipped" << endl;
+                continue;
+            }
+            streams_row(connections, bytes, window, port, use_reactor, 
+                        mode == 2);
+        }
+    }
+    return 0;
+}
+
+//Split the server side between several workers listening on the same port,
+//each on its own core with its own reactor and a socket its streams all share.
+//The clients run on one more reactor and the kernel decides which worker each
+//of them gets.
+int bench_workers(size_t bytes, size_t window, uint16_t port){
+    cout << WORKERS_CLIENTS << " clients of " << bytes << " bytes, window " 
+         << window << ", " << thread::hardware_concurrency() << " cores"
+         << endl;
+    cout << setw(8) << "workers" << setw(10) << "MB/s" << setw(10) 
+         << "CPU s/GB" << setw(16) << "clients/worker" << endl;
+    vector<uint8_t> payload(bytes, 42);
+    for(size_t workers: WORKER_COUNTS){
+        //Each worker sends to everyone it accepts until it accepts a client
+        //after we are done, then waits for its sends and quits
+        atomic<bool> done(false);
+        vector<size_t> accepted(workers, 0);
+        vector<thread> worker_threads;
+        for(size_t w = 0; w < workers; w++){
+            worker_threads.push_back(thread([&, w](){
+                pin_to_core(w);
+                jstp_reactor reactor;
+                jstp_acceptor acceptor(port, &reactor, true, true);
+                vector<thread> senders;
+                while(true){
+                    shared_ptr<jstp_stream> stream(
+                        new jstp_stream(acceptor, 0, window));
+                    if(done.load()){
+                        break;
+                    }
+                    accepted[w]++;
+                    senders.push_back(thread([stream, &payload](){
+                        stream->send(payload);
+                    }));
+                }
+                for(thread& t: senders){
+                    t.join();
+                }
+            }));
+        }
+
+        //Everyone connects, then reads until they have it all
+        jstp_reactor client_reactor;
+        jstp_connector connector("localhost", port, &client_reactor);
+        vector<unique_ptr<jstp_stream>> clients(WORKERS_CLIENTS);
+        vector<size_t> received(WORKERS_CLIENTS, 0);
+        double cpu_before = cpu_seconds();
+        auto start = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < WORKERS_CLIENTS; i++){
+            clients[i].reset(new jstp_stream(connector, 0, window));
+        }
+        vector<thread> receivers;
+        for(size_t t = 0; t < STREAMS_SENDERS; t++){
+            receivers.push_back(thread([&, t](){
+                for(size_t i = t; i < WORKERS_CLIENTS; i += STREAMS_SENDERS){
+                    while(received[i] < bytes){
+                        vector<uint8_t> v = clients[i]->recv_wait(
+                            std::chrono::milliseconds(1000));
+                        if(v.empty()){
+                            break;
+                        }
+                        received[i] += v.size();
+                    }
+                }
+            }));
+        }
+        for(thread& t: receivers){
+            t.join();
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        double cpu = cpu_seconds() - cpu_before;
+        size_t total = 0;
+        for(size_t r: received){
+            total += r;
+        }
+        clients.clear();
+
+        //Every worker takes exactly one more client and quits. One that
+        //lands on a worker which already quit is resent until the kernel
+        //gives it to one still listening.
+        done.store(true);
+        for(size_t w = 0; w < workers; w++){
+            jstp_stream last(connector, 0, window);
+        }
+        for(thread& t: worker_threads){
+            t.join();
+        }
+
+        auto spread = std::minmax_element(accepted.begin(), accepted.end());
+        cout << setw(8) << workers << setw(10) << fixed << setprecision(2) 
+             << total / seconds / 1000000 << setw(10) 
+             << cpu / (total / 1e9) << setw(10) << *spread.first << " - " 
+             << *spread.second 
+             << (total == bytes * WORKERS_CLIENTS ? "" : " (short!)") << endl;
+    }
+    return 0;
+}
+
+//Goodput of the same transfer sent a chunk at a time, with and without
+//waiting for each chunk to be acked before handing over the next.
+int bench_pipeline(size_t bytes, size_t window, uint16_t port){
+    const double losses[] = {0, 0.01};
+
+    cout << "Transfer of " << bytes << " bytes, window " << window 
+         << ", " << PIPELINE_DEPTH << " async sends in flight" << endl;
+    cout << setw(10) << "chunk" << setw(8) << "loss" << setw(16) 
+         << "blocking MB/s" << setw(16) << "async MB/s" << endl;
+    for(size_t chunk: PIPELINE_CHUNKS){
+        for(double loss: losses){
+            cout << setw(10) << chunk << setw(8) << fixed << setprecision(2) 
+                 << loss;
+            for(size_t depth: {(size_t)0, PIPELINE_DEPTH}){
+                transfer_config c = {port, bytes, window, loss, 
+                                     recovery_mode::SELECTIVE_REPEAT,
+                                     congestion_type::NONE, false, 0, false,
+                                     chunk, depth};
+                transfer_result r = run_transfer(c);
+                cout << setw(16) << setprecision(3) 
+                     << r.bytes / r.seconds / 1000000;
+                if(!r.intact){
+                    cout << " (corrupt!)";
+                }
+                cout.flush();
+            }
+            cout << endl;
+        }
+    }
+    return 0;
+}
+
+//Write bytes of the usual pattern to a new file in /tmp, returns its path.
+//Written a block at a time, the file can be bigger than memory.
+static string make_temp_file(size_t bytes){
+    char path[] = "/tmp/jstp_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        return "";
+    }
+    const size_t block = 251 * 65536;
+    vector<uint8_t> payload(block);
+    for(size_t i = 0; i < block; i++){
+        payload[i] = i % 251;
+    }
+    size_t total = 0;
+    while(total < bytes){
+        ssize_t written = write(fd, payload.data(), min(block, bytes - total));
+        if(written <= 0){
+            break;
+        }
+        total += written;
+    }
+    close(fd);
+    return total == bytes ? path : "";
+}
+
+//Reads straight out of memory, for handing part of a mapping to the file
+//layer as if it was a file which ends early
+struct memory_buf: std::streambuf{
+    memory_buf(const uint8_t* data, size_t n){
+        char* start = (char*)data;
+        setg(start, start, start + n);
+    }
+};
+
+//Fetch one file with its ranges split between more and more streams. The
+//server side hands out ranges of the mapped file over as many streams as
+//connect, until one connects after we are done.
+int bench_stripes(size_t bytes, size_t window, uint16_t port){
+    string source = make_temp_file(bytes);
+    shared_ptr<mapped_file> file = mapped_file::open(source);
+    if(!file){
+        cerr << "Could not make a file to fetch" << endl;
+        return 1;
+    }
+    string output = source + ".out";
+
+    cout << "Fetch of " << bytes << " bytes, window " << window << endl;
+    cout << setw(8) << "streams";
+    for(double loss: STRIPE_LOSSES){
+        cout << setw(10) << fixed << setprecision(0) << loss * 100 
+             << "% MB/s" << setw(10) << "speedup";
+    }
+    cout << endl;
+
+    vector<double> base(sizeof(STRIPE_LOSSES) / sizeof(double), 0);
+    for(size_t stripes: STRIPE_COUNTS){
+        cout << setw(8) << stripes;
+        for(size_t l = 0; l < base.size(); l++){
+            double loss = STRIPE_LOSSES[l];
+            atomic<bool> done(false);
+            thread server_thread([&](){
+                jstp_reactor reactor;
+                jstp_acceptor acceptor(port, &reactor);
+                vector<thread> servers;
+                while(true){
+                    shared_ptr<jstp_stream> stream(
+                        new jstp_stream(acceptor, loss, window));
+                    if(done.load()){
+                        break;
+                    }
+                    servers.push_back(thread([stream, &file](){
+                        incoming_message req;
+                        while(req.recv(*stream)){
+                            uint64_t offset = 0, range = file->size();
+                            req.get_offset(offset);
+                            req.get_range(range);
+                            offset = min(offset, file->size());
+                            range = min(range, file->size() - offset);
+                            outgoing_message data_msg;
+                            data_msg.set_action(action_type::DATA);
+                            data_msg.set_offset(offset);
+                            data_msg.set_size(file->size());
+                            data_msg.send_file(*stream, file, offset, range);
+                        }
+                    }));
+                }
+                for(thread& t: servers){
+                    t.join();
+                }
+            });
+
+            uint64_t length = 0;
+            auto start = std::chrono::steady_clock::now();
+            fetch_status::Enum status = striped_fetch("localhost", port, 
+                                                      source, output, 
+                                                      stripes, window, loss,
+                                                      length);
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+
+            done.store(true);
+            {
+                jstp_connector connector("localhost", port);
+                jstp_stream last(connector, 0, window);
+            }
+            server_thread.join();
+
+            //Make sure every stripe landed where it should have
+            shared_ptr<mapped_file> fetched = mapped_file::open(output);
+            bool intact = status == fetch_status::DONE && fetched && 
+                          fetched->size() == bytes &&
+                          std::equal(file->data(), file->data() + bytes, 
+                                     fetched->data());
+            double goodput = length / seconds / 1000000;
+            if(stripes == STRIPE_COUNTS[0]){
+                base[l] = goodput;
+            }
+            cout << setw(16) << setprecision(2) << goodput << setw(10) 
+                 << goodput / base[l] << (intact ? "" : " (corrupt!)");
+            cout.flush();
+        }
+        cout << endl;
+    }
+    unlink(source.c_str());
+    unlink(output.c_str());
+    return 0;
+}
+
+//Fetch a file whose first connection is cut off part way through, then fetch
+//it again either from scratch or from the checkpoint. The server side answers
+//requests like the real one, except the first reply stops short and closes.
+int bench_resume(size_t bytes, size_t window, uint16_t port){
+    string source = make_temp_file(bytes);
+    shared_ptr<mapped_file> file = mapped_file::open(source);
+    if(!file){
+        cerr << "Could not make a file to fetch" << endl;
+        return 1;
+    }
+    string output = source + ".out";
+
+    cout << "Fetch of " << bytes << " bytes, window " << window 
+         << ", cut off at " << RESUME_CUT * 100 << "%" << endl;
+    cout << setw(12) << "" << setw(10) << "seconds" << setw(14) 
+         << "MB sent" << setw(10) << "MB/s" << endl;
+
+    const char* names[] = {"no cut", "start over", "resume"};
+    for(size_t row = 0; row < 3; row++){
+        checkpoint(output).remove();
+        unlink(output.c_str());
+
+        atomic<bool> done(false);
+        atomic<uint64_t> sent(0);
+        thread server_thread([&](){
+            jstp_reactor reactor;
+            jstp_acceptor acceptor(port, &reactor);
+            bool cut = row > 0;
+            while(true){
+                jstp_stream stream(acceptor, 0, window);
+                if(done.load()){
+                    break;
+                }
+                incoming_message req;
+                if(!req.recv(stream)){
+                    continue;
+                }
+                uint64_t offset = 0, expected;
+                req.get_offset(offset);
+                if(req.get_size(expected) && expected != file->size()){
+                    offset = 0;
+                }
+                offset = min(offset, file->size());
+                uint64_t length = file->size() - offset;
+                outgoing_message data_msg;
+                data_msg.set_action(action_type::DATA);
+                data_msg.set_offset(offset);
+                data_msg.set_size(file->size());
+
+                //The cut one says the whole thing is coming, sends up to
+                //the cut and hangs up
+                if(cut){
+                    cut = false;
+                    size_t upto = bytes * RESUME_CUT;
+                    memory_buf buf(file->data() + offset, upto - offset);
+                    istream in(&buf);
+                    data_msg.send_file(stream, in, length);
+                    stream.flush();
+                    sent += upto - offset;
+                    continue;
+                }
+                data_msg.send_file(stream, file, offset, length);
+                sent += length;
+            }
+        });
+
+        //Keep fetching until it works, starting over means losing the
+        //checkpoint in between
+        jstp_connector connector("localhost", port);
+        auto start = std::chrono::steady_clock::now();
+        fetch_status::Enum status = fetch_status::FAILED;
+        for(size_t attempt = 0; attempt < 2 && 
+            status != fetch_status::DONE; attempt++){
+            if(row == 1){
+                checkpoint(output).remove();
+            }
+            jstp_stream stream(connector, 0, window);
+            uint64_t length, resumed;
+            status = resumable_fetch(stream, source, output, length, resumed);
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+
+        done.store(true);
+        {
+            jstp_stream last(connector, 0, window);
+        }
+        server_thread.join();
+
+        shared_ptr<mapped_file> fetched = mapped_file::open(output);
+        bool intact = status == fetch_status::DONE && fetched && 
+                      fetched->size() == bytes &&
+                      std::equal(file->data(), file->data() + bytes, 
+                                 fetched->data());
+        cout << setw(12) << names[row] << setw(10) << fixed 
+             << setprecision(2) << seconds << setw(14) << sent / 1000000 
+             << setw(10) << bytes / seconds / 1000000
+             << (intact ? "" : " (corrupt!)") << endl;
+    }
+    checkpoint(output).remove();
+    unlink(source.c_str());
+    unlink(output.c_str());
+    return 0;
+}
+
+//Write an old and a new version of a pseudo random file, the new one with
+//about DELTA_CHANGED of its blocks scribbled on
+static bool make_versions(const string& old_path, const string& new_path,
+                          size_t bytes){
+    uint32_t block = delta_encoder::block_size(bytes);
+    FILE* old_file = fopen(old_path.c_str(), "wb");
+    FILE* new_file = fopen(new_path.c_str(), "wb");
+    bool ok = old_file && new_file;
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    auto next = [&](){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    vector<uint8_t> data(block);
+    for(size_t pos = 0; ok && pos < bytes; pos += block){
+        size_t n = min((size_t)block, bytes - pos);
+        for(size_t i = 0; i < n; i += 8){
+            uint64_t word = next();
+            memcpy(data.data() + i, &word, min((size_t)8, n - i));
+        }
+        ok = fwrite(data.data(), 1, n, old_file) == n;
+        if(next() % 10000 < DELTA_CHANGED * 10000){
+            for(size_t i = 0; i < min(n, (size_t)64); i++){
+                data[i] ^= 0x5A;
+            }
+        }
+        ok = ok && fwrite(data.data(), 1, n, new_file) == n;
+    }
+    if(old_file){
+        fclose(old_file);
+    }
+    if(new_file){
+        fclose(new_file);
+    }
+    return ok;
+}
+
+//Update a client's old copy of a file to the new version, once by fetching
+//the whole new version and once by sending signatures and getting a delta.
+//The server side answers like the real one does.
+int bench_delta(size_t bytes, size_t window, uint16_t port){
+    char base[] = "/tmp/jstp_bench_XXXXXX";
+    int fd = mkstemp(base);
+    if(fd >= 0){
+        close(fd);
+    }
+    string old_path = string(base) + ".old";
+    string new_path = string(base) + ".new";
+    string full_path = string(base) + ".full";
+    if(fd < 0 || !make_versions(old_path, new_path, bytes)){
+        cerr << "Could not make the files to sync" << endl;
+        return 1;
+    }
+    shared_ptr<mapped_file> file = mapped_file::open(new_path);
+
+    cout << "Update of a " << bytes << " byte file with " 
+         << DELTA_CHANGED * 100 << "% of its " 
+         << delta_encoder::block_size(bytes) << " byte blocks changed, window "
+         << window << endl;
+    cout << setw(8) << "" << setw(14) << "MB on wire" << setw(10) 
+         << "seconds" << setw(10) << "CPU s" << endl;
+
+    const char* names[] = {"full", "delta"};
+    for(size_t row = 0; row < 2; row++){
+        thread server_thread([&](){
+            jstp_acceptor acceptor(port);
+            jstp_stream stream(acceptor, 0, window);
+            incoming_message req;
+            if(!req.recv(stream)){
+                return;
+            }
+            outgoing_message data_msg;
+            data_msg.set_action(action_type::DATA);
+            delta_encoder encoder(req.get_data());
+            if(req.get_delta() && encoder.valid()){
+                encoder.plan(file->data(), file->size());
+                data_msg.set_delta();
+                data_msg.set_size(file->size());
+                data_msg.send_header(stream, encoder.length());
+                encoder.send(stream, file->data());
+                return;
+            }
+            data_msg.send_file(stream, file);
+        });
+
+        jstp_connector connector("localhost", port);
+        double cpu_before = cpu_seconds();
+        auto start = std::chrono::steady_clock::now();
+        uint64_t length = 0, wire = 0, resumed;
+        fetch_status::Enum status;
+        {
+            jstp_stream stream(connector, 0, window);
+            if(row == 0){
+                status = resumable_fetch(stream, new_path, full_path, length,
+                                         resumed);
+                wire = length;
+            }
+            else{
+                status = delta_fetch(stream, new_path, old_path, length, 
+                                     wire);
+            }
+        }
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        double cpu = cpu_seconds() - cpu_before;
+        server_thread.join();
+
+        shared_ptr<mapped_file> fetched = mapped_file::open(
+            row == 0 ? full_path : old_path);
+        bool intact = status == fetch_status::DONE && fetched && 
+                      fetched->size() == bytes &&
+                      std::equal(file->data(), file->data() + bytes, 
+                                 fetched->data());
+        cout << setw(8) << names[row] << setw(14) << fixed 
+             << setprecision(2) << wire / 1000000.0 << setw(10) << seconds 
+             << setw(10) << cpu << (intact ? "" : " (corrupt!)") << endl;
+    }
+    unlink(base);
+    unlink(old_path.c_str());
+    unlink(new_path.c_str());
+    unlink(full_path.c_str());
+    return 0;
+}
+
+//Time one of the kernels over CHECKSUM_KERNEL_BYTES in buffers of size bytes,
+//returns GB/s
+static double kernel_speed(uint32_t (*kernel)(uint32_t, const uint8_t*, 
+                                              size_t),
+                           const vector<uint8_t>& buffer){
+    size_t reps = max(CHECKSUM_KERNEL_BYTES / buffer.size(), (size_t)1);
+    uint32_t crc = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < reps; i++){
+        crc ^= kernel(0, buffer.data(), buffer.size());
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    //Use the answer so the loop can't go anywhere
+    if(crc == 0x12345678){
+        cout << "";
+    }
+    return reps * buffer.size() / seconds / 1e9;
+}
+
+//Time the CRC32C kernels on their own, then see what checking every segment
+//costs a lossless transfer at a small and a big segment size. Each transfer is
+//the best of a few runs. Last, corrupt some of the segments on the way in,
+//with checksums they are dropped and resent like any other loss.
+int bench_checksum(size_t bytes, size_t window, uint16_t port){
+    bool hardware = crc32c_hardware();
+    cout << "CRC32C over " << CHECKSUM_KERNEL_BYTES << " bytes, SSE4.2 " 
+         << (hardware ? "available" : "not available") << endl;
+    cout << setw(10) << "buffer" << setw(14) << "table GB/s" << setw(14) 
+         << "SSE4.2 GB/s" << endl;
+    for(size_t size: CHECKSUM_BUFFERS){
+        vector<uint8_t> buffer(size);
+        for(size_t i = 0; i < size; i++){
+            buffer[i] = i * 2654435761u >> 13;
+        }
+        cout << setw(10) << size << setw(14) << fixed << setprecision(2) 
+             << kernel_speed(crc32c_table, buffer);
+        if(hardware){
+            cout << setw(14) << kernel_speed(crc32c_sse42, buffer);
+        }
+        cout << endl;
+    }
+    cout << endl;
+
+    cout << "Transfer of " << bytes << " bytes, window " << window 
+         << ", no loss, best of " << THROUGHPUT_RUNS << endl;
+    cout << setw(10) << "segment" << setw(14) << "plain MB/s" << setw(14) 
+         << "checked MB/s" << setw(10) << "cost" << endl;
+    for(size_t segment: {(size_t)1472, (size_t)65000}){
+        double best[2] = {0, 0};
+        bool intact = true;
+        for(size_t i = 0; i < 2 * THROUGHPUT_RUNS; i++){
+            bool checked = i % 2;
+            transfer_config c = {port, bytes, window, 0, 
+                                 recovery_mode::GO_BACK_N, 
+                                 congestion_type::NONE, false, segment, false,
+                                 0, 0, checked, 0};
+            transfer_result r = run_transfer(c);
+            best[checked] = max(best[checked], r.bytes / r.seconds / 1e6);
+            intact = intact && r.intact;
+        }
+        cout << setw(10) << segment << setw(14) << fixed << setprecision(2) 
+             << best[0] << setw(14) << best[1] << setw(9) 
+             << setprecision(1) << (1 - best[1] / best[0]) * 100 << "%" 
+             << (intact ? "" : " (corrupt!)") << endl;
+    }
+    cout << endl;
+
+    cout << "Same transfer at 1472 byte segments with " 
+         << CHECKSUM_CORRUPTION * 100 << "% of segments lost vs corrupted, "
+         << "selective repeat" << endl;
+    for(bool corrupt: {false, true}){
+        transfer_config c = {port, bytes, window, 
+                             corrupt ? 0 : CHECKSUM_CORRUPTION,
+                             recovery_mode::SELECTIVE_REPEAT, 
+                             congestion_type::NONE, false, 1472, false, 0, 0, 
+                             true, corrupt ? CHECKSUM_CORRUPTION : 0};
+        transfer_result r = run_transfer(c);
+        cout << setw(14) << (corrupt ? "corrupted: " : "lost: ") << fixed 
+             << setprecision(2) << r.bytes / r.seconds / 1e6 << " MB/s, " 
+             << r.retransmitted / 1e6 << " MB resent, " 
+             << (r.intact ? "arrived intact" : "arrived corrupt!") << endl;
+    }
+    return 0;
+}
+
+//A file in /tmp of either log lines or random bytes, returns its path. The
+//log lines come from a handful of templates with random numbers filled in so
+//they compress about as well as a real log does.
+static string make_compress_file(size_t bytes, bool text){
+    char path[] = "/tmp/jstp_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        return "";
+    }
+    const char* levels[] = {"INFO", "INFO", "WARN", "DEBUG"};
+    const char* verbs[] = {"served", "cached", "sent", "dropped"};
+    uint64_t state = 88172645463325252ull;
+    auto next = [&state](){
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    size_t total = 0;
+    string buffer;
+    while(total < bytes){
+        buffer.clear();
+        while(buffer.size() < 1000000){
+            if(!text){
+                uint64_t word = next();
+                buffer.append((const char*)&word, sizeof(word));
+                continue;
+            }
+            char line[200];
+            uint64_t r = next();
+            snprintf(line, sizeof(line), "2026-10-17 %02u:%02u:%02u.%03u %s "
+                     "worker-%u %s /files/artifact-%u.tar to 10.0.%u.%u in "
+                     "%u ms\n", (unsigned)(r % 24), (unsigned)(r >> 8) % 60,
+                     (unsigned)(r >> 16) % 60, (unsigned)(r >> 24) % 1000,
+                     levels[r >> 34 & 3], (unsigned)(r >> 36 & 7),
+                     verbs[r >> 39 & 3], (unsigned)(r >> 41 & 511),
+                     (unsigned)(r >> 50 & 255), (unsigned)(r >> 42 & 255),
+                     (unsigned)(r >> 52 & 2047));
+            buffer.append(line);
+        }
+        size_t n = min(buffer.size(), bytes - total);
+        if(write(fd, buffer.data(), n) != (ssize_t)n){
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    return total == bytes ? path : "";
+}
+
+//Fetch a text and a random file with the server sending the body as it is and
+//as compressed blocks. The server side answers like the real one, except it
+//only compresses when it is told to.
+int bench_compress(size_t bytes, size_t window, uint16_t port){
+    cout << "Fetch of " << bytes << " bytes, window " << window 
+         << ", no loss" << endl;
+    cout << setw(8) << "input" << setw(12) << "body" << setw(10) << "MB/s" 
+         << setw(14) << "MB on wire" << setw(8) << "ratio" << setw(10) 
+         << "CPU s" << endl;
+    for(bool text: {true, false}){
+        string source = make_compress_file(bytes, text);
+        shared_ptr<mapped_file> file = mapped_file::open(source);
+        if(!file){
+            cerr << "Could not make a file to fetch" << endl;
+            return 1;
+        }
+        string output = source + ".out";
+        for(bool compressed: {false, true}){
+            thread server_thread([&](){
+                jstp_acceptor acceptor(port);
+                jstp_stream stream(acceptor, 0, window);
+                incoming_message req;
+                if(!req.recv(stream)){
+                    return;
+                }
+                outgoing_message data_msg;
+                data_msg.set_action(action_type::DATA);
+                data_msg.set_digest();
+                if(compressed && req.get_compressed()){
+                    data_msg.set_compressed();
+                }
+                data_msg.send_file(stream, file);
+            });
+
+            jstp_connector connector("localhost", port);
+            double cpu_before = cpu_seconds();
+            auto start = std::chrono::steady_clock::now();
+            bool complete = false;
+            uint64_t wire = 0;
+            {
+                jstp_stream stream(connector, 0, window);
+                outgoing_message request;
+                request.set_action(action_type::REQUEST);
+                request.set_filename(source);
+                request.set_digest();
+                request.set_compressed();
+                request.send(stream);
+
+                incoming_message response;
+                int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 
+                              0644);
+                complete = fd >= 0 && response.recv_header(stream) &&
+                           response.recv_body(stream, fd, 0);
+                wire = response.get_wire_length();
+                if(fd >= 0){
+                    close(fd);
+                }
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            double cpu = cpu_seconds() - cpu_before;
+            server_thread.join();
+
+            shared_ptr<mapped_file> fetched = mapped_file::open(output);
+            bool intact = complete && fetched && fetched->size() == bytes &&
+                          std::equal(file->data(), file->data() + bytes, 
+                                     fetched->data());
+            cout << setw(8) << (text ? "text" : "random") << setw(12) 
+                 << (compressed ? "compressed" : "plain") << setw(10) 
+                 << fixed << setprecision(2) << bytes / seconds / 1e6 
+                 << setw(14) << wire / 1e6 << setw(8) 
+                 << (double)bytes / wire << setw(10) << cpu 
+                 << (intact ? "" : " (corrupt!)") << endl;
+        }
+        unlink(source.c_str());
+        unlink(output.c_str());
+    }
+    return 0;
+}
+
+//Minor page faults taken by this process so far, every page of a mapping
+//touched for the first time is one
+static uint64_t minor_faults(){
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+//Pull files over and over from a server which either maps the file for every
+//request like the real one does without a cache, or gets it from a cache. The
+//last row alternates between two files with only room for one of them in the
+//cache, so every pull misses and evicts the other.
+int bench_cache(size_t bytes, size_t window, uint16_t port){
+    string first = make_temp_file(bytes);
+    string second = make_temp_file(bytes);
+    if(first.empty() || second.empty()){
+        cerr << "Could not make the files to pull" << endl;
+        return 1;
+    }
+
+    cout << CACHE_PULLS << " pulls of " << bytes << " bytes, window " 
+         << window << ", " << CACHE_SEGMENT << " byte segments" << endl;
+    cout << setw(12) << "server" << setw(6) << "pull" << setw(10) << "MB/s" 
+         << setw(14) << "page faults" << setw(10) << "CPU s" << endl;
+
+    const char* names[] = {"map", "cache", "two files"};
+    for(size_t row = 0; row < 3; row++){
+        unique_ptr<file_cache> cache;
+        if(row > 0){
+            cache.reset(new file_cache(bytes + bytes / 2));
+        }
+        for(size_t pull = 0; pull < CACHE_PULLS; pull++){
+            string path = row == 2 && pull % 2 ? second : first;
+            thread server_thread([&](){
+                jstp_acceptor acceptor(port);
+                jstp_stream stream(acceptor, 0, window, 
+                                   recovery_mode::GO_BACK_N, 
+                                   congestion_type::NONE, CACHE_SEGMENT);
+                incoming_message req;
+                if(!req.recv(stream)){
+                    return;
+                }
+                shared_ptr<mapped_file> file = cache ? 
+                    cache->get(req.get_filename()) : 
+                    mapped_file::open(req.get_filename());
+                outgoing_message data_msg;
+                data_msg.set_action(action_type::DATA);
+                data_msg.set_digest();
+                data_msg.send_file(stream, file);
+            });
+
+            jstp_connector connector("localhost", port);
+            uint64_t faults_before = minor_faults();
+            double cpu_before = cpu_seconds();
+            auto start = std::chrono::steady_clock::now();
+            bool intact = false;
+            {
+                jstp_stream stream(connector, 0, window, 
+                                   recovery_mode::GO_BACK_N, 
+                                   congestion_type::NONE, CACHE_SEGMENT);
+                outgoing_message request;
+                request.set_action(action_type::REQUEST);
+                request.set_filename(path);
+                request.set_digest();
+                request.send(stream);
+
+                //Nothing is kept, the digest says whether it all made it
+                incoming_message response;
+                discard_buffer nothing;
+                ostream discard(&nothing);
+                intact = response.recv_header(stream) && 
+                         response.get_length() == bytes &&
+                         response.recv_body(stream, discard);
+            }
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+            double cpu = cpu_seconds() - cpu_before;
+            uint64_t faults = minor_faults() - faults_before;
+            server_thread.join();
+
+            cout << setw(12) << names[row] << setw(6) << pull + 1 << setw(10)
+                 << fixed << setprecision(2) << bytes / seconds / 1e6 
+                 << setw(14) << faults << setw(10) << cpu 
+                 << (intact ? "" : " (corrupt!)") << endl;
+        }
+        if(cache){
+            cout << setw(12) << "" << "  cache " << cache->get_stats().str() 
+                 << endl;
+        }
+    }
+    unlink(first.c_str());
+    unlink(second.c_str());
+    return 0;
+}
+
+//Connect with some SYN-ACKs lost on the way to the client, the server has to
+//notice and send it again or the client never gets going. Then the server
+//sends bytes and the client answers with its own to show both ways work.
+static bool handshake_row(size_t drops, size_t bytes, size_t window, 
+                          uint16_t port, bool use_reactor, bool share){
+    unique_ptr<jstp_reactor> reactor;
+    if(use_reactor){
+        reactor.reset(new jstp_reactor());
+    }
+    jstp_acceptor acceptor(port, reactor.get(), share);
+    jstp_connector connector("localhost", port, reactor.get());
+    connector.drop_synacks(drops);
+
+    //A hang can't be cancelled, the row runs on its own thread so we can at
+    //least say so and quit.
+    std::promise<bool> done;
+    future<bool> result = done.get_future();
+    double connect = 0;
+    thread row_thread([&](){
+        unique_ptr<jstp_stream> server;
+        thread accept_thread([&](){
+            server.reset(new jstp_stream(acceptor, 0, window));
+        });
+        auto start = std::chrono::steady_clock::now();
+        jstp_stream client(connector, 0, window);
+        connect = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        accept_thread.join();
+
+        server->send(vector<uint8_t>(bytes, 42));
+        size_t got = 0;
+        while(got < bytes){
+            vector<uint8_t> v = client.recv_wait(std::chrono::seconds(1));
+            if(v.empty()){
+                break;
+            }
+            got += v.size();
+        }
+        client.send(vector<uint8_t>(bytes, 7));
+        size_t answered = 0;
+        while(answered < bytes){
+            vector<uint8_t> v = server->recv_wait(std::chrono::seconds(1));
+            if(v.empty()){
+                break;
+            }
+            answered += v.size();
+        }
+        done.set_value(got == bytes && answered == bytes);
+    });
+    if(result.wait_for(std::chrono::seconds(HANDSHAKE_TIMEOUT_SECONDS)) != 
+       std::future_status::ready){
+        cout << setw(8) << (share ? "shared" : use_reactor ? "reactor" 
+                                                           : "threads")
+             << setw(8) << drops << "  hung!" << endl;
+        _exit(1);
+    }
+    row_thread.join();
+    bool ok = result.get();
+    cout << setw(8) << (share ? "shared" : use_reactor ? "reactor" : "threads")
+         << setw(8) << drops << setw(12) << fixed << setprecision(3) 
+         << connect << (ok ? "" : " (short!)") << endl;
+    return ok;
+}
+
+int bench_handshake(size_t bytes, size_t window, uint16_t port){
+    cout << "Connect and send " << bytes << " bytes each way, window " 
+         << window << endl;
+    cout << setw(8) << "streams" << setw(8) << "lost" << setw(12) 
+         << "connect s" << endl;
+    bool ok = true;
+    for(size_t mode = 0; mode < 3; mode++){
+        for(size_t drops: HANDSHAKE_DROPS){
+            ok = handshake_row(drops, bytes, window, port++, mode > 0, 
+                               mode == 2) && ok;
+        }
+    }
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        cerr << "Usage: " << argv[0] 
+             << " recovery|congestion|tail|throughput|mss|streams|workers|"
+             << "pipeline|stripes|resume|delta|checksum|compress|cache|"
+             << "handshake "
+             << "[bytes] [window] [port]" << endl;
+        return 1;
+    }
+    string which(argv[1]);
+
+    //Optional numeric arguments shared by the benchmarks
+    size_t bytes = DEFAULT_BYTES;
+    size_t window = DEFAULT_WINDOW;
+    uint16_t port = DEFAULT_PORT;
+    try{
+        if(argc > 2) bytes = stoul(argv[2]);
+        if(argc > 3) window = stoul(argv[3]);
+        if(argc > 4) port = stoul(argv[4]);
+    }
+    catch(std::logic_error& e){
+        cerr << "Could not parse the benchmark arguments" << endl;
+        return 1;
+    }
+
+    if(which == "recovery"){
+        return bench_recovery(bytes, window, port);
+    }
+    if(which == "congestion"){
+        return bench_congestion(bytes, window, port);
+    }
+    if(which == "tail"){
+        return bench_tail(argc > 2 ? bytes : TAIL_BYTES, window, port);
+    }
+    if(which == "mss"){
+        return bench_mss(argc > 2 ? bytes : THROUGHPUT_BYTES, 
+                         argc > 3 ? window : MSS_WINDOW, port);
+    }
+    if(which == "throughput"){
+        return bench_throughput(argc > 2 ? bytes : THROUGHPUT_BYTES, window, 
+                                port);
+    }
+
+    if(which == "streams"){
+        return bench_streams(argc > 2 ? bytes : STREAMS_BYTES, window, port);
+    }
+
+    if(which == "workers"){
+        return bench_workers(argc > 2 ? bytes : WORKERS_BYTES, window, port);
+    }
+
+    if(which == "pipeline"){
+        return bench_pipeline(argc > 2 ? bytes : PIPELINE_BYTES, window, 
+                              port);
+    }
+
+    if(which == "stripes"){
+        return bench_stripes(argc > 2 ? bytes : STRIPES_BYTES, window, port);
+    }
+
+    if(which == "resume"){
+        return bench_resume(argc > 2 ? bytes : RESUME_BYTES, window, port);
+    }
+
+    if(which == "delta"){
+        return bench_delta(argc > 2 ? bytes : DELTA_BYTES, window, port);
+    }
+    if(which == "checksum"){
+        return bench_checksum(argc > 2 ? bytes : THROUGHPUT_BYTES, 
+                              argc > 3 ? window : MSS_WINDOW, port);
+    }
+    if(which == "compress"){
+        return bench_compress(argc > 2 ? bytes : COMPRESS_BYTES, 
+                              argc > 3 ? window : MSS_WINDOW, port);
+    }
+    if(which == "cache"){
+        return bench_cache(argc > 2 ? bytes : CACHE_BYTES, 
+                           argc > 3 ? window : MSS_WINDOW, port);
+    }
+    if(which == "handshake"){
+        return bench_handshake(argc > 2 ? bytes : HANDSHAKE_BYTES, window, 
+                               port);
+    }
+
+    cerr << "Unknown benchmark \"" << which << "\"" << endl;
+    return 1;
+}
@@ -1,7 +1,7 @@
 #include <iostream>
 using std::cout; using std::cerr; using std::endl;
 #include <fstream>
-using std::ofstream;
+using std::ifstream;
 #include <string>
 using std::string; using std::stoi; using std::stod;
 //INSERT POINT
@@ -10,15 +10,20 @@ using std::string; using std::stoi; using std::stod;
 //My headers for reliable data transfer and for file transfer
 #include "file_layer.hpp"
 #include "jstp_streams.hpp"
+#include "striped_fetch.hpp"
+#include "resumable_fetch.hpp"
+#include "delta_sync.hpp"
 
 //Main function for the client
 int main(int argc, char* argv[]){
-    //Receives the parameters sender_hostname, sender_portnumber, filename
+    //Receives the parameters sender_hostname, sender_portnumber, filename,
+    //window, loss and optionally how many streams to split the file between,
+    //which congestion controller to use and how to recover lost segments
 
     //The first step is checking for errors in the user's input.
     //Check that the number of args received is correct
-    if(argc != 6){
-        cerr << "Expected five args, Received " << argc -1 << endl;
+    if(argc < 6 || argc > 9){
+        cerr << "Expected five to eight args, Received " << argc -1 << endl;
         return 1;
     }
 
@@ -80,71 +85,143 @@ int main(int argc, char* argv[]){
     //TODO make this handle error cases
     double prob_loss = 0;
     prob_loss = stod(argv[5]); 
+
+    //One stream with a fixed window unless we are told otherwise
+    int stripes = 1;
+    congestion_type::Enum congestion = congestion_type::NONE;
+    string congestion_name;
+    recovery_mode::Enum recovery = recovery_mode::GO_BACK_N;
+    string recovery_name;
+    for(int i = 6; i < argc; i++){
+        string option(argv[i]);
+        if(option.compare(0, 9, "recovery=") == 0){
+            recovery_name = option.substr(9);
+            if(parse_recovery_mode(recovery_name, recovery)){
+                continue;
+            }
+            cerr << "The argument \"" << option << "\" should be "
+                 << "\"recovery=\" and one of go-back-n or selective" << endl;
+            cerr << "Exiting with status code 1" << endl;
+            return 1;
+        }
+        if(option.compare(0, 11, "congestion=") == 0){
+            congestion_name = option.substr(11);
+            if(parse_congestion_type(congestion_name, congestion)){
+                continue;
+            }
+            cerr << "The argument \"" << option << "\" should be "
+                 << "\"congestion=\" and one of fixed, reno or cubic" << endl;
+            cerr << "Exiting with status code 1" << endl;
+            return 1;
+        }
+        try{
+            stripes = stoi(option); 
+        }
+        catch(const std::logic_error& e){
+            stripes = 0;
+        }
+        if(stripes < 1){
+            cerr << "The argument \"" << option 
+                 << "\" should be a number of streams, at least one" << endl;
+            cerr << "Exiting with status code 1" << endl;
+            return 1;
+        }
+    }
     
     //Print a message to the user summarizing their intent
     cout << "You have requested that I use the following information." << endl;
     cout << "    Sender Hostname: " << sender_hostname << endl;
     cout << "    Sender Port    : " << sender_portnum << endl;
     cout << "    Filename       : " << filename << endl;
+    if(stripes > 1){
+        cout << "    Streams        : " << stripes << endl;
+    }
+    if(congestion != congestion_type::NONE){
+        cout << "    Congestion     : " << congestion_name << endl;
+    }
+    if(recovery != recovery_mode::GO_BACK_N){
+        cout << "    Recovery       : " << recovery_name << endl;
+    }
     cout << endl;
 
+    //Split between several streams the striped fetch does it all, each stream
+    //writes its own part of the file.
+    if(stripes > 1){
+        cout << "Attempting to fetch the file over " << stripes 
+             << " streams..." << endl;
+        uint64_t length = 0;
+        fetch_status::Enum status = striped_fetch(sender_hostname, 
+                                                  sender_portnum, filename,
+                                                  filename, stripes, window,
+                                                  prob_loss, length, 
+                                                  congestion, recovery);
+        if(status == fetch_status::DENIED){
+            cout << "Sorry. The server said that it didn't have that file." 
+                 << endl;
+            cout << "Exiting." << endl;
+            return 1;
+        }
+        if(status != fetch_status::DONE){
+            cerr << "The file could not be fetched all the way through" 
+                 << endl;
+            return 1;
+        }
+        cout << "The file was sucessfully received, " << length 
+             << " bytes, and was written to the filesystem. Exiting." << endl;
+        return 0;
+    }
+
     //Establish a connection with the server
     cout << "Attempting to establish a connection..." << endl;
     jstp_connector connector(sender_hostname, sender_portnum);
-    jstp_stream stream(connector, prob_loss, window);      //TODO make this lose some packets
+    jstp_stream stream(connector, prob_loss, window, recovery, congestion);
     cout << "    ... connection established." << endl << endl;
 
-    //Craft the request message
-    cout << "Attempting to send a request message" << endl;
-    outgoing_message request;
-    request.set_action(action_type::REQUEST);
-    request.set_filename(filename);
-
-    //Send the request message over the stream
-    request.send(stream);
-    cout << "... request message sent." << endl << endl;
-
-
-    //Get a response message back
-    cout << "Attempting to get a response back..." << endl;
-    incoming_message response;
-    response.recv(stream);
-    cout << "    ... response received." << endl << endl;
+    //Ask for the file and write it out as it arrives. If an earlier run left
+    //a checkpoint behind we only ask for whatever it didn't get. Otherwise,
+    //if we already have a whole copy of the file from before, we only ask
+    //for what changed. Failing both the file is written from the start.
+    cout << "Attempting to fetch the file..." << endl;
+    uint64_t length = 0;
+    uint64_t resumed = 0;
+    uint64_t checkpoint_size, checkpoint_offset;
+    bool have_checkpoint = checkpoint(filename).load(checkpoint_size, 
+                                                     checkpoint_offset);
+    fetch_status::Enum status;
+    if(!have_checkpoint && stream.get_binary_framing() && 
+       ifstream(filename).good()){
+        uint64_t wire = 0;
+        status = delta_fetch(stream, filename, filename, length, wire);
+        if(status == fetch_status::DONE){
+            cout << "    ... updated the copy we already had, " << wire 
+                 << " bytes went over the wire for " << length 
+                 << " bytes of file." << endl;
+        }
+    }
+    else{
+        status = resumable_fetch(stream, filename, filename, length, resumed);
+    }
 
     //If the response is a DENY message
-    if(response.get_action() == action_type::DENY){
+    if(status == fetch_status::DENIED){
         //Then print an error and exit.
         cout << "Sorry. The server said that it didn't have that file." << endl;
         cout << "Exiting." << endl;
         return 1;
     }
-
-    //If that wasn't the case but they also aren't sending data...
-    else if(response.get_action() != action_type::DATA){
-        //...I (the programmer) did something wrong. 
-        cerr << "Hey there buddy, this shoudn't happen!" << endl;
+    if(status != fetch_status::DONE){
+        cerr << "The file didn't arrive all the way through. Run the same "
+                "command again to pick up where this left off." << endl;
         return 1;
     }
-
-    //Now we know that they sent us the file we wanted. 
-    //Lets open a file on our system so we can save it. Open it in trunc mode to
-    //discard the file's current contents if it already exists.
-    ofstream ofs;
-    ofs.open(filename, std::ios::trunc);
-
-    //If the file failed to open...
-    if(!ofs.is_open()){
-        //Print an error message and exit
-        cerr << "Error: Data was received from the server but no local file "
-                "could be opened to save the data. Check the permissions of "
-                "any existing files of the same name and try again." << endl; 
-        return 1;
+    if(resumed > 0){
+        cout << "    ... picked up where the last attempt stopped, at byte " 
+             << resumed << " of " << length << "." << endl;
     }
+    cout << "    ... file received." << endl << endl;
 
-    //Alright, we now have an open file. All we have to do is extract our data
-    //into it and then close.
-    response.extract_data(ofs);
-    ofs.close();
+    //Report how the round trip times looked over the connection
+    cout << stream.get_rtt_stats().str() << endl;
 
     //We are done! print a message telling the user.
     cout << "The file was sucessfully received and was written "
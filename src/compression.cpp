@@ -0,0 +1,219 @@
+/* Implementation of the codecs defined in compression.hpp */
+
+#include "compression.hpp"
+
+//STL
+#include <vector>
+using std::vector;
+#include <memory>
+using std::unique_ptr;
+#include <algorithm>
+using std::min;
+
+//Cstd
+#include <cstring>
+
+const size_t lz_codec::MIN_MATCH;
+const size_t lz_codec::MAX_OFFSET;
+const size_t lz_codec::HASH_BITS;
+
+unique_ptr<block_codec> make_block_codec(codec_type::Enum type){
+    if(type == codec_type::LZ){
+        return unique_ptr<block_codec>(new lz_codec());
+    }
+    return nullptr;
+}
+
+codec_type::Enum lz_codec::type(){
+    return codec_type::LZ;
+}
+
+static uint32_t read_32(const uint8_t* p){
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+//Fibonacci hashing, the top bits of the product are the best mixed
+static size_t hash_32(uint32_t value){
+    return (value * 2654435761u) >> (32 - lz_codec::HASH_BITS);
+}
+
+//A length which didn't fit in its four bits carries on in bytes of 255 and
+//then whatever is left.
+static void put_length(vector<uint8_t>& out, size_t length){
+    while(length >= 255){
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(length);
+}
+
+//One sequence, the literals from start and then a match unless this is the
+//last one
+static void put_sequence(vector<uint8_t>& out, const uint8_t* literals,
+                         size_t literal_length, size_t offset,
+                         size_t match_length, bool last){
+    size_t match_code = last ? 0 : match_length - lz_codec::MIN_MATCH;
+    out.push_back((min(literal_length, (size_t)15) << 4) |
+                  min(match_code, (size_t)15));
+    if(literal_length >= 15){
+        put_length(out, literal_length - 15);
+    }
+    out.insert(out.end(), literals, literals + literal_length);
+    if(last){
+        return;
+    }
+    out.push_back(offset & 0xFF);
+    out.push_back(offset >> 8);
+    if(match_code >= 15){
+        put_length(out, match_code - 15);
+    }
+}
+
+bool lz_codec::compress(const uint8_t* data, size_t n, vector<uint8_t>& out,
+                        size_t limit){
+    //Positions are stored one up so zero means nothing has been seen yet
+    vector<uint32_t> table(1 << HASH_BITS, 0);
+    size_t start = out.size();
+    size_t pos = 0;
+    size_t anchor = 0;
+    size_t misses = 0;
+    while(n >= MIN_MATCH && pos <= n - MIN_MATCH){
+        if(out.size() - start >= limit){
+            return false;
+        }
+        uint32_t word = read_32(data + pos);
+        size_t slot = hash_32(word);
+        size_t candidate = table[slot];
+        table[slot] = pos + 1;
+        if(candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+           read_32(data + candidate - 1) != word){
+            //Every 64 misses in a row we start skipping one more byte
+            pos += 1 + (misses++ >> 6);
+            continue;
+        }
+        candidate--;
+        size_t length = MIN_MATCH;
+        while(pos + length < n && data[candidate + length] ==
+                                  data[pos + length]){
+            length++;
+        }
+        put_sequence(out, data + anchor, pos - anchor, pos - candidate,
+                     length, false);
+        pos += length;
+        anchor = pos;
+        misses = 0;
+    }
+    put_sequence(out, data + anchor, n - anchor, 0, 0, true);
+    return out.size() - start < limit;
+}
+
+//Read the rest of a length which didn't fit in its four bits
+static bool get_length(const uint8_t*& in, const uint8_t* end,
+                       size_t& length){
+    while(true){
+        if(in == end){
+            return false;
+        }
+        uint8_t more = *in++;
+        length += more;
+        if(more != 255){
+            return true;
+        }
+    }
+}
+
+bool lz_codec::decompress(const uint8_t* in, size_t n, uint8_t* out,
+                          size_t out_size){
+    const uint8_t* end = in + n;
+    uint8_t* op = out;
+    uint8_t* out_end = out + out_size;
+    while(in < end){
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !get_length(in, end, literals)){
+            return false;
+        }
+        if((size_t)(end - in) < literals ||
+           (size_t)(out_end - op) < literals){
+            return false;
+        }
+        memcpy(op, in, literals);
+        in += literals;
+        op += literals;
+        if(in == end){
+            break;
+        }
+
+        //Then the match, which can overlap what it is writing so it goes a
+        //byte at a time
+        if(end - in < 2){
+            return false;
+        }
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if(length == 15 && !get_length(in, end, length)){
+            return false;
+        }
+        length += MIN_MATCH;
+        if(offset == 0 || offset > (size_t)(op - out) ||
+           (size_t)(out_end - op) < length){
+            return false;
+        }
+        const uint8_t* match = op - offset;
+        for(size_t i = 0; i < length; i++){
+            op[i] = match[i];
+        }
+        op += length;
+    }
+    return op == out_end;
+}
+
+//32 bit values, most significant byte first
+static void put_bytes(vector<uint8_t>& out, uint32_t value){
+    for(size_t i = 4; i > 0; i--){
+        out.push_back((value >> (8 * (i - 1))) & 0xFF);
+    }
+}
+
+static uint32_t get_bytes(const uint8_t* in){
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+           (uint32_t)in[2] << 8 | in[3];
+}
+
+vector<uint8_t> compressed_block::encode(block_codec* codec,
+                                         const vector<uint8_t>& data){
+    vector<uint8_t> out;
+    out.reserve(HEADER_SIZE + data.size());
+    out.resize(HEADER_SIZE);
+    size_t limit = data.size() - data.size() / MIN_SAVING;
+    codec_type::Enum type = codec_type::RAW;
+    if(codec && data.size() > 0 &&
+       codec->compress(data.data(), data.size(), out, limit)){
+        type = codec->type();
+    }
+    else{
+        out.resize(HEADER_SIZE);
+        out.insert(out.end(), data.begin(), data.end());
+    }
+    vector<uint8_t> header;
+    header.push_back(type);
+    put_bytes(header, data.size());
+    put_bytes(header, out.size() - HEADER_SIZE);
+    std::copy(header.begin(), header.end(), out.begin());
+    return out;
+}
+
+//A block can't store more than it holds, or hold more than a block
+bool compressed_block::parse_header(const uint8_t* in, codec_type::Enum& type,
+                                    uint32_t& length, uint32_t& stored){
+    type = (codec_type::Enum)in[0];
+    length = get_bytes(in + 1);
+    stored = get_bytes(in + 5);
+    if(length > BLOCK_SIZE || stored > length){
+        return false;
+    }
+    return type != codec_type::RAW || stored == length;
+}
@@ -0,0 +1,92 @@
+/* This file defines the codecs file bodies can be compressed with on their way
+ * over a stream. A compressed body is cut into blocks which are compressed on
+ * their own, so several of them can be worked on at once and the receiver
+ * never has to hold more than one.
+ *
+ * Each block is an 8 bit codec type, a 32 bit length of the data it holds, a
+ * 32 bit length of what is stored and then the stored bytes, in network byte
+ * order. A block which didn't get any smaller is stored as it is with the RAW
+ * type, so a body never gets much bigger than the data in it.
+ *
+ * Codecs are interchangeable, new ones only need to inherit from block_codec,
+ * get a type of their own and be added to the factory. The only one so far is
+ * LZ, a byte oriented LZ77 in the style of LZ4 which goes for speed over
+ * ratio. Its blocks are a run of sequences, each a token byte whose high four
+ * bits are the number of literals and low four bits the match length less
+ * four, 15 in either meaning more bytes of length follow (each added on, 255
+ * meaning yet another). Then the literals, then a 16 bit little endian offset
+ * back to where the match starts. The last sequence is only literals.
+ */
+
+#pragma once
+
+//STL includes
+#include <vector>
+#include <memory>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//The codecs a block can be stored with, the values are what goes on the wire
+namespace codec_type{
+    enum Enum{RAW = 'R', LZ = 'Z'};
+};
+
+//Interface all codecs implement
+class block_codec{
+    public:
+        virtual ~block_codec(){}
+
+        //Compress n bytes onto the end of out. Gives up and returns false as
+        //soon as it is clear the result won't come in under limit bytes.
+        virtual bool compress(const uint8_t*, size_t n,
+                              std::vector<uint8_t>& out, size_t limit) = 0;
+
+        //Decompress n bytes into out, which has to come out exactly out_size
+        //bytes long. False if the data doesn't make sense.
+        virtual bool decompress(const uint8_t*, size_t n, uint8_t* out,
+                                size_t out_size) = 0;
+
+        virtual codec_type::Enum type() = 0;
+};
+
+//Factory, null for RAW or anything we don't know about
+std::unique_ptr<block_codec> make_block_codec(codec_type::Enum);
+
+//Matches are found through a hash table of the last place each four bytes
+//were seen, and only within MAX_OFFSET of each other. Data which isn't finding
+//matches is skipped through faster and faster.
+class lz_codec: public block_codec{
+    public:
+        static const size_t MIN_MATCH = 4;
+        static const size_t MAX_OFFSET = 65535;
+        static const size_t HASH_BITS = 14;
+
+        bool compress(const uint8_t*, size_t n, std::vector<uint8_t>& out,
+                      size_t limit);
+        bool decompress(const uint8_t*, size_t n, uint8_t* out,
+                        size_t out_size);
+        codec_type::Enum type();
+};
+
+//Putting blocks together and taking them apart
+namespace compressed_block{
+    //Bodies are cut into blocks this big, the last one can be shorter
+    static const size_t BLOCK_SIZE = 1048576;
+    static const size_t HEADER_SIZE = 9;
+
+    //A block has to save at least this fraction of its size to be worth
+    //storing compressed
+    static const size_t MIN_SAVING = 16;
+
+    //The whole block for the data, compressed with codec if it is worth it
+    //and codec isn't null
+    std::vector<uint8_t> encode(block_codec* codec,
+                                const std::vector<uint8_t>& data);
+
+    //Read a block header, false if it can't be right. Length is how much data
+    //the block holds and stored how many bytes follow the header.
+    bool parse_header(const uint8_t*, codec_type::Enum& type,
+                      uint32_t& length, uint32_t& stored);
+};
@@ -0,0 +1,222 @@
+/* Implementation of the functions defined in crc32c.hpp */
+
+#include "crc32c.hpp"
+
+//Cstd
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//The Castagnoli polynomial, bit reversed since the CRC is run least
+//significant bit first
+static const uint32_t POLY = 0x82F63B78;
+
+//The hardware CRC runs three LONG byte pieces side by side at a time, then
+//three SHORT ones, then whatever is left one run at a time.
+static const size_t LONG = 8192;
+static const size_t SHORT = 256;
+
+//Multiply a 32x32 matrix over GF(2) by a vector, each word of the matrix is a
+//column.
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vec){
+    uint32_t sum = 0;
+    while(vec){
+        if(vec & 1){
+            sum ^= *matrix;
+        }
+        vec >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* matrix){
+    for(size_t n = 0; n < 32; n++){
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+//Every table the CRCs use, built the first time they are needed. Slicing has
+//a table per byte of the eight, slice[0] is the plain byte at a time table.
+//The shift tables take a CRC to what it would be after LONG or SHORT more
+//zero bytes, a byte of the CRC at a time.
+struct crc_tables{
+    uint32_t slice[8][256];
+    uint32_t long_shift[4][256];
+    uint32_t short_shift[4][256];
+    crc_tables();
+    void build_shift(uint32_t shift[4][256], size_t zeros);
+};
+
+crc_tables::crc_tables(){
+    for(uint32_t n = 0; n < 256; n++){
+        uint32_t crc = n;
+        for(size_t k = 0; k < 8; k++){
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        slice[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; n++){
+        uint32_t crc = slice[0][n];
+        for(size_t k = 1; k < 8; k++){
+            crc = slice[0][crc & 0xFF] ^ (crc >> 8);
+            slice[k][n] = crc;
+        }
+    }
+    build_shift(long_shift, LONG);
+    build_shift(short_shift, SHORT);
+}
+
+//Appending zeros to a CRC is linear, so it is a matrix. The matrix for one zero
+//bit is squared over and over to get the one for zeros bytes, which has to be
+//a power of two. Then it gets split into a table for each byte of the CRC.
+void crc_tables::build_shift(uint32_t shift[4][256], size_t zeros){
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = POLY;
+    for(size_t n = 1; n < 32; n++){
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);      //two zero bits
+    gf2_square(odd, even);      //four zero bits
+    const uint32_t* op = odd;
+    while(true){
+        gf2_square(even, odd);
+        op = even;
+        zeros >>= 1;
+        if(zeros == 0){
+            break;
+        }
+        gf2_square(odd, even);
+        op = odd;
+        zeros >>= 1;
+        if(zeros == 0){
+            break;
+        }
+    }
+    for(uint32_t n = 0; n < 256; n++){
+        shift[0][n] = gf2_times(op, n);
+        shift[1][n] = gf2_times(op, n << 8);
+        shift[2][n] = gf2_times(op, n << 16);
+        shift[3][n] = gf2_times(op, n << 24);
+    }
+}
+
+static const crc_tables& tables(){
+    static crc_tables built;
+    return built;
+}
+
+static uint32_t shift_crc(const uint32_t shift[4][256], uint32_t crc){
+    return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^
+           shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+}
+
+//Slicing by eight. The bytes are put together by hand so it comes out the
+//same whatever order the machine keeps them in.
+uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t n){
+    const uint32_t (*slice)[256] = tables().slice;
+    crc = ~crc;
+    while(n > 0 && ((uintptr_t)data & 7) != 0){
+        crc = slice[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        n--;
+    }
+    while(n >= 8){
+        crc ^= (uint32_t)data[0] | (uint32_t)data[1] << 8 |
+               (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24;
+        crc = slice[7][crc & 0xFF] ^ slice[6][(crc >> 8) & 0xFF] ^
+              slice[5][(crc >> 16) & 0xFF] ^ slice[4][crc >> 24] ^
+              slice[3][data[4]] ^ slice[2][data[5]] ^
+              slice[1][data[6]] ^ slice[0][data[7]];
+        data += 8;
+        n -= 8;
+    }
+    while(n > 0){
+        crc = slice[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+        n--;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+//Three runs of size bytes each, side by side, combined into one. The crc32
+//instruction takes three cycles but a new one can start every cycle.
+__attribute__((target("sse4.2")))
+static uint64_t sse42_triple(uint64_t crc0, const uint8_t* data, size_t size,
+                             const uint32_t shift[4][256]){
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const uint8_t* end = data + size;
+    uint64_t word0, word1, word2;
+    while(data < end){
+        memcpy(&word0, data, 8);
+        memcpy(&word1, data + size, 8);
+        memcpy(&word2, data + 2 * size, 8);
+        crc0 = _mm_crc32_u64(crc0, word0);
+        crc1 = _mm_crc32_u64(crc1, word1);
+        crc2 = _mm_crc32_u64(crc2, word2);
+        data += 8;
+    }
+    crc0 = shift_crc(shift, crc0) ^ crc1;
+    return shift_crc(shift, crc0) ^ crc2;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t n){
+    const crc_tables& t = tables();
+    uint64_t crc0 = ~crc;
+    while(n > 0 && ((uintptr_t)data & 7) != 0){
+        crc0 = _mm_crc32_u8(crc0, *data++);
+        n--;
+    }
+    while(n >= 3 * LONG){
+        crc0 = sse42_triple(crc0, data, LONG, t.long_shift);
+        data += 3 * LONG;
+        n -= 3 * LONG;
+    }
+    while(n >= 3 * SHORT){
+        crc0 = sse42_triple(crc0, data, SHORT, t.short_shift);
+        data += 3 * SHORT;
+        n -= 3 * SHORT;
+    }
+    uint64_t word;
+    while(n >= 8){
+        memcpy(&word, data, 8);
+        crc0 = _mm_crc32_u64(crc0, word);
+        data += 8;
+        n -= 8;
+    }
+    while(n > 0){
+        crc0 = _mm_crc32_u8(crc0, *data++);
+        n--;
+    }
+    return ~(uint32_t)crc0;
+}
+
+bool crc32c_hardware(){
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+//No crc32 instruction to be had
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t n){
+    return crc32c_table(crc, data, n);
+}
+
+bool crc32c_hardware(){
+    return false;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t n){
+    static const bool hardware = crc32c_hardware();
+    if(hardware){
+        return crc32c_sse42(crc, data, n);
+    }
+    return crc32c_table(crc, data, n);
+}
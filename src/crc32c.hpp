@@ -0,0 +1,27 @@
+/* This file defines CRC32C, the 32 bit CRC with the Castagnoli polynomial. It
+ * is what checks segments and whole files for corruption, it catches more than
+ * the ones' complement sum UDP uses and x86 has an instruction for it.
+ *
+ * With SSE4.2 the CRC is run eight bytes at a time by the crc32 instruction,
+ * three runs side by side so the instruction's latency is hidden, and the
+ * three CRCs are combined with tables which shift a CRC past a run of zeros.
+ * Anything else gets slicing by eight, eight table lookups per eight bytes.
+ * Which one is used is decided once, the first time a CRC is run.
+ */
+
+#pragma once
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//Extend crc with n more bytes of data, starting from zero. Running it over the
+//pieces of something one after another gives the same answer as running it
+//over the whole thing at once.
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t n);
+
+//The two ways of doing it, crc32c picks one. The hardware one can only be used
+//if crc32c_hardware says so, these are mostly here for the benchmark.
+uint32_t crc32c_table(uint32_t crc, const uint8_t* data, size_t n);
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t n);
+bool crc32c_hardware();
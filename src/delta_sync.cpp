@@ -0,0 +1,458 @@
+/* Implementation of the classes and function defined in delta_sync.hpp */
+
+#include "delta_sync.hpp"
+#include "file_layer.hpp"
+#include "mapped_file.hpp"
+#include "crc32c.hpp"
+
+//Posix
+#include <fcntl.h>
+#include <unistd.h>
+
+//STL
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <deque>
+using std::deque;
+#include <future>
+using std::future;
+#include <memory>
+using std::shared_ptr;
+#include <iostream>
+using std::ostream;
+#include <algorithm>
+using std::min; using std::max; using std::sort;
+#include <cmath>
+#include <cstring>
+
+const uint32_t delta_encoder::MIN_BLOCK;
+const uint32_t delta_encoder::MAX_BLOCK;
+const uint32_t delta_encoder::MAX_LITERAL;
+const uint8_t delta_encoder::COPY;
+const uint8_t delta_encoder::LITERAL;
+const size_t delta_encoder::FILTER_BITS;
+
+//Write the low n bytes of value to the end of out, most significant first
+static void put_bytes(vector<uint8_t>& out, uint64_t value, size_t n){
+    for(size_t i = n; i > 0; i--){
+        out.push_back((value >> (8 * (i - 1))) & 0xFF);
+    }
+}
+
+//Read an n byte value written by put_bytes
+static uint64_t get_bytes(const uint8_t* in, size_t n){
+    uint64_t value = 0;
+    for(size_t i = 0; i < n; i++){
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+//The rsync weak checksum, two 16 bit sums. The first is the sum of the bytes
+//and the second the sum of the first after each byte. Kept unmasked while
+//rolling since the low 16 bits come out the same.
+struct weak_sum{
+    uint32_t a;
+    uint32_t b;
+    uint32_t value(){
+        return (a & 0xFFFF) | (b << 16);
+    }
+};
+
+//Eight bytes at a time where we can, every byte adds itself to the first sum
+//and then to the second once for each byte after it in the group.
+static weak_sum weak_checksum(const uint8_t* data, uint32_t n){
+    weak_sum sum = {0, 0};
+    uint32_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        const uint8_t* x = data + i;
+        sum.b += 8 * sum.a + 8 * x[0] + 7 * x[1] + 6 * x[2] + 5 * x[3] + 
+                 4 * x[4] + 3 * x[5] + 2 * x[6] + x[7];
+        sum.a += x[0] + x[1] + x[2] + x[3] + x[4] + x[5] + x[6] + x[7];
+    }
+    for(; i < n; i++){
+        sum.a += data[i];
+        sum.b += sum.a;
+    }
+    return sum;
+}
+
+//Slide the window one byte, out leaves the front and in joins the back
+static void roll(weak_sum& sum, uint8_t out, uint8_t in, uint32_t n){
+    sum.a += in - out;
+    sum.b += sum.a - n * out;
+}
+
+//Strong enough to tell blocks apart when the weak checksum can't, nobody is
+//trying to fool it. Eight bytes at a time, mixed the way murmur does it.
+static uint64_t strong_hash(const uint8_t* data, uint32_t n){
+    const uint64_t m1 = 0x87C37B91114253D5ULL;
+    const uint64_t m2 = 0x4CF5AD432745937FULL;
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ n;
+    uint32_t i = 0;
+    for(; i + 8 <= n; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word *= m1;
+        word = (word << 31) | (word >> 33);
+        h ^= word * m2;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+    }
+    uint64_t tail = 0;
+    for(; i < n; i++){
+        tail = (tail << 8) | data[i];
+    }
+    h ^= tail * m1;
+
+    //Finish off so every bit of input touches every bit of output
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint32_t delta_encoder::block_size(uint64_t file_size){
+    uint64_t root = sqrt((double)file_size);
+    root = max((uint64_t)MIN_BLOCK, min((uint64_t)MAX_BLOCK, root));
+    return root & ~(uint64_t)1023;
+}
+
+vector<uint8_t> delta_encoder::signatures(const uint8_t* data, uint64_t size){
+    uint32_t block = block_size(size);
+    vector<uint8_t> out;
+    out.reserve(4 + size / block * 12);
+    put_bytes(out, block, 4);
+    for(uint64_t pos = 0; pos + block <= size; pos += block){
+        put_bytes(out, weak_checksum(data + pos, block).value(), 4);
+        put_bytes(out, strong_hash(data + pos, block), 8);
+    }
+    return out;
+}
+
+delta_encoder::delta_encoder(const vector<uint8_t>& signatures):
+        block(0), ok(false), filter((1 << FILTER_BITS) / 64, 0),
+        encoded_length(0), literal_total(0){
+    if(signatures.size() < 4 || (signatures.size() - 4) % 12 != 0){
+        return;
+    }
+    block = get_bytes(signatures.data(), 4);
+    if(block < MIN_BLOCK || block > MAX_BLOCK){
+        return;
+    }
+    size_t count = (signatures.size() - 4) / 12;
+    sorted.resize(count);
+    for(size_t i = 0; i < count; i++){
+        const uint8_t* entry = signatures.data() + 4 + i * 12;
+        sorted[i].weak = get_bytes(entry, 4);
+        sorted[i].index = i;
+        sorted[i].strong = get_bytes(entry + 4, 8);
+        strongs.push_back(sorted[i].strong);
+        size_t slot = filter_slot(sorted[i].weak);
+        filter[slot / 64] |= (uint64_t)1 << (slot % 64);
+    }
+    sort(sorted.begin(), sorted.end(),
+         [](const signature& l, const signature& r){
+             return l.weak < r.weak || (l.weak == r.weak && l.index < r.index);
+         });
+    ok = true;
+}
+
+bool delta_encoder::valid(){
+    return ok;
+}
+
+size_t delta_encoder::filter_slot(uint32_t weak){
+    return (weak * 2654435761u) >> (32 - FILTER_BITS);
+}
+
+bool delta_encoder::match(const uint8_t* window, uint32_t weak, uint32_t next,
+                          uint32_t& index){
+    size_t slot = filter_slot(weak);
+    if(!(filter[slot / 64] & ((uint64_t)1 << (slot % 64)))){
+        return false;
+    }
+    auto first = std::lower_bound(sorted.begin(), sorted.end(), weak,
+        [](const signature& s, uint32_t w){ return s.weak < w; });
+    if(first == sorted.end() || first->weak != weak){
+        return false;
+    }
+    uint64_t strong = strong_hash(window, block);
+    bool found = false;
+    for(auto it = first; it != sorted.end() && it->weak == weak; it++){
+        if(it->strong != strong){
+            continue;
+        }
+        if(!found || it->index == next){
+            index = it->index;
+            found = true;
+        }
+    }
+    return found;
+}
+
+//Slide along the file a byte at a time until the window matches a block, then
+//jump over the block. Whatever got slid past on the way is a literal.
+void delta_encoder::plan(const uint8_t* data, uint64_t size){
+    steps.clear();
+    uint64_t pos = 0;
+    uint64_t literal_start = 0;
+    weak_sum sum = {0, 0};
+    bool fresh = true;
+    while(ok && !sorted.empty() && pos + block <= size){
+        //Straight after a match the next block is the likely one, most of an
+        //unchanged file goes by without ever needing the weak checksum.
+        uint32_t next = steps.empty() ? 0 :
+                        steps.back().first + steps.back().count;
+        uint32_t index = next;
+        bool found = false;
+        if(fresh){
+            found = next < strongs.size() && 
+                    strong_hash(data + pos, block) == strongs[next];
+            if(!found){
+                sum = weak_checksum(data + pos, block);
+                fresh = false;
+            }
+        }
+        if(found || match(data + pos, sum.value(), next, index)){
+            //Runs of blocks in order stick together
+            if(!steps.empty() && pos == literal_start &&
+               steps.back().count > 0 && index == next){
+                steps.back().count++;
+            }
+            else{
+                steps.push_back(step{literal_start, pos - literal_start,
+                                     index, 1});
+            }
+            pos += block;
+            literal_start = pos;
+            fresh = true;
+            continue;
+        }
+        if(pos + block < size){
+            roll(sum, data[pos], data[pos + block], block);
+        }
+        pos++;
+    }
+    if(literal_start < size){
+        steps.push_back(step{literal_start, size - literal_start, 0, 0});
+    }
+
+    //Work out how long all of that is going to be once written down
+    encoded_length = 0;
+    literal_total = 0;
+    for(const step& s: steps){
+        if(s.literal_length > 0){
+            uint64_t pieces = (s.literal_length + MAX_LITERAL - 1) /
+                              MAX_LITERAL;
+            encoded_length += pieces * 5 + s.literal_length;
+            literal_total += s.literal_length;
+        }
+        if(s.count > 0){
+            encoded_length += 9;
+        }
+    }
+}
+
+uint64_t delta_encoder::length(){
+    return encoded_length;
+}
+
+uint64_t delta_encoder::literal_bytes(){
+    return literal_total;
+}
+
+//Written down a chunk at a time and kept in flight like a file is, the
+//first chunk which never gets acked means the stream closed and we stop.
+bool delta_encoder::send(jstp_stream& stream, const uint8_t* data){
+    deque<future<bool>> in_flight;
+    vector<uint8_t> chunk;
+    auto send_chunk = [&](){
+        if(in_flight.size() == file_message::PIPELINE_CHUNKS){
+            if(!in_flight.front().get()){
+                return false;
+            }
+            in_flight.pop_front();
+        }
+        in_flight.push_back(stream.send_async(std::move(chunk)));
+        chunk = vector<uint8_t>();
+        return true;
+    };
+    for(const step& s: steps){
+        for(uint64_t done = 0; done < s.literal_length; done += MAX_LITERAL){
+            uint64_t n = min((uint64_t)MAX_LITERAL, s.literal_length - done);
+            chunk.push_back(LITERAL);
+            put_bytes(chunk, n, 4);
+            const uint8_t* start = data + s.literal_start + done;
+            chunk.insert(chunk.end(), start, start + n);
+            if(chunk.size() >= file_message::CHUNK_SIZE && !send_chunk()){
+                return false;
+            }
+        }
+        if(s.count > 0){
+            chunk.push_back(COPY);
+            put_bytes(chunk, s.first, 4);
+            put_bytes(chunk, s.count, 4);
+            if(chunk.size() >= file_message::CHUNK_SIZE && !send_chunk()){
+                return false;
+            }
+        }
+    }
+    if(!chunk.empty() && !send_chunk()){
+        return false;
+    }
+    return stream.flush();
+}
+
+delta_decoder::delta_decoder(const uint8_t* basis_in, uint64_t basis_size_in,
+                             uint32_t block_in, int fd_in):
+        basis(basis_in), basis_size(basis_size_in), block(block_in),
+        fd(fd_in), failed(false), offset(0), copied(0), crc(0), 
+        literal_left(0){
+}
+
+bool delta_decoder::ok(){
+    return !failed && literal_left == 0 && instruction.empty();
+}
+
+uint64_t delta_decoder::written(){
+    return offset;
+}
+
+uint64_t delta_decoder::reused(){
+    return copied;
+}
+
+uint32_t delta_decoder::digest(){
+    return crc;
+}
+
+//Write n bytes to the end of the new file
+bool delta_decoder::put(const uint8_t* data, uint64_t n){
+    crc = crc32c(crc, data, n);
+    while(n > 0){
+        ssize_t done = pwrite(fd, data, n, offset);
+        if(done <= 0){
+            return false;
+        }
+        data += done;
+        n -= done;
+        offset += done;
+    }
+    return true;
+}
+
+//Instructions can be split anywhere between pieces, they are put back
+//together a byte at a time. There aren't many of them next to the data.
+std::streamsize delta_decoder::xsputn(const char* s, std::streamsize count){
+    const uint8_t* data = (const uint8_t*)s;
+    uint64_t n = count;
+    while(n > 0 && !failed){
+        if(literal_left > 0){
+            uint64_t take = min(literal_left, n);
+            failed = !put(data, take);
+            literal_left -= take;
+            data += take;
+            n -= take;
+            continue;
+        }
+
+        instruction.push_back(*data++);
+        n--;
+        uint8_t type = instruction[0];
+        if(type == delta_encoder::LITERAL && instruction.size() == 5){
+            literal_left = get_bytes(instruction.data() + 1, 4);
+            instruction.clear();
+        }
+        else if(type == delta_encoder::COPY && instruction.size() == 9){
+            uint64_t start = get_bytes(instruction.data() + 1, 4) * block;
+            uint64_t length = get_bytes(instruction.data() + 5, 4) * block;
+            failed = start + length > basis_size ||
+                     !put(basis + start, length);
+            copied += length;
+            instruction.clear();
+        }
+        else if(type != delta_encoder::LITERAL &&
+                type != delta_encoder::COPY){
+            failed = true;
+        }
+    }
+    return failed ? 0 : count;
+}
+
+std::streambuf::int_type delta_decoder::overflow(int_type c){
+    if(c == traits_type::eof()){
+        return traits_type::not_eof(c);
+    }
+    char byte = c;
+    return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+}
+
+fetch_status::Enum delta_fetch(jstp_stream& stream, const string& filename,
+                               const string& path, uint64_t& length,
+                               uint64_t& wire){
+    shared_ptr<mapped_file> basis = mapped_file::open(path);
+    if(!basis){
+        return fetch_status::FAILED;
+    }
+    uint32_t block = delta_encoder::block_size(basis->size());
+
+    outgoing_message request;
+    request.set_action(action_type::REQUEST);
+    request.set_filename(filename);
+    request.set_delta();
+    request.set_digest();
+    request.set_compressed();
+    vector<uint8_t> signatures = delta_encoder::signatures(basis->data(),
+                                                           basis->size());
+    request.set_data(signatures);
+    request.send(stream);
+
+    incoming_message response;
+    if(!response.recv_header(stream)){
+        return fetch_status::FAILED;
+    }
+    if(response.get_action() == action_type::DENY){
+        return fetch_status::DENIED;
+    }
+    if(response.get_action() != action_type::DATA){
+        return fetch_status::FAILED;
+    }
+    uint64_t size;
+    if(!response.get_size(size)){
+        size = response.get_length();
+    }
+
+    //The old copy is being read from the whole time, so the new one goes
+    //beside it until it is done
+    string temp = path + ".delta";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return fetch_status::FAILED;
+    }
+    bool complete;
+    if(response.get_delta()){
+        delta_decoder decoder(basis->data(), basis->size(), block, fd);
+        ostream os(&decoder);
+        uint32_t digest;
+        complete = response.recv_body(stream, os) && decoder.ok() &&
+                   decoder.written() == size && 
+                   (!response.get_digest(digest) || 
+                    digest == decoder.digest());
+    }
+    else{
+        complete = response.recv_body(stream, fd, 0);
+    }
+    complete = complete && ftruncate(fd, size) == 0;
+    close(fd);
+    if(!complete || rename(temp.c_str(), path.c_str()) != 0){
+        unlink(temp.c_str());
+        return fetch_status::FAILED;
+    }
+    length = size;
+    wire = signatures.size() + response.get_wire_length();
+    return fetch_status::DONE;
+}
@@ -0,0 +1,160 @@
+/* This file defines delta sync, which lets a client that already has an old
+ * copy of a file fetch only the parts of it that changed, the same way rsync
+ * does.
+ *
+ * The client cuts its copy into blocks and sends a signature of each one, a
+ * weak checksum which can be rolled along a byte at a time and a strong hash.
+ * The server slides a block sized window over its version of the file looking
+ * for windows whose weak checksum matches a block, and confirms them with the
+ * strong hash. What comes back is a list of instructions, either copy a run
+ * of blocks out of the client's copy or use these literal bytes, which the
+ * client follows to write out the new file.
+ *
+ * Signatures are a 32 bit block size followed by a 32 bit weak checksum and a
+ * 64 bit strong hash per block. An instruction is a byte saying which kind it
+ * is, then for a copy the 32 bit index of the first block and a 32 bit count,
+ * or for a literal a 32 bit length and that many bytes. Everything is in
+ * network byte order. A short block at the end of the client's copy gets no
+ * signature, whatever is there is just sent again.
+ *
+ * If the client asked for a digest it is the CRC32C of the new file, so it
+ * catches a block which matched when it shouldn't have as well as anything
+ * that went wrong on the way.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+#include <vector>
+#include <streambuf>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+#include "jstp_streams.hpp"
+#include "striped_fetch.hpp"
+
+//Works out what the client is missing, on the server side
+class delta_encoder{
+    public:
+        //Blocks are about the square root of the file's size, held to
+        //these limits
+        static const uint32_t MIN_BLOCK = 2048;
+        static const uint32_t MAX_BLOCK = 131072;
+
+        //Literal runs are split up into pieces no longer than this
+        static const uint32_t MAX_LITERAL = 1048576;
+
+        //The instruction types
+        static const uint8_t COPY = 'C';
+        static const uint8_t LITERAL = 'L';
+
+        //The block size for a copy of a file this big
+        static uint32_t block_size(uint64_t file_size);
+
+        //The signatures of every whole block, as they go in a request
+        static std::vector<uint8_t> signatures(const uint8_t*, uint64_t size);
+
+        //Takes the signatures from a request, valid is false if they don't
+        //make sense.
+        explicit delta_encoder(const std::vector<uint8_t>& signatures);
+        bool valid();
+
+        //Find what of the file can be copied out of the client's copy. After
+        //this, length is how long the instructions are and literal_bytes how
+        //much of that is data the client doesn't have.
+        void plan(const uint8_t*, uint64_t size);
+        uint64_t length();
+        uint64_t literal_bytes();
+
+        //Send the planned instructions, the literals coming out of the same
+        //data given to plan. Returns false if the stream closed first.
+        bool send(jstp_stream&, const uint8_t*);
+
+    private:
+        //The client's blocks sorted by weak checksum so matches can be
+        //binary searched, and their strong hashes in order. The filter has a
+        //bit set for every weak checksum we have, most windows don't get
+        //past it.
+        struct signature{
+            uint32_t weak;
+            uint32_t index;
+            uint64_t strong;
+        };
+        uint32_t block;
+        bool ok;
+        std::vector<signature> sorted;
+        std::vector<uint64_t> strongs;
+        std::vector<uint64_t> filter;
+        static const size_t FILTER_BITS = 20;
+        static size_t filter_slot(uint32_t weak);
+
+        //The plan, each step is a literal followed by a run of blocks, either
+        //one of which can be empty.
+        struct step{
+            uint64_t literal_start;
+            uint64_t literal_length;
+            uint32_t first;
+            uint32_t count;
+        };
+        std::vector<step> steps;
+        uint64_t encoded_length;
+        uint64_t literal_total;
+
+        //The block at this position, if any. Prefers next so runs of blocks
+        //stay together.
+        bool match(const uint8_t*, uint32_t weak, uint32_t next,
+                   uint32_t& index);
+};
+
+//Follows the instructions on the client side as they arrive, writing the new
+//file out with pwrite. Hand it to recv_body as the output stream's buffer.
+class delta_decoder: public std::streambuf{
+    public:
+        //The client's copy of the file, the block size its signatures were
+        //made with and where to write the new file.
+        delta_decoder(const uint8_t* basis, uint64_t basis_size,
+                      uint32_t block, int fd);
+
+        //False if the instructions didn't make sense or a write failed
+        bool ok();
+
+        //How much of the new file has been written, and how much of it was
+        //coppied out of the old one
+        uint64_t written();
+        uint64_t reused();
+
+        //The CRC32C of the new file so far, to check against the digest
+        uint32_t digest();
+
+    protected:
+        std::streamsize xsputn(const char*, std::streamsize) override;
+        int_type overflow(int_type) override;
+
+    private:
+        const uint8_t* basis;
+        uint64_t basis_size;
+        uint32_t block;
+        int fd;
+        bool failed;
+        uint64_t offset;
+        uint64_t copied;
+        uint32_t crc;
+
+        //The instruction read so far, and what's left of the current literal
+        std::vector<uint8_t> instruction;
+        uint64_t literal_left;
+        bool put(const uint8_t*, uint64_t n);
+};
+
+//Fetch filename over the stream into the file at path, sending signatures of
+//the copy already at path so only what changed comes back. The new file is
+//written beside the old one and renamed over it at the end. Length is set to
+//the size of the file and wire to the bytes of signatures and reply body
+//which went over the stream. Servers which don't know about deltas just send
+//the whole thing.
+fetch_status::Enum delta_fetch(jstp_stream&, const std::string& filename,
+                               const std::string& path, uint64_t& length,
+                               uint64_t& wire);
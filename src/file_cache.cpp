@@ -0,0 +1,119 @@
+/* Implementation of the class defined in file_cache.hpp */
+
+#include "file_cache.hpp"
+
+//STL
+#include <string>
+using std::string;
+#include <memory>
+using std::shared_ptr;
+#include <list>
+using std::list;
+#include <iterator>
+using std::prev;
+#include <mutex>
+using std::mutex; using std::unique_lock;
+#include <future>
+using std::promise; using std::shared_future;
+#include <sstream>
+using std::ostringstream;
+
+//Posix
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+string file_cache_stats::str(){
+    ostringstream oss;
+    oss << hits << " hits, " << misses << " misses, " << evictions 
+        << " evictions, " << bytes / 1000000 << " MB in " << files 
+        << " files";
+    return oss.str();
+}
+
+file_cache::file_cache(uint64_t budget): budget(budget){}
+
+shared_ptr<mapped_file> file_cache::get(const string& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+        close(fd);
+        return nullptr;
+    }
+    int64_t mtime = st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    uint64_t size = st.st_size;
+
+    unique_lock<mutex> l(cache_mutex);
+    auto found = index.find(path);
+    if(found != index.end()){
+        auto it = found->second;
+        if(it->mtime == mtime && it->size == size){
+            stats.hits++;
+            lru.splice(lru.begin(), lru, it);
+            shared_future<shared_ptr<mapped_file>> file = it->file;
+            l.unlock();
+            close(fd);
+            return file.get();
+        }
+
+        //The file has changed since, anyone still sending the old copy
+        //keeps it until they are done
+        drop(it);
+    }
+    stats.misses++;
+    if(size > budget){
+        l.unlock();
+        close(fd);
+        return mapped_file::open(path);
+    }
+
+    //Put it in before loading it so anyone else after it waits for this
+    //load instead of starting their own
+    promise<shared_ptr<mapped_file>> loaded;
+    uint64_t id = ++loads;
+    lru.push_front(entry{path, mtime, size, id, loaded.get_future().share()});
+    index[path] = lru.begin();
+    stats.bytes += size;
+    stats.files++;
+    evict();
+    l.unlock();
+
+    shared_ptr<mapped_file> file = mapped_file::load(fd, size);
+    close(fd);
+    loaded.set_value(file);
+
+    //A file which couldn't be read shouldn't stay in, unless it has been
+    //dropped or replaced already
+    if(!file){
+        l.lock();
+        found = index.find(path);
+        if(found != index.end() && found->second->id == id){
+            drop(found->second);
+        }
+    }
+    return file;
+}
+
+file_cache_stats file_cache::get_stats(){
+    unique_lock<mutex> l(cache_mutex);
+    return stats;
+}
+
+void file_cache::drop(list<entry>::iterator it){
+    stats.bytes -= it->size;
+    stats.files--;
+    index.erase(it->path);
+    lru.erase(it);
+}
+
+//The newest file always stays, nothing bigger than the budget gets in so it
+//fits once everything else is gone
+void file_cache::evict(){
+    while(stats.bytes > budget && lru.size() > 1){
+        drop(prev(lru.end()));
+        stats.evictions++;
+    }
+}
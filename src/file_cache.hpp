@@ -0,0 +1,79 @@
+/* This file defines the server's cache of whole files held in memory. A few
+ * files tend to get asked for over and over, so rather than going back to the
+ * disk for each request the server keeps a copy of them.
+ *
+ * Files are looked up by path and are only a hit if their modification time
+ * and size haven't changed since they were loaded. Each copy is read only and
+ * shared by every stream sending it, they go out of it without being coppied
+ * just like a mapping. Once the copies add up to more than the budget the
+ * least recently used ones are dropped, a stream still sending one keeps it
+ * alive until it is done.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <future>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+#include "mapped_file.hpp"
+
+//What the cache has been up to
+struct file_cache_stats{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    //What is held right now
+    uint64_t bytes = 0;
+    size_t files = 0;
+
+    std::string str();
+};
+
+class file_cache{
+    public:
+        //Hold up to budget bytes of files
+        file_cache(uint64_t budget);
+
+        //The file at path, from memory if we have it as it is now and
+        //loaded into memory if not. Anything bigger than the whole budget is
+        //just mapped and counts as a miss. If several streams miss on the
+        //same file at once it only gets loaded once, the rest wait for it.
+        //Returns nullptr if the file can't be opened or read.
+        std::shared_ptr<mapped_file> get(const std::string& path);
+
+        file_cache_stats get_stats();
+
+    private:
+        //A file and what it looked like when it was loaded. Id tells loads
+        //of the same path apart.
+        struct entry{
+            std::string path;
+            int64_t mtime;
+            uint64_t size;
+            uint64_t id;
+            std::shared_future<std::shared_ptr<mapped_file>> file;
+        };
+
+        uint64_t budget;
+        uint64_t loads = 0;
+        file_cache_stats stats;
+
+        //Most recently used first, and where to find each path in it
+        std::list<entry> lru;
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        std::mutex cache_mutex;
+
+        //Both need the lock held
+        void drop(std::list<entry>::iterator);
+        void evict();
+};
@@ -1,25 +1,86 @@
-
 #include "file_layer.hpp"
+#include "crc32c.hpp"
+#include "compression.hpp"
 #include <iostream>
 using std::cout; using std::endl;
 #include <string>
-using std::string;
+using std::string; using std::stoull;
 #include <algorithm>
-using std::copy;
+using std::copy; using std::min;
 #include <iterator>
 using std::ostream_iterator;
 #include <sstream>
 using std::ostringstream;
-#include <time.h>
+#include <stdexcept>
+#include <deque>
+using std::deque;
+#include <future>
+using std::future; using std::async;
+#include <memory>
+using std::unique_ptr;
+#include <cstring>
+#include <unistd.h>
 
 //The strings which specify the action type
 static const string request_str = "REQUEST";
 static const string deny_str = "DENY";
 static const string data_str = "DATA";
 
+const size_t file_message::CHUNK_SIZE;
+const size_t file_message::PIPELINE_CHUNKS;
+const size_t file_message::COMPRESS_WORKERS;
+const size_t file_message::MAX_SKIPPED_BLOCKS;
+const uint8_t file_message::BINARY_MAGIC;
+const uint8_t file_message::BINARY_VERSION;
+const size_t file_message::BINARY_HEADER_SIZE;
+const size_t file_message::DIGEST_SIZE;
+
+//Write the low n bytes of value to the end of out, most significant first
+static void put_bytes(vector<uint8_t>& out, uint64_t value, size_t n){
+    for(size_t i = n; i > 0; i--){
+        out.push_back((value >> (8 * (i - 1))) & 0xFF);
+    }
+}
+
+//Read an n byte value written by put_bytes, moving in past it
+static uint64_t get_bytes(const uint8_t*& in, size_t n){
+    uint64_t value = 0;
+    for(size_t i = 0; i < n; i++){
+        value = (value << 8) | *in++;
+    }
+    return value;
+}
+
+//Wait for the stream to give us some more data, the stream wakes us up as
+//soon as any arrives. Only comes back empty if the stream closed first.
+static vector<uint8_t> wait_for_data(jstp_stream& stream){
+    return stream.recv_wait();
+}
+
+//Keep adding whatever the stream gives us to v until it is at least n long
+static bool wait_for_bytes(jstp_stream& stream, vector<uint8_t>& v, size_t n){
+    while(v.size() < n){
+        vector<uint8_t> more = wait_for_data(stream);
+        if(more.empty()){
+            return false;
+        }
+        v.insert(v.end(), more.begin(), more.end());
+    }
+    return true;
+}
+
 //Get a string representation of the message, this might be used later for the
 //send function if I'm feeling particularly lazy.
 string file_message::str(){
+    string out = header_str(data.size());
+
+    //Finally, the data itself
+    out.append(data.begin(), data.end());
+    return out;
+}
+
+//The header lines which go in front of a body of the given length
+string file_message::header_str(uint64_t length){
     ostringstream oss;
 
     //First, lets put the action_type on the first line
@@ -37,14 +98,49 @@ string file_message::str(){
     oss << filename << endl;
 
     //Then the length of the data, as a string
-    oss << data.size() << endl;
+    oss << length << endl;
 
-    //Finally, the data itself
-    copy(data.begin(), data.end(), ostream_iterator<unsigned char>(oss));
-    
     return oss.str();
 }
 
+//The header for a body of the given length in the format the peer can read
+vector<uint8_t> file_message::header_bytes(jstp_stream& stream, 
+                                          uint64_t length){
+    if(stream.get_binary_framing()){
+        return binary_header(length);
+    }
+    string header = header_str(length);
+    return vector<uint8_t>(header.begin(), header.end());
+}
+
+//The binary header, see the top of file_layer.hpp for the layout. Names too
+//long for the length field get cut off, no filesystem allows one that long.
+vector<uint8_t> file_message::binary_header(uint64_t length){
+    size_t name_length = min(filename.size(), (size_t)0xFFFF);
+    vector<uint8_t> out;
+    out.reserve(BINARY_HEADER_SIZE + 28 + name_length);
+    out.push_back(BINARY_MAGIC);
+    out.push_back(BINARY_VERSION);
+    out.push_back(action);
+    out.push_back(flags);
+    put_bytes(out, length, 8);
+    put_bytes(out, name_length, 2);
+    if(flags & message_flag::OFFSET){
+        put_bytes(out, offset, 8);
+    }
+    if(flags & message_flag::CHECKSUM){
+        put_bytes(out, checksum, 4);
+    }
+    if(flags & message_flag::RANGE){
+        put_bytes(out, range, 8);
+    }
+    if(flags & message_flag::SIZE){
+        put_bytes(out, size, 8);
+    }
+    out.insert(out.end(), filename.begin(), filename.begin() + name_length);
+    return out;
+}
+
 
 //Set the action of an outgoing_message
 void outgoing_message::set_action(const action_type::Enum& action_in){
@@ -56,6 +152,39 @@ void outgoing_message::set_filename(const string& filename_in){
     filename = filename_in;
 }
 
+//Set the optional fields, they only go out in the binary format
+void outgoing_message::set_offset(uint64_t offset_in){
+    offset = offset_in;
+    flags |= message_flag::OFFSET;
+}
+
+void outgoing_message::set_checksum(uint32_t checksum_in){
+    checksum = checksum_in;
+    flags |= message_flag::CHECKSUM;
+}
+
+void outgoing_message::set_range(uint64_t range_in){
+    range = range_in;
+    flags |= message_flag::RANGE;
+}
+
+void outgoing_message::set_size(uint64_t size_in){
+    size = size_in;
+    flags |= message_flag::SIZE;
+}
+
+void outgoing_message::set_delta(){
+    flags |= message_flag::DELTA;
+}
+
+void outgoing_message::set_digest(){
+    flags |= message_flag::DIGEST;
+}
+
+void outgoing_message::set_compressed(){
+    flags |= message_flag::COMPRESSED;
+}
+
 //Quick and dirty way to attach data to an outgoing_message
 void outgoing_message::attach_data(istream& is){
     data.clear();
@@ -65,20 +194,209 @@ void outgoing_message::attach_data(istream& is){
     data.pop_back();
 }
 
-//Quick and dirty send, TODO make it copy free?
+//Attach data we already have in memory
+void outgoing_message::set_data(const vector<uint8_t>& data_in){
+    data.assign(data_in.begin(), data_in.end());
+}
+
+//Send the header and the attached data in one go. Anything small enough to
+//be attached isn't worth a worker, compressed blocks get made right here.
 void outgoing_message::send(jstp_stream& stream){
-    
-    //First, get the whole message as a string
-    string message = str();
+    vector<uint8_t> v = header_bytes(stream, data.size());
+    if(compressing(stream)){
+        lz_codec codec;
+        for(size_t at = 0; at < data.size(); 
+            at += compressed_block::BLOCK_SIZE){
+            size_t n = min(data.size() - at, compressed_block::BLOCK_SIZE);
+            vector<uint8_t> block = compressed_block::encode(&codec, 
+                vector<uint8_t>(data.begin() + at, data.begin() + at + n));
+            v.insert(v.end(), block.begin(), block.end());
+        }
+    }
+    else{
+        v.insert(v.end(), data.begin(), data.end());
+    }
+    if(action == action_type::DATA && stream.get_binary_framing() &&
+       (flags & message_flag::DIGEST)){
+        put_bytes(v, crc32c(0, data.data(), data.size()), DIGEST_SIZE);
+    }
+    stream.send(v);
+}
+
+//No point waiting for the header to be acked, the body is right behind it
+void outgoing_message::send_header(jstp_stream& stream, uint64_t length){
+    stream.send_async(header_bytes(stream, length), [](bool){});
+}
 
-    //Quick and dirty, copy the chars to a vector of uint8
+//Goes right after the body, the digest is never sent in the text format
+void outgoing_message::send_digest(jstp_stream& stream, uint32_t digest){
+    if(!stream.get_binary_framing() || !(flags & message_flag::DIGEST)){
+        return;
+    }
     vector<uint8_t> v;
-    v.reserve(message.size());
+    put_bytes(v, digest, DIGEST_SIZE);
+    stream.send_async(v, [](bool){});
+}
 
-    copy(message.begin(), message.end(), back_inserter(v));
+//Only a DATA has a body worth compressing, and only the binary format can say
+//that it is
+bool outgoing_message::compressing(jstp_stream& stream){
+    return action == action_type::DATA && stream.get_binary_framing() &&
+           (flags & message_flag::COMPRESSED);
+}
 
-    stream.send(v);
+//One block of a compressed body, a block which isn't being tried is just
+//coppied in as it is
+static vector<uint8_t> encode_block(bool attempt, vector<uint8_t> raw){
+    unique_ptr<block_codec> codec;
+    if(attempt){
+        codec = make_block_codec(codec_type::LZ);
+    }
+    return compressed_block::encode(codec.get(), raw);
+}
+
+bool outgoing_message::send_blocks(jstp_stream& stream, uint64_t length,
+                                   std::function<bool(vector<uint8_t>&)> read){
+    send_header(stream, length);
+
+    //Blocks still being worked on oldest first, whether each of them was
+    //tried, and the ones on the wire. Blocks are smaller than chunks so more
+    //of them can be out at once for the same memory.
+    deque<future<vector<uint8_t>>> encoding;
+    deque<bool> tried;
+    deque<future<bool>> in_flight;
+    size_t max_in_flight = PIPELINE_CHUNKS * CHUNK_SIZE / 
+                           compressed_block::BLOCK_SIZE;
+    uint32_t crc = 0;
+    size_t skip = 0;
+    size_t backoff = 1;
+    while(length > 0 || !encoding.empty()){
+        //Keep the workers busy. A block which isn't being tried only needs
+        //copying, that gets done whenever it is sent.
+        while(length > 0 && encoding.size() < COMPRESS_WORKERS){
+            vector<uint8_t> raw(min((uint64_t)compressed_block::BLOCK_SIZE, 
+                                    length));
+            if(!read(raw)){
+                return false;
+            }
+            length -= raw.size();
+            crc = crc32c(crc, raw.data(), raw.size());
+            bool attempt = skip == 0;
+            if(!attempt){
+                skip--;
+            }
+            encoding.push_back(async(attempt ? std::launch::async : 
+                                               std::launch::deferred,
+                                     encode_block, attempt, std::move(raw)));
+            tried.push_back(attempt);
+        }
+
+        //Data which didn't compress probably won't in the next block either,
+        //so back off from trying for longer every time
+        vector<uint8_t> block = encoding.front().get();
+        encoding.pop_front();
+        if(tried.front() && block[0] == codec_type::RAW){
+            skip = backoff;
+            backoff = min(backoff * 2, MAX_SKIPPED_BLOCKS);
+        }
+        else if(tried.front()){
+            backoff = 1;
+        }
+        tried.pop_front();
+
+        //Once a block goes unacked the stream is gone, don't read and
+        //compress the rest of the file for nobody
+        if(in_flight.size() == max_in_flight){
+            if(!in_flight.front().get()){
+                return false;
+            }
+            in_flight.pop_front();
+        }
+        in_flight.push_back(stream.send_async(std::move(block)));
+    }
+    send_digest(stream, crc);
+    return stream.flush();
+}
+
+//Stream a file through without holding more than a chunk of it at a time
+bool outgoing_message::send_file(jstp_stream& stream, istream& is,
+                                 uint64_t length){
+    if(compressing(stream)){
+        return send_blocks(stream, length, [&is](vector<uint8_t>& raw){
+            is.read((char*)raw.data(), raw.size());
+            return (size_t)is.gcount() == raw.size();
+        });
+    }
+
+    //The header goes first, there is no point waiting for it to be acked
+    send_header(stream, length);
+
+    //Then the body a chunk at a time. Each chunk is handed off without
+    //waiting and the next one gets read while it is on the wire, we only
+    //wait once PIPELINE_CHUNKS are out so memory stays bounded. A chunk
+    //which never got acked means the stream closed, stop right there.
+    deque<future<bool>> in_flight;
+    uint32_t crc = 0;
+    while(length > 0){
+        if(in_flight.size() == PIPELINE_CHUNKS){
+            if(!in_flight.front().get()){
+                return false;
+            }
+            in_flight.pop_front();
+        }
+        vector<uint8_t> chunk(min((uint64_t)CHUNK_SIZE, length));
+        is.read((char*)chunk.data(), chunk.size());
+        if((size_t)is.gcount() != chunk.size()){
+            return false;
+        }
+        length -= chunk.size();
+        crc = crc32c(crc, chunk.data(), chunk.size());
+        in_flight.push_back(stream.send_async(std::move(chunk)));
+    }
+    send_digest(stream, crc);
+    return stream.flush();
+}
+
+//No chunks needed here, nothing gets coppied so nothing piles up in memory
+bool outgoing_message::send_file(jstp_stream& stream, 
+                                 std::shared_ptr<mapped_file> file){
+    return send_file(stream, file, 0, file->size());
+}
+
+bool outgoing_message::send_file(jstp_stream& stream, 
+                                 std::shared_ptr<mapped_file> file,
+                                 uint64_t offset, uint64_t length){
+    //Compressed blocks can't go straight from the mapping, they get coppied
+    //out a block at a time for the workers
+    if(compressing(stream)){
+        const uint8_t* at = file->data() + offset;
+        return send_blocks(stream, length, [&at](vector<uint8_t>& raw){
+            memcpy(raw.data(), at, raw.size());
+            at += raw.size();
+            return true;
+        });
+    }
+
+    send_header(stream, length);
 
+    //The digest gets worked out on another thread while the body is on the
+    //wire, it is only needed once the body is all the way out.
+    future<uint32_t> crc;
+    bool digest = stream.get_binary_framing() && 
+                  (flags & message_flag::DIGEST);
+    if(digest){
+        crc = async(std::launch::async, [file, offset, length](){
+            return crc32c(0, file->data() + offset, length);
+        });
+    }
+    if(!stream.send_external(file->data() + offset, length, file)){
+        return false;
+    }
+    if(digest){
+        send_digest(stream, crc.get());
+        return stream.flush();
+    }
+    return true;
 }
 
 //Get the action type of an incoming_message
@@ -91,83 +409,396 @@ string incoming_message::get_filename(){
     return filename;
 }
 
+bool incoming_message::get_offset(uint64_t& offset_out){
+    offset_out = offset;
+    return flags & message_flag::OFFSET;
+}
+
+bool incoming_message::get_checksum(uint32_t& checksum_out){
+    checksum_out = checksum;
+    return flags & message_flag::CHECKSUM;
+}
+
+bool incoming_message::get_range(uint64_t& range_out){
+    range_out = range;
+    return flags & message_flag::RANGE;
+}
+
+bool incoming_message::get_size(uint64_t& size_out){
+    size_out = size;
+    return flags & message_flag::SIZE;
+}
+
+bool incoming_message::get_digest(uint32_t& digest_out){
+    digest_out = digest;
+    return flags & message_flag::DIGEST;
+}
+
+bool incoming_message::get_delta(){
+    return flags & message_flag::DELTA;
+}
+
+bool incoming_message::get_compressed(){
+    return flags & message_flag::COMPRESSED;
+}
+
+//Only a DATA carries a digest, on a REQUEST the flag is asking for one
+bool incoming_message::has_digest(){
+    return action == action_type::DATA && (flags & message_flag::DIGEST);
+}
+
+//On a REQUEST the flag is asking for blocks, only a DATA body is made of them
+bool incoming_message::has_blocks(){
+    return action == action_type::DATA && (flags & message_flag::COMPRESSED);
+}
+
+//Each block waits until it is all here, the stored bytes are cut off the front
+//once it has been handed on so whatever is left starts at the next one.
+bool incoming_message::recv_blocks(jstp_stream& stream,
+                           std::function<bool(const uint8_t*, size_t)> sink){
+    uint64_t left = length;
+    uint32_t crc = 0;
+    vector<uint8_t> v;
+    v.swap(pending);
+    vector<uint8_t> decompressed;
+
+    //A single piece from the stream can hold a lot of blocks, they are
+    //walked through with an offset and only what is left of the piece gets
+    //moved to the front, once, when more has to be waited for.
+    size_t used = 0;
+    auto have = [&](size_t n){
+        if(v.size() - used >= n){
+            return true;
+        }
+        v.erase(v.begin(), v.begin() + used);
+        used = 0;
+        return wait_for_bytes(stream, v, n);
+    };
+    while(left > 0){
+        codec_type::Enum type;
+        uint32_t block_length, stored;
+        if(!have(compressed_block::HEADER_SIZE) ||
+           !compressed_block::parse_header(v.data() + used, type, 
+                                           block_length, stored) ||
+           block_length == 0 || block_length > left){
+            return false;
+        }
+        size_t block_size = compressed_block::HEADER_SIZE + stored;
+        if(!have(block_size)){
+            return false;
+        }
+        const uint8_t* block = v.data() + used + 
+                               compressed_block::HEADER_SIZE;
+        if(type != codec_type::RAW){
+            unique_ptr<block_codec> codec = make_block_codec(type);
+            decompressed.resize(block_length);
+            if(!codec || !codec->decompress(block, stored, 
+                                            decompressed.data(),
+                                            block_length)){
+                return false;
+            }
+            block = decompressed.data();
+        }
+        if(has_digest()){
+            crc = crc32c(crc, block, block_length);
+        }
+        if(!sink(block, block_length)){
+            return false;
+        }
+        left -= block_length;
+        wire_length += block_size;
+        used += block_size;
+    }
+    return finish_body(stream, v, used, crc);
+}
+
+//Whatever was left of the last piece past the body is where the digest
+//starts, anything short of it is still on its way.
+bool incoming_message::finish_body(jstp_stream& stream, vector<uint8_t>& rest,
+                                   size_t used, uint32_t crc){
+    if(!has_digest()){
+        return true;
+    }
+    rest.erase(rest.begin(), rest.begin() + used);
+    if(!wait_for_bytes(stream, rest, DIGEST_SIZE)){
+        return false;
+    }
+    const uint8_t* ptr = rest.data();
+    digest = get_bytes(ptr, DIGEST_SIZE);
+    return get_delta() || digest == crc;
+}
+
+//The body, only filled in by recv
+const vector<uint8_t>& incoming_message::get_data(){
+    return data;
+}
+
+//Get the length of the body that follows the header
+uint64_t incoming_message::get_length(){
+    return length;
+}
+
+//Blocks count themselves as they come in, anything else is just the length
+uint64_t incoming_message::get_wire_length(){
+    return has_blocks() ? wire_length : length;
+}
+
 //Extract the data from an incoming_message
 void incoming_message::extract_data(ostream& os){
     copy(data.begin(), data.end(), ostream_iterator<unsigned char>(os));
 }
 
-//Quick and dirty recv
-void incoming_message::recv(jstp_stream& stream){
-    /* char c; */
-    vector<uint8_t> recv_vect;
-    auto iter = recv_vect.begin();
+//Quick and dirty recv, the whole body ends up in memory
+bool incoming_message::recv(jstp_stream& stream){
+    if(!recv_header(stream)){
+        return false;
+    }
+
+    //Get the remaining characters into the data vector
+    data.clear();
+    data.reserve(length);
+    if(has_blocks()){
+        return recv_blocks(stream, [this](const uint8_t* block, size_t n){
+            data.insert(data.end(), block, block + n);
+            return true;
+        });
+    }
+    data.insert(data.end(), pending.begin(), pending.end());
+    pending.clear();
+    if(!wait_for_bytes(stream, data, length)){
+        return false;
+    }
+
+    //Anything past the body isn't ours, apart from the digest
+    vector<uint8_t> rest(data.begin() + length, data.end());
+    data.resize(length);
+    if(has_digest()){
+        return finish_body(stream, rest, 0, 
+                           crc32c(0, data.data(), data.size()));
+    }
+    return true;
+}
 
-    string action_string;
-    string length_string;
+//Read just the header, anything after it is kept for the body. The first byte
+//tells us which format the peer used.
+bool incoming_message::recv_header(jstp_stream& stream){
     filename.clear();
     data.clear();
-    size_t length = 0;
+    pending.clear();
+    wire_length = 0;
+    flags = 0;
+    offset = 0;
+    checksum = 0;
+    digest = 0;
+    range = 0;
+    size = 0;
+
+    vector<uint8_t> v = wait_for_data(stream);
+    if(v.empty()){
+        return false;
+    }
+    if(v[0] == BINARY_MAGIC){
+        return recv_binary_header(stream, v);
+    }
+    return recv_text_header(stream, v);
+}
+
+//The fixed header says how much more there is, wait for that much and pick the
+//fields out.
+bool incoming_message::recv_binary_header(jstp_stream& stream, 
+                                          vector<uint8_t>& v){
+    if(!wait_for_bytes(stream, v, BINARY_HEADER_SIZE)){
+        return false;
+    }
+    const uint8_t* ptr = v.data() + 1;
+    if(*ptr++ != BINARY_VERSION){
+        return false;
+    }
+    uint8_t type = *ptr++;
+    if(type > action_type::DATA){
+        return false;
+    }
+    action = (action_type::Enum)type;
+    flags = *ptr++;
+    length = get_bytes(ptr, 8);
+    size_t name_length = get_bytes(ptr, 2);
+
+    size_t header_size = BINARY_HEADER_SIZE + name_length;
+    if(flags & message_flag::OFFSET){
+        header_size += 8;
+    }
+    if(flags & message_flag::CHECKSUM){
+        header_size += 4;
+    }
+    if(flags & message_flag::RANGE){
+        header_size += 8;
+    }
+    if(flags & message_flag::SIZE){
+        header_size += 8;
+    }
+    if(!wait_for_bytes(stream, v, header_size)){
+        return false;
+    }
+
+    //Waiting may have moved the data
+    ptr = v.data() + BINARY_HEADER_SIZE;
+    if(flags & message_flag::OFFSET){
+        offset = get_bytes(ptr, 8);
+    }
+    if(flags & message_flag::CHECKSUM){
+        checksum = get_bytes(ptr, 4);
+    }
+    if(flags & message_flag::RANGE){
+        range = get_bytes(ptr, 8);
+    }
+    if(flags & message_flag::SIZE){
+        size = get_bytes(ptr, 8);
+    }
+    filename.assign((const char*)ptr, name_length);
+    pending.assign(v.begin() + header_size, v.end());
+    return true;
+}
 
-    //Loop forever
-    vector<string> strings;
-    strings.resize(3);
+//Read the three header lines. Each piece the stream hands us is scanned once,
+//picking up where the last one left off.
+bool incoming_message::recv_text_header(jstp_stream& stream, 
+                                        vector<uint8_t>& v){
+    //Fill out the strings, using newlines as a separator
+    vector<string> strings(3);
     size_t string_index = 0;
-    while(string_index < 3){
-        //If we are at the end of our vector, wait around for half a second and
-        //grab some more data, TODO make this event driven somehow?
-        while(iter == recv_vect.end()){
-            timespec t;
-            t.tv_sec = 0;
-            t.tv_nsec = 500000000;
-            nanosleep(&t, nullptr);
-            recv_vect = stream.recv(); 
-            iter = recv_vect.begin();
-        }
-
-        //Fill out the strings, using newlines as a separator
-        char c = *iter; 
-        if(string_index < 3){
-            if(c == '\n'){
+    while(true){
+        auto iter = v.begin();
+        for(; iter != v.end() && string_index < 3; iter++){
+            if(*iter == '\n'){
                 string_index++; 
             }
-
             else{
-                strings[string_index].push_back(c); 
+                strings[string_index].push_back(*iter);
             }
-            iter++;
+        }
+        pending.assign(iter, v.end());
+        if(string_index == 3){
+            break;
+        }
+        v = wait_for_data(stream);
+        if(v.empty()){
+            return false;
         }
     }
 
     //Set the action type
     if(strings[0] == request_str){
         action = action_type::REQUEST; 
-    } 
+    }
     else if(strings[0] == deny_str){
         action = action_type::DENY; 
-    } 
+    }
     else if(strings[0] == data_str){
         action = action_type::DATA; 
-    } 
+    }
 
-    //Set the filename
+    //Set the filename and length, files can be bigger than an int
     filename = strings[1];
-    length = stoi(strings[2]);
-    string_index++;
+    try{
+        length = stoull(strings[2]);
+    }
+    catch(std::exception& e){
+        return false;
+    }
+    return true;
+}
 
-    //Get the remaining characters into the data vector
-    data.reserve(length);
-    while(length > 0){
-        while(iter == recv_vect.end()){
-            timespec t;
-            t.tv_sec = 0;
-            t.tv_nsec = 500000000;
-            nanosleep(&t, nullptr);
-            recv_vect = stream.recv(); 
-            iter = recv_vect.begin();
+//Write the body to the output stream as it arrives
+bool incoming_message::recv_body(jstp_stream& stream, ostream& os){
+    if(has_blocks()){
+        return recv_blocks(stream, [&os](const uint8_t* block, size_t n){
+            return (bool)os.write((const char*)block, n);
+        });
+    }
+    uint64_t left = length;
+    bool digested = has_digest();
+    uint32_t crc = 0;
+    vector<uint8_t> v;
+    v.swap(pending);
+    while(true){
+        size_t n = min((uint64_t)v.size(), left);
+        if(!os.write((const char*)v.data(), n)){
+            return false;
+        }
+        if(digested){
+            crc = crc32c(crc, v.data(), n);
         }
+        left -= n;
+        if(left == 0){
+            return finish_body(stream, v, n, crc);
+        }
+        v = wait_for_data(stream);
+        if(v.empty()){
+            return false;
+        }
+    }
+}
 
-        data.push_back(*iter);
-        iter++;
-        length--;
+//Same as above, but every piece goes to its place in the file
+bool incoming_message::recv_body(jstp_stream& stream, int fd, 
+                                 uint64_t offset,
+                                 std::function<void(uint64_t)> progress){
+    if(has_blocks()){
+        return recv_blocks(stream, [&](const uint8_t* block, size_t n){
+            while(n > 0){
+                ssize_t written = pwrite(fd, block, n, offset);
+                if(written < 0){
+                    return false;
+                }
+                block += written;
+                n -= written;
+                offset += written;
+            }
+            if(progress){
+                progress(offset);
+            }
+            return true;
+        });
     }
+    uint64_t left = length;
+    bool digested = has_digest();
+    uint32_t crc = 0;
+    vector<uint8_t> v;
+    v.swap(pending);
+    while(true){
+        size_t n = min((uint64_t)v.size(), left);
+        if(digested){
+            crc = crc32c(crc, v.data(), n);
+        }
+        size_t used = n;
+        const uint8_t* ptr = v.data();
+        while(n > 0){
+            ssize_t written = pwrite(fd, ptr, n, offset);
+            if(written < 0){
+                return false;
+            }
+            ptr += written;
+            n -= written;
+            offset += written;
+            left -= written;
+        }
+        if(progress){
+            progress(offset);
+        }
+        if(left == 0){
+            return finish_body(stream, v, used, crc);
+        }
+        v = wait_for_data(stream);
+        if(v.empty()){
+            return false;
+        }
+    }
+}
+
+std::streamsize discard_buffer::xsputn(const char*, std::streamsize count){
+    return count;
+}
+
+std::streambuf::int_type discard_buffer::overflow(int_type c){
+    return traits_type::not_eof(c);
 }
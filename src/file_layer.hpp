@@ -1,3 +1,49 @@
+/* File messages go over a stream in one of two formats, picked by what the
+ * peer said it can read during the handshake.
+ *
+ * The old text format is three lines, the action (REQUEST, DENY or DATA), the
+ * filename and the body length in decimal, followed by the body.
+ *
+ * The binary format is a fixed header of, in order:
+ *     An 8 bit magic number (0xB5, never the first byte of a text message)
+ *     An 8 bit version number (currently 1)
+ *     An 8 bit message type (the action_type)
+ *     An 8 bit flag field (described below)
+ *     A 64 bit body length
+ *     A 16 bit filename length
+ * then a 64 bit offset if the OFFSET flag is set, a 32 bit checksum if the
+ * CHECKSUM flag is set, a 64 bit range length if the RANGE flag is set, a 64
+ * bit file size if the SIZE flag is set, the filename and finally the body.
+ * Multibyte fields are in network byte order. Receivers tell the formats apart
+ * by the first byte so they can always read either one.
+ *
+ * A REQUEST with an offset asks for just part of the file, starting at the
+ * offset and running for the range length, or to the end of the file without
+ * one. The DATA in reply has the offset its body starts at and the size of the
+ * whole file. After a range the client can ask for another one over the same
+ * stream, the server keeps serving it until it closes. A request which also
+ * has a size is picking up a file it already has part of, if the file isn't
+ * that size anymore the reply starts over from the beginning.
+ *
+ * The DELTA flag has no field of its own. On a REQUEST it means the body is
+ * the signatures of a copy of the file the client already has, on a DATA it
+ * means the body is instructions for rebuilding the file out of that copy.
+ * See delta_sync.hpp for both.
+ *
+ * The DIGEST flag has no field of its own either. On a REQUEST it says the
+ * client can check a digest, on a DATA it means the body is followed by the
+ * CRC32C of the file data the message carries, which isn't counted in the
+ * body length. That is the body itself, or for a DELTA the file rebuilt from
+ * it. It goes at the end so the server can work it out as the body goes by.
+ *
+ * The COMPRESSED flag has no field either, so a server which has never heard
+ * of it just ignores it. On a REQUEST it says the client can read compressed
+ * blocks, on a DATA it means the body is a run of them, see compression.hpp.
+ * The body length is then the length of the data once it is decompressed, the
+ * blocks say how long they are themselves. A digest is of the decompressed
+ * data and comes after the last block.
+ */
+
 #pragma once
 
 #include <iostream>
@@ -6,8 +52,10 @@ using std::istream; using std::ostream;
 using std::string;
 #include <vector>
 using std::vector;
+#include <functional>
 
 #include "jstp_streams.hpp"
+#include "mapped_file.hpp"
 
 //The message has three action types, request, deny, and data. This enum is used
 //to specify which should be/has been used.
@@ -15,17 +63,61 @@ namespace action_type{
     enum Enum{REQUEST, DENY, DATA};
 };
 
+//The bits of the binary header's flag field, each one says an optional field
+//is there.
+namespace message_flag{
+    enum Enum{OFFSET = 1, CHECKSUM = 2, RANGE = 4, SIZE = 8, DELTA = 16,
+              DIGEST = 32, COMPRESSED = 64};
+};
+
 //Each message, incoming or outgoing, contains the following
 class file_message{
     public:
         string str();       //Obtain a string representation of the messsage
 
+        //Files are streamed through in pieces no bigger than this
+        static const size_t CHUNK_SIZE = 4194304;
+
+        //How many of those chunks can be sent and not yet acked at once
+        static const size_t PIPELINE_CHUNKS = 4;
+
+        //How many blocks of a compressed body can be being compressed at once
+        static const size_t COMPRESS_WORKERS = 4;
+
+        //A block which doesn't compress means the next one isn't tried, then
+        //the next two, four and so on up to this many. One that does
+        //compress starts it over.
+        static const size_t MAX_SKIPPED_BLOCKS = 16;
+
+        //Constants for the binary format, the fixed header doesn't include
+        //the optional fields or the filename.
+        static const uint8_t BINARY_MAGIC = 0xB5;
+        static const uint8_t BINARY_VERSION = 1;
+        static const size_t BINARY_HEADER_SIZE = 14;
+        static const size_t DIGEST_SIZE = 4;
+
     protected:
 
+        //Just the header part of the string representation, for a body of
+        //the given length.
+        string header_str(uint64_t length);
+
+        //The header in whichever format the stream agreed on
+        vector<uint8_t> header_bytes(jstp_stream&, uint64_t length);
+        vector<uint8_t> binary_header(uint64_t length);
+
         //Data which fully defines the message
         action_type::Enum action;
         string filename;
         vector<unsigned char> data;
+
+        //Optional fields, only the binary format carries them. Flags says
+        //which of them are set.
+        uint8_t flags = 0;
+        uint64_t offset = 0;
+        uint32_t checksum = 0;
+        uint64_t range = 0;
+        uint64_t size = 0;
 };
 
 //Outgoing message type, only allows modification of fields and sending
@@ -33,8 +125,51 @@ class outgoing_message: public file_message{
     public:
         void set_action(const action_type::Enum&);
         void set_filename(const string&);
+        void set_offset(uint64_t);
+        void set_checksum(uint32_t);
+        void set_range(uint64_t);
+        void set_size(uint64_t);
+        void set_delta();
+        void set_digest();
+        void set_compressed();
         void attach_data(istream&);
+        void set_data(const vector<uint8_t>&);
         void send(jstp_stream&);
+
+        //Send just the header for a body of the given length, the caller
+        //sends the body itself right after. With the DIGEST flag set the
+        //caller sends the digest after that too, the other sends do it
+        //themselves.
+        void send_header(jstp_stream&, uint64_t length);
+        void send_digest(jstp_stream&, uint32_t digest);
+
+        //Send the header and then length bytes of body straight from the
+        //input stream, one chunk at a time, without ever holding the whole
+        //thing. Chunks are read while the ones before them are still on the
+        //wire, up to PIPELINE_CHUNKS of them. Returns false if the input ran
+        //out early or the stream closed before it was all acked.
+        bool send_file(jstp_stream&, istream&, uint64_t length);
+
+        //Send the header and then the whole mapped file as the body. The body
+        //goes out straight from the mapping without being coppied, and the
+        //stream holds on to the mapping until it has all been acked. Returns
+        //false if the stream closed first.
+        bool send_file(jstp_stream&, std::shared_ptr<mapped_file>);
+
+        //Same thing for just length bytes of the file starting at offset
+        bool send_file(jstp_stream&, std::shared_ptr<mapped_file>,
+                       uint64_t offset, uint64_t length);
+
+    private:
+        //Whether the body goes out as compressed blocks
+        bool compressing(jstp_stream&);
+
+        //Send the header and then length bytes of body as compressed blocks,
+        //each one filled in by read. Blocks are compressed on worker threads
+        //while the ones before them are on the wire, so the caller only ever
+        //reads and queues.
+        bool send_blocks(jstp_stream&, uint64_t length,
+                         std::function<bool(vector<uint8_t>&)> read);
 };
 
 //Incoming message type, only allows receiving and getting fields
@@ -42,6 +177,75 @@ class incoming_message: public file_message{
     public:
         action_type::Enum get_action();
         string get_filename();
+
+        //The optional fields, the getters return false if it wasn't sent.
+        //The digest is only filled in once the body has been received.
+        bool get_offset(uint64_t&);
+        bool get_checksum(uint32_t&);
+        bool get_range(uint64_t&);
+        bool get_size(uint64_t&);
+        bool get_digest(uint32_t&);
+        bool get_delta();
+        bool get_compressed();
         void extract_data(ostream&);
-        void recv(jstp_stream&);
+        const vector<uint8_t>& get_data();
+        bool recv(jstp_stream&);
+
+        //Receive a message in two steps, first only the header and then the
+        //body written to the output stream as it arrives. The body is
+        //get_length() bytes long, compressed bodies are decompressed on the
+        //way through. These block until the data shows up and
+        //return false if the stream closed before the message was complete,
+        //or as soon as writing the body out fails.
+        //A body with a digest also comes back false if it doesn't match,
+        //except a DELTA whose digest is of the rebuilt file. That one is left
+        //for whoever rebuilt it to check.
+        bool recv_header(jstp_stream&);
+        uint64_t get_length();
+        bool recv_body(jstp_stream&, ostream&);
+
+        //How many bytes the body took up on the stream once it has been
+        //received, less than get_length() if it came compressed
+        uint64_t get_wire_length();
+
+        //Or write the body into the file starting at offset with pwrite, so
+        //several streams can each fill in their own part of one file. If
+        //given, progress is called with the offset written up to after every
+        //piece.
+        bool recv_body(jstp_stream&, int fd, uint64_t offset,
+                       std::function<void(uint64_t)> progress = nullptr);
+
+    private:
+        //Length of the body, and anything we got from the stream past the
+        //end of the header which belongs to the body.
+        uint64_t length = 0;
+        uint64_t wire_length = 0;
+        vector<uint8_t> pending;
+
+        //The digest that came after the body, if there was one. Once the body
+        //is done, finish_body reads the digest out of whatever is left of the
+        //last piece and the stream and checks it against crc.
+        uint32_t digest = 0;
+        bool has_digest();
+        bool has_blocks();
+        bool finish_body(jstp_stream&, vector<uint8_t>& rest, size_t used,
+                         uint32_t crc);
+
+        //Receive a body of compressed blocks, each block's data goes to sink
+        //once it is decompressed. Stops as soon as sink returns false.
+        bool recv_blocks(jstp_stream&,
+                         std::function<bool(const uint8_t*, size_t)> sink);
+
+        //Finish reading a header in either format, given whatever has
+        //arrived of it so far.
+        bool recv_text_header(jstp_stream&, vector<uint8_t>&);
+        bool recv_binary_header(jstp_stream&, vector<uint8_t>&);
+};
+
+//An output buffer which throws away everything written to it, for reading a
+//body when all that matters is whether it made it across intact.
+class discard_buffer: public std::streambuf{
+    protected:
+        std::streamsize xsputn(const char*, std::streamsize) override;
+        int_type overflow(int_type) override;
 };
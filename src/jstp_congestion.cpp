@@ -0,0 +1,246 @@
+/* Implementation of the classes defined in jstp_congestion.hpp */
+
+#include "jstp_congestion.hpp"
+
+//STL
+#include <string>
+using std::string;
+#include <memory>
+using std::unique_ptr;
+#include <algorithm>
+using std::min; using std::max;
+#include <chrono>
+#include <limits>
+
+//Cstd
+#include <cmath>
+
+//Streams start out allowed to send this many full segments
+static const size_t INITIAL_WINDOW_SEGMENTS = 10;
+
+const size_t congestion_controller::DUP_ACK_THRESHOLD;
+
+//Constants from RFC 8312, C scales the cubic curve and BETA is how much of
+//the window survives a loss.
+static const double CUBIC_C = 0.4;
+static const double CUBIC_BETA = 0.7;
+
+unique_ptr<congestion_controller> 
+make_congestion_controller(congestion_type::Enum type, size_t window, 
+                           size_t mss){
+    if(type == congestion_type::RENO){
+        return unique_ptr<congestion_controller>(new reno_controller(mss));
+    }
+    else if(type == congestion_type::CUBIC){
+        return unique_ptr<congestion_controller>(new cubic_controller(mss));
+    }
+    return unique_ptr<congestion_controller>(new fixed_window(window));
+}
+
+bool parse_congestion_type(const string& name, congestion_type::Enum& type){
+    if(name == "fixed"){
+        type = congestion_type::NONE;
+    }
+    else if(name == "reno"){
+        type = congestion_type::RENO;
+    }
+    else if(name == "cubic"){
+        type = congestion_type::CUBIC;
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
+//The fixed window ignores every event
+fixed_window::fixed_window(size_t w): window(w){}
+
+void fixed_window::on_ack(size_t, size_t){}
+
+void fixed_window::on_dup_ack(){}
+
+void fixed_window::on_fast_retransmit(){}
+
+void fixed_window::on_recovery_exit(){}
+
+void fixed_window::on_timeout(){}
+
+void fixed_window::set_mss(size_t){}
+
+size_t fixed_window::get_cwnd(){
+    return window;
+}
+
+string fixed_window::name(){
+    return "fixed";
+}
+
+//Both start in slow start with no threshold
+loss_based_controller::loss_based_controller(size_t m): mss(m),
+    cwnd(INITIAL_WINDOW_SEGMENTS * m),
+    ssthresh(std::numeric_limits<double>::infinity()),
+    in_fast_recovery(false){}
+
+void loss_based_controller::on_ack(size_t acked_bytes, size_t rtt_usecs){
+    //A partial ack during fast recovery takes back the inflation for what
+    //left the network but leaves room for the retransmission (NewReno).
+    if(in_fast_recovery){
+        cwnd -= min(cwnd - mss, (double)acked_bytes);
+        cwnd += mss;
+        return;
+    }
+
+    //In slow start the window grows by however much was acked, doubling it
+    //every round trip.
+    if(cwnd < ssthresh){
+        cwnd += acked_bytes;
+        return;
+    }
+    grow(acked_bytes, rtt_usecs);
+}
+
+//Every duplicate ack during recovery means a segment left the network, let
+//another one in to take its place.
+void loss_based_controller::on_dup_ack(){
+    if(in_fast_recovery){
+        cwnd += mss;
+    }
+}
+
+//Shrink the window, then inflate it by the segments the duplicate acks say
+//have already left.
+void loss_based_controller::on_fast_retransmit(){
+    reduce();
+    cwnd += DUP_ACK_THRESHOLD * mss;
+    in_fast_recovery = true;
+}
+
+//Deflate back to the threshold and carry on in congestion avoidance
+void loss_based_controller::on_recovery_exit(){
+    if(in_fast_recovery){
+        cwnd = ssthresh;
+        in_fast_recovery = false;
+    }
+}
+
+//A timeout means the pipe drained, start over from a single segment
+void loss_based_controller::on_timeout(){
+    reduce();
+    cwnd = mss;
+    in_fast_recovery = false;
+}
+
+//The window stays the same number of bytes, it just counts in the new size.
+//It can't be less than one full segment though, or nothing full sized would
+//ever get sent.
+void loss_based_controller::set_mss(size_t m){
+    mss = m;
+    cwnd = max(cwnd, (double)mss);
+}
+
+size_t loss_based_controller::get_cwnd(){
+    return cwnd;
+}
+
+reno_controller::reno_controller(size_t m): loss_based_controller(m),
+    acked_since_increase(0){}
+
+//In congestion avoidance the window grows by one segment per window acked
+void reno_controller::grow(size_t acked_bytes, size_t){
+    acked_since_increase += acked_bytes;
+    if(acked_since_increase >= cwnd){
+        acked_since_increase -= cwnd;
+        cwnd += mss;
+    }
+}
+
+//Halve the window on a loss
+void reno_controller::reduce(){
+    ssthresh = max(cwnd / 2, 2.0 * mss);
+    cwnd = ssthresh;
+    acked_since_increase = 0;
+}
+
+string reno_controller::name(){
+    return "reno";
+}
+
+//w_max stays zero until the first loss
+cubic_controller::cubic_controller(size_t m): loss_based_controller(m),
+    w_max(0), w_last_max(0), in_epoch(false), k(0), origin(0), w_est(0){}
+
+//The curve only resumes once fast recovery is over, and is worked out in
+//segments and seconds.
+void cubic_controller::grow(size_t acked_bytes, size_t rtt_usecs){
+    auto now = std::chrono::steady_clock::now();
+    double segments = cwnd / mss;
+
+    //The first ack after a loss starts a new epoch, work out how long the
+    //curve will take to climb back to where the loss happened.
+    if(!in_epoch){
+        in_epoch = true;
+        epoch_start = now;
+        if(segments < w_max){
+            k = std::cbrt((w_max - segments) / CUBIC_C);
+            origin = w_max;
+        }
+        else{
+            k = 0;
+            origin = segments;
+        }
+        w_est = segments;
+    }
+
+    //Where the curve says we should be one round trip from now
+    double t = std::chrono::duration<double>(now - epoch_start).count() + 
+               rtt_usecs / 1000000.0;
+    double target = origin + CUBIC_C * std::pow(t - k, 3);
+
+    //Never grow slower than Reno would have in the same situation
+    w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * 
+             (acked_bytes / (double)mss) / segments;
+    target = max(target, w_est);
+
+    //Close a fraction of the distance to the target on every ack, creep
+    //forward very slowly if we are already past it.
+    if(target > segments){
+        cwnd += (target - segments) / segments * acked_bytes;
+    }
+    else{
+        cwnd += acked_bytes / (100 * segments);
+    }
+}
+
+//Remember where the loss happened and shrink by BETA. If we lost before
+//getting back to the last maximum, another flow is probably taking up more
+//of the link so give up some extra room (fast convergence).
+void cubic_controller::reduce(){
+    double segments = cwnd / mss;
+    if(segments < w_last_max){
+        w_max = segments * (1 + CUBIC_BETA) / 2;
+    }
+    else{
+        w_max = segments;
+    }
+    w_last_max = segments;
+    in_epoch = false;
+
+    ssthresh = max(cwnd * CUBIC_BETA, 2.0 * mss);
+    cwnd = ssthresh;
+}
+
+//The curve is worked out in segments, so everything remembered in segments
+//has to be rescaled to stay the same number of bytes.
+void cubic_controller::set_mss(size_t m){
+    double scale = mss / (double)m;
+    w_max *= scale;
+    w_last_max *= scale;
+    origin *= scale;
+    w_est *= scale;
+    loss_based_controller::set_mss(m);
+}
+
+string cubic_controller::name(){
+    return "cubic";
+}
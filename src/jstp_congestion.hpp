@@ -0,0 +1,161 @@
+/* This file defines the congestion controllers a jstp_stream can use to decide
+ * how much data it may have on the wire. The stream reports acks, duplicate
+ * acks and timeouts to its controller and never sends past the window the
+ * controller hands back. Controllers are interchangeable, new ones only need
+ * to inherit from congestion_controller and be added to the factory.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+#include <memory>
+#include <chrono>
+
+//Cstd includes
+#include <cstddef>
+
+//The controllers which can be chosen for a stream. NONE keeps the window fixed
+//at whatever the user asked for.
+namespace congestion_type{
+    enum Enum{NONE, RENO, CUBIC};
+};
+
+//Interface all controllers implement. All sizes are in bytes.
+class congestion_controller{
+    public:
+        //Duplicate acks the stream waits for before a fast retransmit, the
+        //window is inflated by this many segments on entering fast recovery.
+        static const size_t DUP_ACK_THRESHOLD = 3;
+
+        virtual ~congestion_controller(){}
+
+        //New data was acked, rtt is the current smoothed round trip time in
+        //microseconds or zero if there isn't one yet.
+        virtual void on_ack(size_t acked_bytes, size_t rtt_usecs) = 0;
+
+        //An ack arrived which didn't move the window while data was on the
+        //wire. Each one means another segment left the network.
+        virtual void on_dup_ack() = 0;
+
+        //The stream saw enough duplicate acks to resend the oldest segment
+        //without waiting for the timer, the controller should shrink the
+        //window and enter fast recovery.
+        virtual void on_fast_retransmit() = 0;
+
+        //Everything that was on the wire when the loss was detected has been
+        //acked, fast recovery is over.
+        virtual void on_recovery_exit() = 0;
+
+        //The retransmission timer fired
+        virtual void on_timeout() = 0;
+
+        //The stream moved to a different segment size, mss is the payload of
+        //a full segment from now on.
+        virtual void set_mss(size_t mss) = 0;
+
+        //How many bytes may currently be on the wire
+        virtual size_t get_cwnd() = 0;
+
+        virtual std::string name() = 0;
+};
+
+//Factory, window is only used by NONE and mss is the size of a full segment
+std::unique_ptr<congestion_controller> 
+make_congestion_controller(congestion_type::Enum, size_t window, size_t mss);
+
+//Look a controller up by the name it goes by, false if there isn't one
+bool parse_congestion_type(const std::string& name, congestion_type::Enum&);
+
+//A window which never changes, how streams behaved before congestion control
+class fixed_window: public congestion_controller{
+    public:
+        fixed_window(size_t window);
+        void on_ack(size_t acked_bytes, size_t rtt_usecs);
+        void on_dup_ack();
+        void on_fast_retransmit();
+        void on_recovery_exit();
+        void on_timeout();
+        void set_mss(size_t mss);
+        size_t get_cwnd();
+        std::string name();
+
+    private:
+        size_t window;
+};
+
+//Everything Reno and CUBIC have in common. Both slow start until the first
+//loss, and both do fast recovery the same way: shrink the window, then let
+//every duplicate ack inflate it by a segment so new data keeps flowing while
+//the hole is filled. They only differ in how much they shrink by and how the
+//window grows again in congestion avoidance.
+class loss_based_controller: public congestion_controller{
+    public:
+        loss_based_controller(size_t mss);
+        void on_ack(size_t acked_bytes, size_t rtt_usecs);
+        void on_dup_ack();
+        void on_fast_retransmit();
+        void on_recovery_exit();
+        void on_timeout();
+        void set_mss(size_t mss);
+        size_t get_cwnd();
+
+    protected:
+        size_t mss;
+        double cwnd;
+        double ssthresh;
+
+        //Grow the window on an ack outside of slow start and fast recovery
+        virtual void grow(size_t acked_bytes, size_t rtt_usecs) = 0;
+
+        //Set ssthresh after a loss and shrink the window down to it
+        virtual void reduce() = 0;
+
+    private:
+        bool in_fast_recovery;
+};
+
+//Classic TCP Reno: additive increase in congestion avoidance and halving the
+//window on loss.
+class reno_controller: public loss_based_controller{
+    public:
+        reno_controller(size_t mss);
+        std::string name();
+
+    protected:
+        void grow(size_t acked_bytes, size_t rtt_usecs);
+        void reduce();
+
+    private:
+        //Bytes acked since the window last grew during congestion avoidance
+        double acked_since_increase;
+};
+
+//CUBIC as described in RFC 8312. After a loss the window grows along a cubic
+//curve centered on the size it had when the loss happened, flat near that
+//size and steep far away from it.
+class cubic_controller: public loss_based_controller{
+    public:
+        cubic_controller(size_t mss);
+        void set_mss(size_t mss);
+        std::string name();
+
+    protected:
+        void grow(size_t acked_bytes, size_t rtt_usecs);
+        void reduce();
+
+    private:
+        //Window size when the last loss happened and the one before it
+        double w_max;
+        double w_last_max;
+
+        //The current growth epoch, K is how long it takes to get back to
+        //origin, all in seconds and segments.
+        bool in_epoch;
+        std::chrono::steady_clock::time_point epoch_start;
+        double k;
+        double origin;
+
+        //Reno style estimate used to stay at least as fast as Reno would be
+        double w_est;
+};
@@ -0,0 +1,241 @@
+/* Implementation of the class defined in jstp_reactor.hpp */
+
+#include "jstp_reactor.hpp"
+#include "jstp_streams.hpp"
+
+//Posix
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+//STL
+#include <vector>
+using std::vector;
+#include <mutex>
+using std::mutex; using std::unique_lock;
+#include <thread>
+using std::thread;
+#include <algorithm>
+using std::max;
+
+const size_t jstp_reactor::WHEEL_SLOTS;
+const size_t jstp_reactor::TICK_USECS;
+const size_t jstp_reactor::MAX_EVENTS;
+
+jstp_reactor::jstp_reactor(): stopping(false), wheel(WHEEL_SLOTS),
+                              current_tick(0), timer_count(0),
+                              epoch(std::chrono::steady_clock::now()){
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    //The eventfd is the one thing in the set that isn't a stream
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    loop_thread = thread(&jstp_reactor::main, this);
+}
+
+jstp_reactor::~jstp_reactor(){
+    stopping.store(true);
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd, &one, sizeof(one));
+    (void)written;
+    loop_thread.join();
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+size_t jstp_reactor::stream_count(){
+    unique_lock<mutex> l(streams_mutex);
+    return streams.size();
+}
+
+void jstp_reactor::add(jstp_stream* stream){
+    {
+        unique_lock<mutex> l(streams_mutex);
+        streams.insert(stream);
+        stream->timer_tick = 0;
+
+        //Level triggered, a socket we didn't drain all the way just comes
+        //up again next time around.
+        if(!stream->shared_acceptor){
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = stream;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stream->stream_sock.get_fd(), 
+                      &ev);
+        }
+    }
+    wake(stream);
+}
+
+void jstp_reactor::remove(jstp_stream* stream){
+    unique_lock<mutex> l(streams_mutex);
+    if(!stream->shared_acceptor){
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->stream_sock.get_fd(), 
+                  nullptr);
+    }
+    streams.erase(stream);
+}
+
+void jstp_reactor::add(jstp_acceptor* acceptor){
+    unique_lock<mutex> l(streams_mutex);
+    acceptors.insert(acceptor);
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = acceptor;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, acceptor->acceptor_socket.get_fd(), 
+              &ev);
+}
+
+void jstp_reactor::remove(jstp_acceptor* acceptor){
+    unique_lock<mutex> l(streams_mutex);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, acceptor->acceptor_socket.get_fd(), 
+              nullptr);
+    acceptors.erase(acceptor);
+}
+
+//Only the first wake before the thread gets to the stream does anything, and
+//only the first stream in an empty list has to interrupt epoll_wait.
+void jstp_reactor::wake(jstp_stream* stream){
+    if(stream->queued.exchange(true)){
+        return;
+    }
+    bool was_empty;
+    {
+        unique_lock<mutex> l(ready_mutex);
+        was_empty = ready.empty();
+        ready.push_back(stream);
+    }
+    if(was_empty){
+        uint64_t one = 1;
+        ssize_t written = write(wake_fd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+void jstp_reactor::main(){
+    epoll_event events[MAX_EVENTS];
+    vector<jstp_stream*> woken;
+    while(!stopping.load()){
+        //Only wake up for the wheel if there is something on it
+        int timeout = timer_count > 0 ? TICK_USECS / 1000 : -1;
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+
+        unique_lock<mutex> l(streams_mutex);
+
+        //Streams and acceptors with something to read. Whatever an acceptor
+        //hands out to its streams wakes them, they get run below.
+        for(int i = 0; i < n; i++){
+            void* ptr = events[i].data.ptr;
+            jstp_stream* stream = (jstp_stream*)ptr;
+            jstp_acceptor* acceptor = (jstp_acceptor*)ptr;
+            if(ptr == nullptr){
+                uint64_t count;
+                ssize_t got = read(wake_fd, &count, sizeof(count));
+                (void)got;
+            }
+            else if(streams.count(stream)){
+                run(stream);
+            }
+            else if(acceptors.count(acceptor)){
+                acceptor->demux();
+            }
+        }
+
+        //Streams somebody woke up. One removed since it was woken may still
+        //be in the list, so check before touching it.
+        {
+            unique_lock<mutex> r(ready_mutex);
+            woken.swap(ready);
+        }
+        for(jstp_stream* stream: woken){
+            if(streams.count(stream)){
+                stream->queued.store(false);
+                run(stream);
+            }
+        }
+        woken.clear();
+
+        run_timers();
+    }
+}
+
+//Run the stream, then either put it back in line if it still had more to
+//send or set its timer for whenever it next needs looking at.
+void jstp_reactor::run(jstp_stream* stream){
+    if(!stream->reactor_step()){
+        wake(stream);
+    }
+    size_t usecs = stream->reactor_timer_usecs();
+    if(usecs > 0){
+        schedule(stream, usecs);
+    }
+    else{
+        stream->timer_tick = 0;
+    }
+}
+
+uint64_t jstp_reactor::now_tick(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch).count() / TICK_USECS;
+}
+
+//Round up so a timer never goes off early, a stream which already has a timer
+//for the same tick keeps it.
+void jstp_reactor::schedule(jstp_stream* stream, size_t usecs){
+    uint64_t tick = now_tick() + (usecs + TICK_USECS - 1) / TICK_USECS;
+    tick = std::max(tick, current_tick + 1);
+    if(stream->timer_tick == tick){
+        return;
+    }
+    stream->timer_tick = tick;
+    wheel[tick % WHEEL_SLOTS].push_back(timer{stream, tick});
+    timer_count++;
+}
+
+//Go off every timer in the slot due at or before upto. The slot is taken out
+//of the wheel first since running a stream can schedule it again.
+void jstp_reactor::fire_slot(size_t slot, uint64_t upto){
+    vector<timer> entries;
+    entries.swap(wheel[slot]);
+    for(timer& t: entries){
+        if(t.tick > upto){
+            wheel[slot].push_back(t);
+            continue;
+        }
+        timer_count--;
+        if(streams.count(t.stream) && t.stream->timer_tick == t.tick){
+            t.stream->timer_tick = 0;
+            run(t.stream);
+        }
+    }
+}
+
+//Catch the wheel up to now. If we somehow fell more than a whole turn behind,
+//one pass over every slot covers it.
+void jstp_reactor::run_timers(){
+    uint64_t now = now_tick();
+    if(now - current_tick >= WHEEL_SLOTS){
+        current_tick = now;
+        for(size_t slot = 0; slot < WHEEL_SLOTS; slot++){
+            fire_slot(slot, now);
+        }
+        return;
+    }
+    while(current_tick < now){
+        current_tick++;
+        fire_slot(current_tick % WHEEL_SLOTS, current_tick);
+    }
+}
+
+void pin_to_core(size_t core){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core % max(thread::hardware_concurrency(), 1u), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
@@ -0,0 +1,113 @@
+/* This file defines the reactor, an alternative to the two threads every
+ * jstp_stream normally starts for itself. A reactor runs one thread which
+ * looks after any number of streams, it waits on all of their sockets at once
+ * with epoll and keeps their retransmission and closing timers in a timer
+ * wheel. When a socket is readable, a timer goes off, or the user hands a
+ * stream something to send, the reactor runs that stream's sender and
+ * receiver logic right there on its thread.
+ *
+ * Streams are put on a reactor by building them from a connector or acceptor
+ * which was given one, everything else about using them stays the same. The
+ * reactor has to outlive every stream on it.
+ */
+
+#pragma once
+
+//STL includes
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+class jstp_stream;
+class jstp_acceptor;
+
+class jstp_reactor{
+    friend class jstp_stream;
+    friend class jstp_acceptor;
+    public:
+        //Timers are kept to the nearest tick, anything due within one turn
+        //of the wheel goes straight into its slot and later ones just wait
+        //for the wheel to come around again.
+        static const size_t WHEEL_SLOTS = 1024;
+        static const size_t TICK_USECS = 1000;
+
+        //Most readiness events handled per epoll_wait
+        static const size_t MAX_EVENTS = 256;
+
+        jstp_reactor();
+        ~jstp_reactor();
+
+        //Owns a thread and descriptors, can't be coppied
+        jstp_reactor(const jstp_reactor&) = delete;
+        jstp_reactor& operator=(const jstp_reactor&) = delete;
+
+        //How many streams it is looking after right now
+        size_t stream_count();
+
+    private:
+        //Used by the streams themselves. Add and remove wait for the reactor
+        //to finish with whatever stream it is running at the time. Wake can
+        //be called from anywhere, the stream gets run as soon as possible.
+        void add(jstp_stream*);
+        void remove(jstp_stream*);
+        void wake(jstp_stream*);
+
+        //Acceptors sharing their socket with their streams, the reactor has
+        //them sort out whatever arrives on it. Streams sharing a socket don't
+        //have one of their own to watch.
+        void add(jstp_acceptor*);
+        void remove(jstp_acceptor*);
+
+        //The reactor thread
+        void main();
+        std::thread loop_thread;
+        std::atomic<bool> stopping;
+
+        //Epoll watches every stream's and acceptor's socket plus an eventfd
+        //which wake uses to get the thread out of epoll_wait.
+        int epoll_fd;
+        int wake_fd;
+
+        //The streams we look after, only touched with streams_mutex held. The
+        //reactor thread holds it the whole time it is running streams, so
+        //once remove returns the stream is never looked at again.
+        std::mutex streams_mutex;
+        std::unordered_set<jstp_stream*> streams;
+        std::unordered_set<jstp_acceptor*> acceptors;
+
+        //Run one stream and work out when it next needs looking at. Expects
+        //streams_mutex to be held.
+        void run(jstp_stream*);
+
+        //Streams that have been woken up since the thread last looked
+        std::mutex ready_mutex;
+        std::vector<jstp_stream*> ready;
+
+        //The timer wheel. Each stream has at most one live timer, the tick
+        //it is due at is kept in the stream. Entries whose tick doesn't
+        //match any more were replaced and are just thrown out.
+        struct timer{
+            jstp_stream* stream;
+            uint64_t tick;
+        };
+        std::vector<std::vector<timer>> wheel;
+        uint64_t current_tick;
+        size_t timer_count;
+        std::chrono::steady_clock::time_point epoch;
+        uint64_t now_tick();
+        void schedule(jstp_stream*, size_t usecs);
+        void fire_slot(size_t slot, uint64_t upto);
+        void run_timers();
+};
+
+//Keep the calling thread, and every thread it starts from then on, on one
+//core. Running one reactor per core with each pinned to its own is how the
+//server splits into workers. Cores past the last one wrap around.
+void pin_to_core(size_t core);
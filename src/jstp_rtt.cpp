@@ -0,0 +1,102 @@
+/* Implementation of the class defined in jstp_rtt.hpp */
+
+#include "jstp_rtt.hpp"
+
+//STL
+#include <string>
+using std::string;
+#include <sstream>
+using std::ostringstream; using std::endl;
+#include <mutex>
+using std::mutex; using std::lock_guard;
+#include <algorithm>
+using std::min; using std::max;
+
+const size_t rtt_estimator::MIN_RTO_USECS;
+const size_t rtt_estimator::MAX_RTO_USECS;
+const size_t rtt_estimator::INITIAL_RTO_USECS;
+
+//Gains for the smoothed rtt and its variance, the same ones TCP uses
+static const double ALPHA = 1.0 / 8;
+static const double BETA = 1.0 / 4;
+
+rtt_estimator::rtt_estimator(): has_sample(false), srtt(0), rttvar(0),
+    min_rtt(0), max_rtt(0), total_rtt(0), samples(0), timeouts(0),
+    rto(INITIAL_RTO_USECS){}
+
+void rtt_estimator::sample(size_t usecs){
+    lock_guard<mutex> l(stats_mutex);
+    double r = usecs;
+
+    //The first sample seeds the estimate, every later one is blended in
+    if(!has_sample){
+        srtt = r;
+        rttvar = r / 2;
+        min_rtt = r;
+        max_rtt = r;
+        has_sample = true;
+    }
+    else{
+        rttvar = (1 - BETA) * rttvar + BETA * (srtt > r ? srtt - r : r - srtt);
+        srtt = (1 - ALPHA) * srtt + ALPHA * r;
+        min_rtt = min(min_rtt, r);
+        max_rtt = max(max_rtt, r);
+    }
+    total_rtt += r;
+    samples++;
+
+    //Recompute the timeout from scratch, which also undoes any backoff
+    rto.store(base_rto());
+}
+
+void rtt_estimator::reset_backoff(){
+    lock_guard<mutex> l(stats_mutex);
+    rto.store(base_rto());
+}
+
+//The timeout without any backoff applied, expects the stats mutex to be held
+size_t rtt_estimator::base_rto(){
+    if(!has_sample){
+        return INITIAL_RTO_USECS;
+    }
+    size_t new_rto = srtt + 4 * rttvar;
+    return min(max(new_rto, MIN_RTO_USECS), MAX_RTO_USECS);
+}
+
+void rtt_estimator::backoff(){
+    lock_guard<mutex> l(stats_mutex);
+    timeouts++;
+    rto.store(min(rto.load() * 2, MAX_RTO_USECS));
+}
+
+size_t rtt_estimator::get_rto(){
+    return rto.load();
+}
+
+rtt_stats rtt_estimator::get_stats(){
+    lock_guard<mutex> l(stats_mutex);
+    rtt_stats s;
+    s.samples = samples;
+    s.timeouts = timeouts;
+    s.srtt = srtt;
+    s.rttvar = rttvar;
+    s.min = min_rtt;
+    s.max = max_rtt;
+    s.mean = samples > 0 ? total_rtt / samples : 0;
+    s.rto = rto.load();
+    return s;
+}
+
+//Summarize the statistics, times are printed in milliseconds
+string rtt_stats::str(){
+    ostringstream oss;
+    oss << "Round trip statistics:" << endl;
+    oss << "    Samples         = " << samples << endl;
+    oss << "    Timeouts        = " << timeouts << endl;
+    oss << "    Min/Mean/Max    = " << min / 1000 << " / " << mean / 1000
+        << " / " << max / 1000 << " ms" << endl;
+    oss << "    Smoothed RTT    = " << srtt / 1000 << " ms" << endl;
+    oss << "    RTT Variance    = " << rttvar / 1000 << " ms" << endl;
+    oss << "    Final RTO       = " << rto / 1000.0 << " ms" << endl;
+    return oss.str();
+}
@@ -0,0 +1,75 @@
+/* This file defines the round trip time estimator used by jstp_stream to pick
+ * its retransmission timeout. It follows the usual TCP recipe: a smoothed
+ * round trip time and its variance are updated from every valid sample, the
+ * timeout is srtt + 4 * rttvar, and every timeout doubles it until a fresh
+ * sample comes in.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+#include <mutex>
+#include <atomic>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//A snapshot of what the estimator has seen, all times are in microseconds
+struct rtt_stats{
+    size_t samples;
+    size_t timeouts;
+    double srtt;
+    double rttvar;
+    double min;
+    double max;
+    double mean;
+    size_t rto;
+
+    //Human readable summary of the statistics
+    std::string str();
+};
+
+class rtt_estimator{
+    public:
+        //Bounds on the timeout, and the value it starts with before any
+        //samples have been taken.
+        static const size_t MIN_RTO_USECS = 2000;
+        static const size_t MAX_RTO_USECS = 60000000;
+        static const size_t INITIAL_RTO_USECS = 125000;
+
+        rtt_estimator();
+
+        //Feed in a round trip time measured on a segment which was only ever
+        //sent once (Karn's algorithm), this also clears any backoff.
+        void sample(size_t usecs);
+
+        //A retransmission timer fired, double the timeout
+        void backoff();
+
+        //The peer acked new data, undo any backoff. Waiting for a clean sample
+        //instead can leave a lossy link with a huge timeout for a long time
+        //since most acks cover retransmitted data.
+        void reset_backoff();
+
+        //The current retransmission timeout, safe to call from any thread
+        size_t get_rto();
+        rtt_stats get_stats();
+
+    private:
+        //Protects everything but the rto itself
+        std::mutex stats_mutex;
+
+        bool has_sample;
+        double srtt;
+        double rttvar;
+        double min_rtt;
+        double max_rtt;
+        double total_rtt;
+        size_t samples;
+        size_t timeouts;
+
+        std::atomic<size_t> rto;
+        size_t base_rto();
+};
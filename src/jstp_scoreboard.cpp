@@ -0,0 +1,92 @@
+/* Implementation of the class defined in jstp_scoreboard.hpp */
+
+#include "jstp_scoreboard.hpp"
+
+//STL
+#include <map>
+using std::map;
+#include <algorithm>
+using std::min; using std::max;
+
+sack_scoreboard::sack_scoreboard(): base(0){}
+
+void sack_scoreboard::clear(){
+    ranges.clear();
+}
+
+//Move the base forward and throw out anything the cumulative ack now covers
+void sack_scoreboard::advance(size_t acked){
+    base += acked;
+    auto it = ranges.begin();
+    while(it != ranges.end() && it->first < base){
+        uint64_t end = it->second;
+        it = ranges.erase(it);
+
+        //A range straddling the new base keeps its upper part
+        if(end > base){
+            ranges[base] = end;
+            break;
+        }
+    }
+}
+
+//Insert a range, merging it with any ranges it touches or overlaps
+void sack_scoreboard::mark(size_t start, size_t end){
+    if(end <= start){
+        return;
+    }
+    uint64_t left = base + start;
+    uint64_t right = base + end;
+
+    //Step back to a range which might overlap us from below
+    auto it = ranges.upper_bound(left);
+    if(it != ranges.begin()){
+        auto prev = it;
+        prev--;
+        if(prev->second >= left){
+            it = prev;
+        }
+    }
+
+    //Swallow every range that touches the new one
+    while(it != ranges.end() && it->first <= right){
+        left = min(left, it->first);
+        right = max(right, it->second);
+        it = ranges.erase(it);
+    }
+    ranges[left] = right;
+}
+
+//One past the highest byte the peer has sacked, zero if nothing is sacked
+size_t sack_scoreboard::highest_sacked(){
+    if(ranges.empty()){
+        return 0;
+    }
+    return ranges.rbegin()->second - base;
+}
+
+bool sack_scoreboard::next_hole(size_t from, size_t limit,
+                                size_t& hole_start, size_t& hole_length){
+    uint64_t p = base + from;
+    uint64_t l = base + limit;
+
+    //If from lands inside a sacked range, skip to the end of that range
+    auto it = ranges.upper_bound(p);
+    if(it != ranges.begin()){
+        auto prev = it;
+        prev--;
+        p = max(p, prev->second);
+    }
+    if(p >= l){
+        return false;
+    }
+
+    //The hole runs until the next sacked range or the limit
+    uint64_t hole_end = l;
+    if(it != ranges.end()){
+        hole_end = min(hole_end, it->first);
+    }
+    hole_start = p - base;
+    hole_length = hole_end - p;
+    return true;
+}
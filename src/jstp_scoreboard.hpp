@@ -0,0 +1,48 @@
+/* This file defines the SACK scoreboard used by the sending side of a
+ * jstp_stream. The scoreboard remembers which ranges of the send buffer the
+ * peer has told us it holds out of order and uses that to decide which bytes
+ * actually need to be retransmitted after a loss.
+ */
+
+#pragma once
+
+//STL includes
+#include <map>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//All positions taken and returned by the scoreboard are offsets from the base
+//of the send window, the same way jstp_stream measures its offset.
+class sack_scoreboard{
+    public:
+        sack_scoreboard();
+
+        //Forget everything, used when the retransmission timer fires. The
+        //peer is allowed to throw away what it sacked, it tells us again
+        //about anything it still holds on its next acks.
+        void clear();
+
+        //The base of the window moved forward by this many bytes
+        void advance(size_t acked);
+
+        //Record that the peer holds the bytes in [start, end)
+        void mark(size_t start, size_t end);
+
+        //One past the highest byte the peer holds, zero if it holds nothing
+        size_t highest_sacked();
+
+        //Find the first range of bytes at or after from and before limit which
+        //the peer does not hold. Returns false if there is no such range.
+        bool next_hole(size_t from, size_t limit, 
+                       size_t& hole_start, size_t& hole_length);
+
+    private:
+        //Absolute stream offset of the base of the window, positions are
+        //stored absolutely so advancing doesn't have to touch every range.
+        uint64_t base;
+
+        //Disjoint sacked ranges, start mapped to one past the end
+        std::map<uint64_t, uint64_t> ranges;
+};
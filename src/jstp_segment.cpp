@@ -7,10 +7,7 @@
 //STL
 #include <vector>
 using std::vector;
-#include <iterator>
-using std::back_inserter;
 #include <algorithm>
-using std::copy;
 #include <string>
 using std::string;
 #include <sstream>
@@ -18,9 +15,17 @@ using std::ostringstream; using std::endl;
 
 //Our source
 #include "jstp_segment.hpp"
+#include "crc32c.hpp"
 
 const size_t jstp_segment::MAX_PAYLOAD_SIZE;
 const size_t jstp_segment::MAX_SEGMENT_SIZE;
+const size_t jstp_segment::DEFAULT_SEGMENT_SIZE;
+const size_t jstp_segment::MIN_SEGMENT_SIZE;
+const size_t jstp_segment::MAX_SACK_BLOCKS;
+const size_t jstp_segment::SACK_BLOCK_SIZE;
+const size_t jstp_segment::MAX_HEADER_SIZE;
+const size_t jstp_segment::CONNECTION_ID_SIZE;
+const size_t jstp_segment::CHECKSUM_SIZE;
 
 //Getters for header data:
 uint32_t jstp_segment::get_sequence(){
@@ -36,7 +41,7 @@ uint32_t jstp_segment::get_window(){
 }
 
 uint32_t jstp_segment::get_length(){
-    return payload.size();
+    return length;
 }
 
 bool jstp_segment::get_syn_flag(){
@@ -51,6 +56,26 @@ bool jstp_segment::get_exit_flag(){
     return (flags >> 13) & 1;
 }
 
+bool jstp_segment::get_sack_flag(){
+    return (flags >> 12) & 1;
+}
+
+bool jstp_segment::get_framing_flag(){
+    return (flags >> 11) & 1;
+}
+
+bool jstp_segment::get_connection_flag(){
+    return (flags >> 10) & 1;
+}
+
+bool jstp_segment::get_checksum_flag(){
+    return (flags >> 9) & 1;
+}
+
+uint32_t jstp_segment::get_connection_id(){
+    return connection_id;
+}
+
 //Setters for header data:
 void jstp_segment::set_sequence(uint32_t in){
     sequence = in;
@@ -76,6 +101,24 @@ void jstp_segment::set_exit_flag(){
     flags |= 1 << 13;
 }
 
+void jstp_segment::set_sack_flag(){
+    flags |= 1 << 12;
+}
+
+void jstp_segment::set_framing_flag(){
+    flags |= 1 << 11;
+}
+
+//Setting the ID always sets the flag, even to zero
+void jstp_segment::set_connection_id(uint32_t id){
+    flags |= 1 << 10;
+    connection_id = id;
+}
+
+void jstp_segment::set_checksum_flag(){
+    flags |= 1 << 9;
+}
+
 void jstp_segment::reset_syn_flag(){
     flags &= ~(1 << 15);
 }
@@ -88,9 +131,57 @@ void jstp_segment::reset_exit_flag(){
     flags &= ~(1 << 13);
 }
 
+void jstp_segment::reset_sack_flag(){
+    flags &= ~(1 << 12);
+    sack_blocks.clear();
+}
+
+void jstp_segment::reset_framing_flag(){
+    flags &= ~(1 << 11);
+}
+
+void jstp_segment::reset_connection_flag(){
+    flags &= ~(1 << 10);
+    connection_id = 0;
+}
+
+void jstp_segment::reset_checksum_flag(){
+    flags &= ~(1 << 9);
+}
+
+//A SYN or SYN-ACK only says the host can check checksums, it has no field
+bool jstp_segment::checksummed(){
+    return get_checksum_flag() && !get_syn_flag();
+}
+
+//Right after the connection ID, so everything in front of it is fixed
+size_t jstp_segment::checksum_offset(){
+    return HEADER_SIZE + (get_connection_flag() ? CONNECTION_ID_SIZE : 0);
+}
+
+//Interface for SACK blocks, anything past MAX_SACK_BLOCKS is dropped
+void jstp_segment::set_sack_blocks(const vector<sack_block>& in){
+    sack_blocks.assign(in.begin(), 
+                       in.begin() + std::min(in.size(), MAX_SACK_BLOCKS));
+    set_sack_flag();
+}
+
+const vector<sack_block>& jstp_segment::get_sack_blocks(){
+    return sack_blocks;
+}
+
+size_t jstp_segment::sack_size(){
+    if(!get_sack_flag()){
+        return 0;
+    }
+    return 2 + SACK_BLOCK_SIZE * sack_blocks.size();
+}
+
 //Interface for payload
 void jstp_segment::clear_payload(){
     payload.clear();
+    payload_view = nullptr;
+    length = 0;
 }
 
 //Set the payload from an input vector
@@ -98,83 +189,196 @@ void jstp_segment::set_payload(const vector<uint8_t>& in){
     if(in.size() > MAX_PAYLOAD_SIZE){
         //TODO error condition 
     }
-    payload.reserve(in.size());
-    copy(in.begin(), in.end(), back_inserter(payload));
+    payload_view = nullptr;
+    payload.assign(in.begin(), in.end());
+    length = payload.size();
+}
+
+//Add raw bytes to the end of the payload in one go
+void jstp_segment::append_payload(const uint8_t* data, size_t n){
+    own_payload();
+    payload.insert(payload.end(), data, data + n);
+    length = payload.size();
 }
 
 const vector<uint8_t> jstp_segment::get_payload(){
-    return payload;
+    return vector<uint8_t>(payload_data(), payload_data() + length);
+}
+
+const uint8_t* jstp_segment::payload_data(){
+    return payload_view ? payload_view : payload.data();
 }
 
 vector<uint8_t>::const_iterator jstp_segment::payload_begin(){
+    own_payload();
     return payload.cbegin();
 }
 
 vector<uint8_t>::const_iterator jstp_segment::payload_end(){
+    own_payload();
     return payload.cend();
 }
 
+//Copy a payload we only have a view of into our own storage
+void jstp_segment::own_payload(){
+    if(payload_view){
+        payload.assign(payload_view, payload_view + length);
+        payload_view = nullptr;
+    }
+}
+
 //Serialize and Deserialize methods, required in order to make this class
-//serializable.
+//serializable. Both are built on the in place versions below.
 vector<uint8_t> jstp_segment::serialize(){
-    //First reserve the necessary size for the vector
-    vector<uint8_t> out;
-    out.reserve(HEADER_SIZE + payload.size());
-
-    //For each header field, we need to convert the number to network order then
-    //cast the number to uint8s and write them to the data output.
-    uint8_t arr[4];
-
-    uint32_t sequence_net = htonl(sequence);
-    memcpy(arr, &sequence_net, 4);
-    copy(arr, arr + 4, back_inserter(out));
+    vector<uint8_t> out(MAX_HEADER_SIZE + length);
+    size_t header_length = serialize_header(out.data(), length);
+    memcpy(out.data() + header_length, payload_data(), length);
+    out.resize(header_length + length);
+    if(checksummed()){
+        seal(out.data(), crc32c(0, out.data(), out.size()));
+    }
+    return out;
+}
 
-    uint32_t ack_net = htonl(ack);
-    memcpy(arr, &ack_net, 4);
-    copy(arr, arr + 4, back_inserter(out));
+//Anything which doesn't parse, a segment with a bad checksum included, comes
+//out as a blank segment with no flags so nobody mistakes it for anything.
+void jstp_segment::deserialize(const vector<uint8_t>& v){
+    clear_payload();
+    if(parse(v.data(), v.size())){
+        own_payload();
+    }
+    else{
+        *this = jstp_segment();
+    }
+}
 
-    uint32_t window_net = htonl(window);
-    memcpy(arr, &window_net, 4);
-    copy(arr, arr + 4, back_inserter(out));
+//Small helpers for writing and reading network order fields through a cursor
+static void put_16(uint8_t*& out, uint16_t in){
+    uint16_t net = htons(in);
+    memcpy(out, &net, 2); out += 2;
+}
 
-    uint32_t length_net = htonl(payload.size());
-    memcpy(arr, &length_net, 4);
-    copy(arr, arr + 4, back_inserter(out));
+static void put_32(uint8_t*& out, uint32_t in){
+    uint32_t net = htonl(in);
+    memcpy(out, &net, 4); out += 4;
+}
 
-    uint16_t flags_net = htons(flags);
-    memcpy(arr, &flags_net, 2);
-    copy(arr, arr + 2, back_inserter(out));
+static uint16_t get_16(const uint8_t*& in){
+    uint16_t net;
+    memcpy(&net, in, 2); in += 2;
+    return ntohs(net);
+}
 
-    //Lastly, copy the payload over into the serialized data and return it
-    copy(payload.begin(), payload.end(), back_inserter(out));
-    return out;
+static uint32_t get_32(const uint8_t*& in){
+    uint32_t net;
+    memcpy(&net, in, 4); in += 4;
+    return ntohl(net);
 }
 
-void jstp_segment::deserialize(const vector<uint8_t>& v){
-    auto ptr = v.data();
+//Write the headers for a payload of payload_length bytes to out, which must
+//have room for MAX_HEADER_SIZE bytes. Returns how many bytes were written.
+size_t jstp_segment::serialize_header(uint8_t* out, size_t payload_length){
+    uint8_t* ptr = out;
+    put_32(ptr, sequence);
+    put_32(ptr, ack);
+    put_32(ptr, window);
+    put_32(ptr, payload_length);
+    put_16(ptr, flags);
+
+    //The connection ID comes first so it is always in the same place, the
+    //checksum is filled in by seal once the rest is known
+    if(get_connection_flag()){
+        put_32(ptr, connection_id);
+    }
+    if(checksummed()){
+        put_32(ptr, 0);
+    }
 
-    uint32_t sequence_net;
-    memcpy(&sequence_net, ptr, 4); ptr += 4;
-    sequence = ntohl(sequence_net);
+    //If the SACK flag is set, the blocks go between the header and payload
+    if(get_sack_flag()){
+        put_16(ptr, sack_blocks.size());
+        for(const sack_block& block: sack_blocks){
+            put_32(ptr, block.left);
+            put_32(ptr, block.right);
+        }
+    }
+    return ptr - out;
+}
 
-    uint32_t ack_net;
-    memcpy(&ack_net, ptr, 4); ptr += 4;
-    ack = ntohl(ack_net);
+void jstp_segment::seal(uint8_t* header, uint32_t crc){
+    uint8_t* ptr = header + checksum_offset();
+    put_32(ptr, crc);
+}
 
-    uint32_t window_net;
-    memcpy(&window_net, ptr, 4); ptr += 4;
-    window = ntohl(window_net);
+//Read the headers out of size bytes of data, the payload is left in place
+bool jstp_segment::parse(const uint8_t* data, size_t size){
+    if(size < HEADER_SIZE){
+        return false;
+    }
+    const uint8_t* ptr = data;
+    const uint8_t* end = data + size;
+    sequence = get_32(ptr);
+    ack = get_32(ptr);
+    window = get_32(ptr);
+    uint32_t claimed_length = get_32(ptr);
+    flags = get_16(ptr);
+
+    //A connection ID that got cut off doesn't make a segment
+    connection_id = 0;
+    if(get_connection_flag()){
+        if(end - ptr < (long)CONNECTION_ID_SIZE){
+            return false;
+        }
+        connection_id = get_32(ptr);
+    }
 
-    uint32_t length_net;
-    memcpy(&length_net, ptr, 4); ptr += 4;
-    uint32_t length = ntohl(length_net);
+    //Run the CRC over everything as if the checksum field were still zero,
+    //a segment which doesn't match got mangled on the way.
+    if(checksummed()){
+        if(end - ptr < (long)CHECKSUM_SIZE){
+            return false;
+        }
+        uint32_t claimed_crc = get_32(ptr);
+        static const uint8_t zeros[CHECKSUM_SIZE] = {0, 0, 0, 0};
+        size_t field = checksum_offset();
+        uint32_t crc = crc32c(0, data, field);
+        crc = crc32c(crc, zeros, CHECKSUM_SIZE);
+        crc = crc32c(crc, ptr, end - ptr);
+        if(crc != claimed_crc){
+            return false;
+        }
+    }
 
-    uint16_t flags_net;
-    memcpy(&flags_net, ptr, 2); ptr += 2;
-    flags = ntohs(flags_net);
+    //Pull out the SACK blocks if there are any. No sender puts more than
+    //MAX_SACK_BLOCKS in a segment, and the blocks it says are there have to
+    //actually be there, anything else is garbage and not a segment.
+    sack_blocks.clear();
+    if(get_sack_flag()){
+        if(end - ptr < 2){
+            return false;
+        }
+        uint16_t count = get_16(ptr);
+        if(count > MAX_SACK_BLOCKS || 
+           end - ptr < (long)(count * SACK_BLOCK_SIZE)){
+            return false;
+        }
+        for(uint16_t i = 0; i < count; i++){
+            sack_block block;
+            block.left = get_32(ptr);
+            block.right = get_32(ptr);
+            sack_blocks.push_back(block);
+        }
+    }
 
+    //Same for the payload, a datagram cut short of the length it claims
+    //doesn't get delivered as a shorter segment.
+    if(end - ptr < (long)claimed_length){
+        return false;
+    }
     payload.clear();
-    copy(v.begin() + 18, v.begin() + 18 + length, back_inserter(payload));
+    payload_view = ptr;
+    length = claimed_length;
+    return true;
 }
 
 //Get a string summarizing the headers
@@ -194,9 +398,28 @@ string jstp_segment::header_str(){
         oss << "ACK, "; 
    }
    if(get_exit_flag()){
-        oss << "EXIT"; 
+        oss << "EXIT, "; 
+   }
+   if(get_sack_flag()){
+        oss << "SACK, "; 
+   }
+   if(get_framing_flag()){
+        oss << "FRAMING, "; 
+   }
+   if(get_connection_flag()){
+        oss << "CONNECTION, "; 
+   }
+   if(get_checksum_flag()){
+        oss << "CHECKSUM"; 
    }
    oss << endl;
+   if(get_connection_flag()){
+       oss << "    Connection ID   = " << connection_id << endl;
+   }
+   for(const sack_block& block: sack_blocks){
+       oss << "    SACK Block      = " << block.left << " - " 
+           << block.right << endl;
+   }
    return oss.str();
 }
 
@@ -204,8 +427,7 @@ string jstp_segment::header_str(){
 string jstp_segment::payload_str(){
     ostringstream oss;
     oss << "Payload for JSTP segment:" << endl << "    ";
-    string s;
-    copy(payload.begin(), payload.end(), back_inserter(s));
+    string s(payload_data(), payload_data() + length);
     oss << s;
     return oss.str();
 }
@@ -8,14 +8,48 @@
  *     A 32 bit window size
  *     A 32 bit length field (Length of the payload in bytes)
  *     A 16 bit flag field   (described below)
+ *     An optional 32 bit connection ID (described below)
+ *     An optional 32 bit checksum (described below)
+ *     An optional list of SACK blocks (described below)
  *     A variable ammount of payload data
  * All multibyte fields are manipulated in host byte ordering but when
  * serialized will be represented in a compatible format.
  */
 
 /* The JSTP flag field consists of 16 bits. 
- * The first three most sygnificant bits represent the SYN, ACK, and EXIT
- * flags, the remaining bits are reserved and unused.
+ * The first seven most sygnificant bits represent the SYN, ACK, EXIT, SACK,
+ * FRAMING, CONNECTION and CHECKSUM flags, the remaining bits are reserved and
+ * unused. FRAMING only means anything on a SYN or SYN-ACK, where it says the
+ * host can read file messages in the binary framing. Hosts which don't know
+ * about it leave it clear and everyone sticks to the text format.
+ */
+
+/* On a SYN segment (and the SYN-ACK answering it) the window field carries the
+ * largest segment, headers included, the sender of the segment is able to
+ * receive. Zero means the default size. Both hosts use the smaller of the two.
+ */
+
+/* When the CONNECTION flag is set the fixed header is followed by a 32 bit
+ * connection ID. A server sharing one socket between all of its streams uses
+ * it to tell whose segment is whose, so once a connection has an ID every
+ * segment on it carries it. On a SYN the ID is zero and the flag only says the
+ * client can do this, the server picks the ID and hands it back on the SYN-ACK.
+ * A SYN-ACK without the flag means each side has a socket of its own.
+ */
+
+/* When the CHECKSUM flag is set the connection ID, or the fixed header if there
+ * isn't one, is followed by the CRC32C of the whole segment as it was sent,
+ * headers and payload, worked out with the checksum field itself zeroed. A
+ * segment which doesn't match it is dropped as if it had been lost. On a SYN
+ * or SYN-ACK the flag carries no checksum and only says the host can check
+ * them, once both have said so every other segment carries one.
+ */
+
+/* When the SACK flag is set, the fixed header is followed by a 16 bit count of
+ * SACK blocks and then that many pairs of 32 bit sequence numbers. Each pair
+ * is the first byte and one past the last byte of a range the sender of the
+ * segment has received out of order. On a SYN segment the flag carries no
+ * blocks and instead signals that the host understands them.
  */
 
 #pragma once
@@ -25,16 +59,41 @@
 #include <string>
 #include "udp_socket.hpp"
 
+//A range of sequence numbers which the receiver holds, right is one past the
+//last byte received.
+struct sack_block{
+    uint32_t left;
+    uint32_t right;
+};
+
 //Inherit serializable so that we can esily send and receive over UDP
 class jstp_segment: public serializable{
     public:
 
-        //Constants which define the max segment size and the max payload size
-        //for the segment. These values differ by exactly the size of the
-        //headers. Length of headers = 18.
-        static const size_t MAX_SEGMENT_SIZE = 1024;
+        //Constants which define segment sizes, headers included. Streams
+        //agree on a segment size during the handshake, a host which doesn't
+        //say what it can take gets the default. The max is the biggest UDP
+        //datagram IPv4 can carry. Payload sizes differ from these by exactly
+        //the size of the headers. Length of headers = 18.
+        static const size_t DEFAULT_SEGMENT_SIZE = 1024;
+        static const size_t MIN_SEGMENT_SIZE = 576;
+        static const size_t MAX_SEGMENT_SIZE = 65507;
         static const size_t HEADER_SIZE = 18;
-        static const size_t MAX_PAYLOAD_SIZE = 1006;
+        static const size_t MAX_PAYLOAD_SIZE = 65489;
+
+        //A segment carries at most this many SACK blocks, the space they take
+        //up comes out of the payload.
+        static const size_t MAX_SACK_BLOCKS = 4;
+        static const size_t SACK_BLOCK_SIZE = 8;
+
+        //Size of the connection ID and the checksum, when there are any
+        static const size_t CONNECTION_ID_SIZE = 4;
+        static const size_t CHECKSUM_SIZE = 4;
+
+        //The most header a segment can have, the fixed part plus a connection
+        //ID, a checksum and a full set of SACK blocks. A buffer this big
+        //always fits serialize_header.
+        static const size_t MAX_HEADER_SIZE = 60;
 
         //Explicitly only the default constructor, default move copy etc. should
         //all be just fine, we just use STL in this class.
@@ -48,6 +107,11 @@ class jstp_segment: public serializable{
         bool get_syn_flag();
         bool get_ack_flag();
         bool get_exit_flag();
+        bool get_sack_flag();
+        bool get_framing_flag();
+        bool get_connection_flag();
+        bool get_checksum_flag();
+        uint32_t get_connection_id();
 
         //Setters for header data
         void set_sequence(uint32_t);
@@ -57,14 +121,30 @@ class jstp_segment: public serializable{
         void set_syn_flag();
         void set_ack_flag();
         void set_exit_flag();
+        void set_sack_flag();
+        void set_framing_flag();
+        void set_connection_id(uint32_t);
+        void set_checksum_flag();
         void reset_syn_flag();
         void reset_ack_flag();
         void reset_exit_flag();
+        void reset_sack_flag();
+        void reset_framing_flag();
+        void reset_connection_flag();
+        void reset_checksum_flag();
+
+        //Interact with the SACK blocks, setting any blocks also sets the SACK
+        //flag. sack_size is the number of bytes the blocks add to the segment.
+        void set_sack_blocks(const std::vector<sack_block>&);
+        const std::vector<sack_block>& get_sack_blocks();
+        size_t sack_size();
 
         //Interact with the payload
         void clear_payload();
         void set_payload(const std::vector<uint8_t>&);
+        void append_payload(const uint8_t*, size_t);
         const std::vector<uint8_t> get_payload();
+        const uint8_t* payload_data();
         std::vector<uint8_t>::const_iterator payload_begin();
         std::vector<uint8_t>::const_iterator payload_end();
 
@@ -73,6 +153,22 @@ class jstp_segment: public serializable{
         std::vector<uint8_t> serialize();
         void deserialize(const std::vector<uint8_t>&);
 
+        //Copy free versions of the above for the data path. serialize_header
+        //writes only the headers for a payload of the given length which the
+        //caller sends from wherever it lives, returning the bytes written.
+        //parse reads the headers in place and leaves the payload where it is,
+        //payload_data points into the given buffer until the payload is
+        //changed so the buffer has to outlive any use of it. Returns false if
+        //the data is too short to be a segment or its checksum is wrong.
+        size_t serialize_header(uint8_t* out, size_t payload_length);
+        bool parse(const uint8_t* data, size_t size);
+
+        //With the CHECKSUM flag set serialize_header leaves the checksum
+        //zeroed. Run crc32c over the headers it wrote and then the payload,
+        //in however many pieces it is in, and seal writes the result into the
+        //headers.
+        void seal(uint8_t* header, uint32_t crc);
+
         //Get strings which summarize the data in the headers and in the
         //payload, this is useful for debugging.
         std::string header_str();
@@ -80,13 +176,27 @@ class jstp_segment: public serializable{
 
     private:
 
-        //Header data, the length header is not maintained separatly because it
-        //is simply the size of the payload std::vector.
-        uint32_t sequence;
-        uint32_t ack;
-        uint32_t window;
-        uint16_t flags;
+        //Whether the headers have a checksum field, and where it goes
+        bool checksummed();
+        size_t checksum_offset();
+
+        //Header data, the length header always matches the payload whether
+        //we own it or it was parsed in place. Everything starts out zeroed so
+        //a fresh segment has no stray flags set.
+        uint32_t sequence = 0;
+        uint32_t ack = 0;
+        uint32_t window = 0;
+        uint32_t length = 0;
+        uint16_t flags = 0;
+        uint32_t connection_id = 0;
 
-        //Payload data
+        //Optional SACK blocks
+        std::vector<sack_block> sack_blocks;
+
+        //Payload data, either owned or a view into somebody else's buffer
         std::vector<uint8_t> payload;
+        const uint8_t* payload_view = nullptr;
+
+        //Turn a payload view into an owned payload before changing it
+        void own_payload();
 };
@@ -2,6 +2,7 @@
 
 #include "jstp_streams.hpp"
 #include "jstp_segment.hpp"
+#include "crc32c.hpp"
 
 #include <string>
 using std::string;
@@ -36,23 +37,169 @@ uint32_t chose_isn(){
     return 42;
 }
 
+const size_t jstp_stream::BASE_SEGMENT_SIZE;
+const size_t jstp_stream::MAX_PROBES;
+const size_t jstp_stream::SYN_TIMEOUT_USECS;
+const size_t jstp_stream::MAX_SYN_TIMEOUT_USECS;
+const size_t jstp_stream::TERMINATION_TRIES;
+const size_t jstp_stream::REACTOR_BATCHES;
+const size_t jstp_acceptor::SYN_MEMORY;
+
+//Keep a segment size the user asked for to something UDP can carry
+static size_t clamp_segment_size(size_t size){
+    return std::max(jstp_segment::MIN_SEGMENT_SIZE, 
+                    min(size, jstp_segment::MAX_SEGMENT_SIZE));
+}
+
+//The sizes path MTU probing tries in turn. Ethernet and jumbo frames less the
+//IP and UDP headers, then the biggest datagram there is.
+static const size_t PROBE_SIZES[] = {1472, 8972, 
+                                     jstp_segment::MAX_SEGMENT_SIZE};
+static const size_t PROBE_SIZE_COUNT = 3;
+
+bool parse_recovery_mode(const string& name, recovery_mode::Enum& mode){
+    if(name == "go-back-n"){
+        mode = recovery_mode::GO_BACK_N;
+    }
+    else if(name == "selective"){
+        mode = recovery_mode::SELECTIVE_REPEAT;
+    }
+    else{
+        return false;
+    }
+    return true;
+}
+
 //Constructor, only thing we need to do for the connector class
-jstp_connector::jstp_connector(string h, uint16_t p): hostname(h), port(p){}
+jstp_connector::jstp_connector(string h, uint16_t p, jstp_reactor* r, 
+                               bool c):
+    hostname(h), port(p), reactor(r), checksums(c), synack_drops(0){}
 
-//Constructor for the jstp acceptor, also the only thing we need to do for this
-//class, the default destructor should do just fine.
-jstp_acceptor::jstp_acceptor(uint16_t portno):
-    acceptor_socket(jstp_segment::MAX_SEGMENT_SIZE){
+void jstp_connector::drop_synacks(size_t n){
+    synack_drops = n;
+}
+
+//Constructor for the jstp acceptor. A shared socket gets data from every
+//stream as well as SYNs, so it has to take segments as big as any of them.
+jstp_acceptor::jstp_acceptor(uint16_t portno, jstp_reactor* r, bool share,
+                             bool reuse_port):
+    acceptor_socket(share && r ? jstp_segment::MAX_SEGMENT_SIZE
+                               : jstp_segment::DEFAULT_SEGMENT_SIZE), 
+    reactor(r), shared(share && r), next_connection_id(chose_isn()){
     
     //Bind the socket to the specified port
+    if(reuse_port){
+        acceptor_socket.set_reuse_port();
+    }
     acceptor_socket.bind_local(portno);
+
+    //When sharing, the reactor reads the socket for us from now on
+    if(shared){
+        reactor->add(this);
+    }
+}
+
+//Every stream sharing the socket has to be gone by now
+jstp_acceptor::~jstp_acceptor(){
+    if(shared){
+        reactor->remove(this);
+    }
+}
+
+//Sort out everything waiting on the shared socket, called by the reactor. SYNs
+//are queued up for whoever is making the next stream, anything else goes to
+//the stream with its connection ID. Segments for streams we don't know about
+//or which don't have an ID are dropped.
+void jstp_acceptor::demux(){
+    const uint8_t* raw[udp_socket::MAX_BATCH];
+    size_t raw_lengths[udp_socket::MAX_BATCH];
+    sockaddr_in from[udp_socket::MAX_BATCH];
+    timeval tv = {0, 0};
+    unique_lock<mutex> l(demux_mutex);
+    for(size_t batches = 0; batches < jstp_stream::REACTOR_BATCHES; 
+        batches++){
+        size_t received = acceptor_socket.recv_batch(raw, raw_lengths, 
+                                                     udp_socket::MAX_BATCH,
+                                                     true, tv, from);
+        for(size_t i = 0; i < received; i++){
+            if(!demux_seg.parse(raw[i], raw_lengths[i])){
+                continue;
+            }
+            if(demux_seg.get_syn_flag()){
+                //Check for room first, a SYN we remember but didn't queue
+                //would never be let in when the client sends it again
+                if(pending_syns.size() < SYN_MEMORY &&
+                   first_syn(from[i], demux_seg.get_sequence())){
+                    demux_seg.clear_payload();
+                    pending_syns.push_back(pending_syn{demux_seg, from[i]});
+                    syn_ready.notify_one();
+                }
+                continue;
+            }
+            auto found = connections.find(demux_seg.get_connection_id());
+            if(demux_seg.get_connection_flag() && found != connections.end() &&
+               found->second != nullptr){
+                found->second->deliver(demux_seg);
+            }
+        }
+        if(received < udp_socket::MAX_BATCH){
+            break;
+        }
+    }
+}
+
+//Wait for the demux to find a SYN for us
+void jstp_acceptor::next_syn(jstp_segment& seg, sockaddr_in& from){
+    unique_lock<mutex> l(demux_mutex);
+    syn_ready.wait(l, [this](){ return !pending_syns.empty(); });
+    seg = pending_syns.front().seg;
+    from = pending_syns.front().from;
+    pending_syns.pop_front();
+}
+
+//Pick an ID nobody is using, never zero. Nothing goes to the stream until it
+//is attached.
+uint32_t jstp_acceptor::reserve_connection_id(){
+    unique_lock<mutex> l(demux_mutex);
+    while(next_connection_id == 0 || connections.count(next_connection_id)){
+        next_connection_id++;
+    }
+    connections[next_connection_id] = nullptr;
+    return next_connection_id++;
+}
+
+void jstp_acceptor::attach(uint32_t id, jstp_stream* stream){
+    unique_lock<mutex> l(demux_mutex);
+    connections[id] = stream;
+}
+
+//Once this returns the demux won't touch the stream again
+void jstp_acceptor::detach(uint32_t id){
+    unique_lock<mutex> l(demux_mutex);
+    connections.erase(id);
+}
+
+//Remember the SYN, returns false if we have already seen it
+bool jstp_acceptor::first_syn(const sockaddr_in& addr, uint32_t isn){
+    syn_key key((uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port, isn);
+    if(!recent_syns.insert(key).second){
+        return false;
+    }
+    syn_order.push_back(key);
+    if(syn_order.size() > SYN_MEMORY){
+        recent_syns.erase(syn_order.front());
+        syn_order.pop_front();
+    }
+    return true;
 }
 
 //Constructor for the jstp_stream on the client side
 jstp_stream::jstp_stream(jstp_connector& connector, double probability_loss, 
-                         size_t w):
-    stream_sock(jstp_segment::MAX_SEGMENT_SIZE, 0), 
-    window_limit(w){
+                         size_t w, recovery_mode::Enum m, 
+                         congestion_type::Enum c, size_t s):
+    stream_sock(clamp_segment_size(s), 0), 
+    window_limit(w), mode(m),
+    send_buffer(BUFF_CAPACITY), recv_buffer(BUFF_CAPACITY){
     
     //Bind the stream socket to any local port
     stream_sock.bind_local_any();
@@ -67,44 +214,121 @@ jstp_stream::jstp_stream(jstp_connector& connector, double probability_loss,
     jstp_segment syn_seg;
     syn_seg.set_syn_flag();
     syn_seg.set_sequence(our_isn);
+    syn_seg.set_window(stream_sock.get_max_segment_size());
+    if(mode == recovery_mode::SELECTIVE_REPEAT){
+        syn_seg.set_sack_flag();
+    }
+    syn_seg.set_framing_flag();
+    if(connector.checksums){
+        syn_seg.set_checksum_flag();
+    }
+    syn_seg.set_connection_id(0);
     stream_sock.send(syn_seg);
 
-    //Nice! We need to receive a synack now. TODO add timeout to udp socket recv
-    //so that we can address the loss of the syn or synack segemnt
+    //Nice! We need to receive a synack now. The syn can get dropped if the
+    //acceptor is busy with lots of other clients, so keep sending it until
+    //the synack answering it shows up. If it was the synack that got lost
+    //the server sends it again on its own.
     jstp_segment synack_seg;
-    stream_sock.recv(synack_seg);
+    size_t syn_wait = SYN_TIMEOUT_USECS;
+    while(true){
+        timeval tv;
+        tv.tv_sec = syn_wait / 1000000;
+        tv.tv_usec = syn_wait % 1000000;
+        if(stream_sock.recv(synack_seg, true, tv) && 
+           synack_seg.get_syn_flag() && synack_seg.get_ack_flag() &&
+           synack_seg.get_ack() == our_isn + 1){
+            if(connector.synack_drops == 0){
+                break;
+            }
+            connector.synack_drops--;
+            continue;
+        }
+        stream_sock.send(syn_seg);
+        syn_wait = min(2 * syn_wait, MAX_SYN_TIMEOUT_USECS);
+    }
 
     //The server will have used a different ephemeral port to send that synack,
     //switch to the other socket. TODO update peer method?
     sockaddr_in server_stream_addr = stream_sock.get_last_addr();
     stream_sock.set_peer(server_stream_addr);
 
-    //The synack should contain the servers initial sequence number
+    //The synack should contain the servers initial sequence number and tell
+    //us if the server is willing to send SACK blocks.
     uint32_t server_isn = synack_seg.get_sequence();
+    sack_enabled = synack_seg.get_sack_flag();
+    binary_framing = synack_seg.get_framing_flag();
+    checksums = connector.checksums && synack_seg.get_checksum_flag();
+
+    //If the server is sharing its socket it gave us an ID to put on
+    //everything, which comes out of the payload.
+    connection_id = synack_seg.get_connection_id();
+    shared_acceptor = nullptr;
+    header_size = jstp_segment::HEADER_SIZE + 
+                  (connection_id ? jstp_segment::CONNECTION_ID_SIZE : 0) +
+                  (checksums ? jstp_segment::CHECKSUM_SIZE : 0);
+    agree_segment_size(synack_seg.get_window(), c);
 
     stream_sock.set_loss_probability(probability_loss);
+    synack_pending.store(false);
     //TODO use the real numbers we got
-    init(our_isn + 1, server_isn + 1);
+    init(our_isn + 1, server_isn + 1, connector.reactor);
+
+    //Ack the synack straight away, until the server hears from us it keeps
+    //sending it again.
+    force_send.store(true);
+    wake_sender();
 }
 
 //Constructor for JSTP stream on the server side
 jstp_stream::jstp_stream(jstp_acceptor& acceptor, double probability_loss,
-                         size_t w):
-    stream_sock(jstp_segment::MAX_SEGMENT_SIZE, 0),
-    window_limit(w){
-
-    //First, lets wait for a syn segment to come in
+                         size_t w, recovery_mode::Enum m,
+                         congestion_type::Enum c, size_t s):
+    stream_sock(clamp_segment_size(s), 0),
+    window_limit(w), mode(m),
+    send_buffer(BUFF_CAPACITY), recv_buffer(BUFF_CAPACITY){
+
+    //First, lets wait for a syn segment to come in. A shared socket is read
+    //by the reactor, it passes SYNs on to us.
     jstp_segment syn_seg; 
-    while(!syn_seg.get_syn_flag()){
-        acceptor.acceptor_socket.recv(syn_seg); 
+    sockaddr_in client_addr;
+    if(acceptor.shared){
+        acceptor.next_syn(syn_seg, client_addr);
+    }
+    else{
+        while(true){
+            acceptor.acceptor_socket.recv(syn_seg); 
+            if(syn_seg.get_syn_flag() && 
+               acceptor.first_syn(acceptor.acceptor_socket.get_last_addr(),
+                                  syn_seg.get_sequence())){
+                break;
+            }
+        }
+        client_addr = acceptor.acceptor_socket.get_last_addr();
     }
 
     //Now that we got a syn segment, we know the clients isn
     uint32_t other_isn = syn_seg.get_sequence();
 
-    //Now we can bind our socket and set our peer
-    stream_sock.bind_local_any();
-    stream_sock.set_peer(acceptor.acceptor_socket.get_last_addr());
+    //Now we can bind our socket, or borrow the acceptor's if the client can
+    //use a connection ID, and set our peer
+    connection_id = 0;
+    shared_acceptor = nullptr;
+    if(acceptor.shared && syn_seg.get_connection_flag()){
+        connection_id = acceptor.reserve_connection_id();
+        shared_acceptor = &acceptor;
+        stream_sock.share(acceptor.acceptor_socket);
+    }
+    else{
+        stream_sock.bind_local_any();
+    }
+    stream_sock.set_peer(client_addr);
+
+    //Checksums are up to the client, checking them is never a problem for us
+    checksums = syn_seg.get_checksum_flag();
+    header_size = jstp_segment::HEADER_SIZE + 
+                  (connection_id ? jstp_segment::CONNECTION_ID_SIZE : 0) +
+                  (checksums ? jstp_segment::CHECKSUM_SIZE : 0);
 
     //Time to chose our own initial sequence numebr
     uint32_t our_isn = chose_isn();
@@ -115,19 +339,70 @@ jstp_stream::jstp_stream(jstp_acceptor& acceptor, double probability_loss,
     synack_seg.set_ack_flag();
     synack_seg.set_ack(other_isn + 1);
     synack_seg.set_sequence(our_isn);
+    if(connection_id){
+        synack_seg.set_connection_id(connection_id);
+    }
 
-    //Send the synack back
-    stream_sock.send(synack_seg);
+    //Tell the client how big a segment we can take, we both go with the
+    //smaller of that and what it can take.
+    synack_seg.set_window(stream_sock.get_max_segment_size());
+    agree_segment_size(syn_seg.get_window(), c);
+
+    //Agree to use SACK blocks only if the client asked for them and we are
+    //doing selective repeat ourselves.
+    sack_enabled = syn_seg.get_sack_flag() && 
+                   mode == recovery_mode::SELECTIVE_REPEAT;
+    if(sack_enabled){
+        synack_seg.set_sack_flag();
+    }
+
+    //Same for the binary file message framing, we can always read it
+    binary_framing = syn_seg.get_framing_flag();
+    if(binary_framing){
+        synack_seg.set_framing_flag();
+    }
+    if(checksums){
+        synack_seg.set_checksum_flag();
+    }
 
     stream_sock.set_loss_probability(probability_loss);
 
-    //TODO wait for normal ack back
-    init(our_isn + 1, other_isn + 1);       //TODO make this real
+    //The timer resends the synack until the client's first segment shows up
+    synack = synack_seg;
+    synack_sent_at = std::chrono::steady_clock::now();
+    synack_wait = SYN_TIMEOUT_USECS;
+    synack_pending.store(true);
+    init(our_isn + 1, other_isn + 1, acceptor.reactor);  //TODO make this real
+
+    //Only send the synack back once we are ready for whatever the client
+    //sends next, on a shared socket that means being attached first.
+    if(shared_acceptor){
+        acceptor.attach(connection_id, this);
+    }
+    stream_sock.send(synack_seg);
+}
+
+//Use the smaller of our segment size and the peer's, a peer which doesn't say
+//gets the default. The congestion controller counts in full segments so it
+//can only be made once we know how big they are.
+void jstp_stream::agree_segment_size(size_t peer_segment_size, 
+                                     congestion_type::Enum c){
+    if(peer_segment_size == 0){
+        peer_segment_size = jstp_segment::DEFAULT_SEGMENT_SIZE;
+    }
+    agreed_segment_size = min(stream_sock.get_max_segment_size(), 
+                              clamp_segment_size(peer_segment_size));
+    segment_size = agreed_segment_size;
+    congestion = make_congestion_controller(c, window_limit, 
+                            agreed_segment_size - header_size);
+    probing = false;
+    probe_outstanding = false;
 }
 
 //Function which initalizes all variables and starts threads for both
 //constructors
-void jstp_stream::init(uint32_t init_seq, uint32_t init_ack){
+void jstp_stream::init(uint32_t init_seq, uint32_t init_ack, 
+                       jstp_reactor* r){
 
     //Set the initial sequence and ack numbers
     sender_base_sequence = init_seq;
@@ -145,31 +420,80 @@ void jstp_stream::init(uint32_t init_seq, uint32_t init_ack){
 
     //The send buffer and associated things
     offset = 0;
+    retransmit_pending.store(false);
+    in_recovery = false;
+    recovery_point = init_seq;
+    retransmit_next = 0;
+    dup_acks = 0;
+    dup_acks_owed.store(0);
+    high_water = 0;
+    retransmitted_bytes.store(0);
+    queued_total = 0;
+    acked_total = 0;
+    batch_size = 0;
+
+    //The reassembly buffer starts out empty at stream offset zero
+    reassembly_bytes = 0;
+    recv_offset = 0;
+    last_stored_key = 0;
+    last_new_ack = std::chrono::steady_clock::now();
+    timing = false;
+    sender_woken = false;
+    termination_tries = TERMINATION_TRIES;
+    exit_timer_running = false;
+    exit_sent = false;
+    exit_due.store(false);
+    exit_owed.store(false);
+    exit_acked.store(false);
         
-    //Start the threads, make sure this is the last thing init does
+    //Start the threads or hand ourselves to the reactor, make sure this is
+    //the last thing init does
+    reactor = r;
+    timer_tick = 0;
+    queued.store(false);
     running.store(true);
     closing.store(false);
     terminating.store(false);
-    sender_thread = thread(&jstp_stream::sender_main, this);
-    receiver_thread = thread(&jstp_stream::receiver_main, this);
+    if(reactor){
+        reactor->add(this);
+    }
+    else{
+        sender_thread = thread(&jstp_stream::sender_main, this);
+        receiver_thread = thread(&jstp_stream::receiver_main, this);
+    }
 }
 
 //Destructor
 jstp_stream::~jstp_stream(){
     closing.store(true);
 
+    //On a reactor there are no threads to join, wait for it to finish the
+    //closing handshake for us and then take ourselves off
+    if(reactor){
+        reactor->wake(this);
+        {
+            unique_lock<mutex> l(sender_notify_lock);
+            stopped.wait(l, [this](){ return !running.load(); });
+        }
+        if(shared_acceptor){
+            shared_acceptor->detach(connection_id);
+        }
+        reactor->remove(this);
+    }
+
     //Now we need to join both threads
-    sender_thread.join();
-    receiver_thread.join();
+    else{
+        sender_thread.join();
+        receiver_thread.join();
+    }
+
+#ifdef JSTP_DEBUG
+    cout << get_rtt_stats().str();
+#endif
 }
 
 //The thread for the sender function
 void jstp_stream::sender_main(){
-
-    //How many times we will try to send a terminate message before quitting our
-    //of frustration
-    int termination_tries = 5;
-
     //The main sender loop runs as long as the running var is set
     bool nap = true;
     while(running.load()){
@@ -181,111 +505,347 @@ void jstp_stream::sender_main(){
         //iteration.
         if(nap){
             unique_lock<mutex> l(sender_notify_lock);
-            sender_condition_var.wait(l);
+            sender_condition_var.wait(l, [this](){ return sender_woken; });
+            sender_woken = false;
             nap = false;
         }
+        nap = sender_step();
+    }
+
+#ifdef JSTP_DEBUG
+    cout << "Sender quit" << endl;
+#endif
+}
 
-        //Next, we dicide what to do depending on if the program is currently
-        //terminating or not.
-        if(!terminating){
-            //In the nonterminating case, we need access to the send buffer
-            send_buffer_mutex.lock();
+//One pass of the sender, sends whatever the windows allow in one batch.
+//Returns true if there is nothing more to do until something changes.
+bool jstp_stream::sender_step(){
+    //Next, we dicide what to do depending on if the program is currently
+    //terminating or not.
+    if(!terminating){
+        //In the nonterminating case, we need access to the send buffer
+        send_buffer_mutex.lock();
+
+        //Update the progress codition variable when we are compleetly
+        //cleared
+        if(send_buffer.size() == 0){
+            send_progress.notify_all(); 
+        }
 
-            //Update the flushed codition variable when we are compleetly
-            //cleared
-            if(send_buffer.size() == 0){
-                flushed.notify_all(); 
+        //Our first check should be to see if we are closing...
+        if(closing.load()){
+            //... if we are, then we should do a bit of cleanup before
+            //entering the terminating state.
+            send_buffer.clear(); 
+            self_exit_number.store(sender_base_sequence + offset);
+            offset = 0;
+            data_on_wire.store(false);
+            terminating.store(true);
+
+            //Nothing is getting sent anymore, don't leave a send waiting
+            //on acks which are never going to come.
+            std::vector<std::function<void(bool)>> failed;
+            take_completions(true, failed);
+            send_progress.notify_all();
+            send_buffer_mutex.unlock();
+            for(auto& done: failed){
+                done(false);
             }
+            return false;
+        }
 
-            //Our first check should be to see if we are closing...
-            if(closing.load()){
-                //... if we are, then we should do a bit of cleanup before
-                //entering the terminating state.
-                send_buffer.clear(); 
-                self_exit_number.store(sender_base_sequence + offset);
-                terminating.store(true);
+        //Selective repeat resends only the segment at the base of the
+        //window, the receiver is holding on to everything after it that
+        //made it across.
+        if(retransmit_pending.exchange(false) && offset > 0){
+            size_t length = min(offset, payload_limit());
+            retransmit_next = transmit(0, length);
+        }
+
+        //With SACK we also know where the other holes are, fill in
+        //everything below the highest sacked byte before sending anything
+        //new.
+        else if(in_recovery && sack_enabled){
+            size_t limit = min(scoreboard.highest_sacked(), offset);
+            size_t hole_start, hole_length;
+            if(scoreboard.next_hole(retransmit_next, limit, 
+                                    hole_start, hole_length)){
+                hole_length = min(hole_length, payload_limit());
+                retransmit_next = hole_start + 
+                                  transmit(hole_start, hole_length);
+                flush_batch();
                 send_buffer_mutex.unlock();
-                continue;
+                return false;
             }
+        }
 
-            //Do some simple math to get the length of the longest payload we
-            //are legally allowd to send at this very instant.
-            size_t buffered_data = send_buffer.size() - offset;
-            size_t flow_limit = other_rwnd.load() - offset;
-            size_t wndlim = window_limit - offset; 
-            flow_limit = min(flow_limit, wndlim);
-            size_t payload_size = min(flow_limit, buffered_data);
-            payload_size = min(payload_size, jstp_segment::MAX_PAYLOAD_SIZE);
-
-            //If we dont have a payload and we arent being forced to send...
-            if(!(payload_size > 0) && !force_send.load()){
-                //... then we skip the rest of the loop and nap
-                nap = true; 
-                send_buffer_mutex.unlock();
-                continue;
+        //Get the length of the longest payload we are legally allowd to
+        //send at this very instant.
+        size_t payload_size = sendable_bytes(payload_limit());
+
+        //If we dont have a payload and we arent being forced to send...
+        if(!(payload_size > 0) && !force_send.load()){
+            //... then there is nothing to do until something changes
+            flush_batch();
+            send_buffer_mutex.unlock();
+            return true;
+        }
+
+        //While searching for the path MTU the first segment may go out
+        //at the next size up instead, as long as we can fill it.
+        size_t probe_payload = probe_payload_due();
+        bool probe_now = probe_payload > 0 && 
+                         sendable_bytes(probe_payload) == probe_payload;
+        if(probe_now){
+            payload_size = probe_payload;
+            probe_start = sender_base_sequence + offset;
+        }
+
+        //Send as much of the window as we can in one batch, advancing the
+        //offset by however much of the payload fit in each segment. A
+        //bare ack only goes out if there was no data to carry it.
+        do{
+            payload_size = transmit(offset, payload_size);
+            offset += payload_size;
+            if(probe_now){
+                probe_end = probe_start + payload_size;
+                probe_outstanding = true;
+                probe_now = false;
             }
+            payload_size = sendable_bytes(payload_limit());
+        } while(payload_size > 0 && batch_size < udp_socket::MAX_BATCH);
+
+        //One ack already went out, send the rest of the duplicates we
+        //owe. More than enough to trigger a fast retransmit is no use.
+        size_t owed = min(dup_acks_owed.exchange(0), 
+                          congestion_controller::DUP_ACK_THRESHOLD);
+        for(; owed > 1 && batch_size < udp_socket::MAX_BATCH; owed--){
+            transmit(offset, 0);
+        }
+        
+        //If there is anything on the wire now...
+        if(offset != 0){
+            data_on_wire.store(true); 
+        }
 
-            jstp_segment outgoing_seg;
+        flush_batch();
+        send_buffer_mutex.unlock();
+        return false;
+    }
 
-            //Set all the headers appropriatly
-            if(payload_size > 0){
-                outgoing_seg.set_sequence(sender_base_sequence + offset);
+    //The situation in which we are terminating. The first exit and every
+    //one the termination timer asks for is a try, answering the peer's exit
+    //isn't.
+    else{
+        bool retry = !exit_sent || exit_due.exchange(false);
+        bool answer = exit_owed.exchange(false);
+        if(!retry && !answer){
+            return true;
+        }
+        if(retry){
+            exit_sent = true;
+            if(termination_tries == 0){
+                running.store(false); 
             }
             else{
-                outgoing_seg.set_sequence(0);
+                termination_tries--;
             }
-            outgoing_seg.set_ack(self_ack_number.load());
-            outgoing_seg.set_ack_flag();
-            outgoing_seg.set_window(self_rwnd.load());
+        }
 
-            //Create the payload for the segment
-            vector<uint8_t> outgoing_paylaod;
-            outgoing_paylaod.reserve(payload_size);
-            copy(send_buffer.begin() + offset, 
-                 send_buffer.begin() + offset + payload_size, 
-                 back_inserter(outgoing_paylaod));
+        //The peer's exit number is stored before it is marked as acking
+        //ours, check first so the exit we stop on is sure to answer it
+        bool acked = exit_acked.load();
+        jstp_segment seg;
+        seg.set_sequence(self_exit_number.load());
+        seg.set_ack(peer_exit_number.load());
+        seg.set_ack_flag();
+        seg.set_exit_flag();
+        if(connection_id){
+            seg.set_connection_id(connection_id);
+        }
+        if(checksums){
+            seg.set_checksum_flag();
+        }
+        stream_sock.send(seg);
 
-            //Attach the paylaod to the segment
-            outgoing_seg.set_payload(outgoing_paylaod);
+        //The peer has seen our exit and now knows we saw theirs
+        if(acked){
+            running.store(false);
+        }
+        return true;
+    }
+}
 
-            //Send the segment
-            stream_sock.send(outgoing_seg);
+//Build a segment from length bytes of the send buffer starting at start and
+//send it to our peer. Every segment we send doubles as an ack.
+size_t jstp_stream::transmit(size_t start, size_t length){
+    jstp_segment outgoing_seg;
+
+    //Tell the peer about anything we are holding out of order, the blocks
+    //have to agree with the ack so grab both under the same lock.
+    if(sack_enabled){
+        recv_buffer_mutex.lock();
+        outgoing_seg.set_ack(self_ack_number.load());
+        if(!reassembly_buffer.empty()){
+            outgoing_seg.set_sack_blocks(build_sack_blocks());
+        }
+        recv_buffer_mutex.unlock();
 
-            //Advance the offset by the specified ammount
-            offset += payload_size;
-            
-            //If the length of the segment was nonzero...
-            if(payload_size != 0){
-                data_on_wire.store(true); 
-            }
+        //The blocks come out of the payload, they never make the segment
+        //bigger than we are allowed or than the probe we are sending.
+        size_t room = std::max(length, payload_limit());
+        length = min(length, room - outgoing_seg.sack_size());
+    }
+    else{
+        outgoing_seg.set_ack(self_ack_number.load());
+    }
 
-            //Turn off the force send flag
-            force_send.store(false);
+    //Set all the headers appropriatly
+    if(length > 0){
+        outgoing_seg.set_sequence(sender_base_sequence + start);
+    }
+    else{
+        outgoing_seg.set_sequence(0);
+    }
+    outgoing_seg.set_ack_flag();
+    outgoing_seg.set_window(self_rwnd.load());
+    if(connection_id){
+        outgoing_seg.set_connection_id(connection_id);
+    }
+    if(checksums){
+        outgoing_seg.set_checksum_flag();
+    }
 
-            cout_mutex.lock();
-            cout << "Sending this segment:" << endl;
-            cout << outgoing_seg.header_str() << endl;
-            cout_mutex.unlock();
-            send_buffer_mutex.unlock();
+    //The headers go in the next slot of the batch and the payload is sent
+    //straight out of the send buffer, or out of whatever external memory it
+    //points at. If the payload is in too many pieces to fit in the iovecs it
+    //gets cut short.
+    if(batch_size == udp_socket::MAX_BATCH){
+        flush_batch();
+    }
+    pending_segment& slot = batch[batch_size];
+    byte_span spans[send_queue::MAX_SPANS];
+    size_t span_count = send_buffer.spans(start, length, spans);
+    length = 0;
+    for(size_t i = 0; i < span_count; i++){
+        slot.iov[i + 1].iov_base = const_cast<uint8_t*>(spans[i].data);
+        slot.iov[i + 1].iov_len = spans[i].size;
+        length += spans[i].size;
+    }
+    slot.iov[0].iov_base = slot.header;
+    slot.iov[0].iov_len = outgoing_seg.serialize_header(slot.header, length);
+    if(checksums){
+        uint32_t crc = crc32c(0, slot.header, slot.iov[0].iov_len);
+        for(size_t i = 0; i < span_count; i++){
+            crc = crc32c(crc, spans[i].data, spans[i].size);
         }
+        outgoing_seg.seal(slot.header, crc);
+    }
+    batch_datagrams[batch_size].iov = slot.iov;
+    batch_datagrams[batch_size].count = span_count + 1;
+    batch_size++;
 
-        //The situation in which we are terminating
-        else{
-            if(termination_tries == 0){
-                running.store(false); 
-            }
-            jstp_segment seg;
-            seg.set_sequence(self_exit_number.load());
-            seg.set_ack_flag();
-            seg.set_exit_flag();
-            stream_sock.send(seg);
-            termination_tries--;
-            nap = true;    
+    //The segment is as good as sent, the ack it carries is now up to date
+    force_send.store(false);
+
+    //Keep track of how much of this we've sent before
+    size_t end = start + length;
+    size_t resent = min(end, high_water) - min(start, high_water);
+    retransmitted_bytes += resent;
+    high_water = std::max(high_water, end);
+
+    //A probe we have to resend any part of didn't make it, the path may not
+    //take segments that big.
+    if(probe_outstanding && resent > 0 &&
+       (int32_t)(sender_base_sequence + start - probe_end) < 0 &&
+       (int32_t)(sender_base_sequence + end - probe_start) > 0){
+        probe_finished(false);
+    }
+
+    //Time this segment if nothing else is being timed, but give up on any
+    //measurement as soon as something gets resent since the ack would be
+    //ambiguous.
+    if(resent > 0){
+        timing = false;
+    }
+    else if(!timing && length > 0){
+        timing = true;
+        timed_sequence = sender_base_sequence + end;
+        timed_at = std::chrono::steady_clock::now();
+    }
+
+#ifdef JSTP_DEBUG
+    cout_mutex.lock();
+    cout << "Sending this segment:" << endl;
+    cout << outgoing_seg.header_str() << endl;
+    cout_mutex.unlock();
+#endif
+
+    return length;
+}
+
+//Do some simple math to get the length of the longest new payload the windows
+//allow. Once a window shrinks below what is already on the wire we can't send
+//anything.
+size_t jstp_stream::sendable_bytes(size_t limit){
+    size_t buffered_data = send_buffer.size() - offset;
+    size_t rwnd = other_rwnd.load();
+    size_t flow_limit = rwnd > offset ? rwnd - offset : 0;
+    size_t cwnd = min(window_limit, congestion->get_cwnd());
+    size_t wndlim = cwnd > offset ? cwnd - offset : 0;
+    flow_limit = min(flow_limit, wndlim);
+    size_t payload_size = min(flow_limit, buffered_data);
+    return min(payload_size, limit);
+}
+
+//The most payload a segment may carry at the current segment size
+size_t jstp_stream::payload_limit(){
+    return segment_size - header_size;
+}
+
+//The payload for the next probe, if one is due. Sizes which aren't bigger
+//than what we are already using or are bigger than we agreed on are skipped.
+size_t jstp_stream::probe_payload_due(){
+    if(!probing || probe_outstanding){
+        return 0;
+    }
+    while(probe_index < PROBE_SIZE_COUNT){
+        size_t size = min(PROBE_SIZES[probe_index], agreed_segment_size);
+        if(size > segment_size){
+            return size - header_size;
         }
+        probe_index++;
     }
+    probing = false;
+    return 0;
+}
 
-    //TODO remove this printout
-    cout << "Sender quit" << endl;
+//Move up to the probed size if the probe made it, otherwise keep trying the
+//same size until we've lost too many in a row.
+void jstp_stream::probe_finished(bool acked){
+    probe_outstanding = false;
+    if(acked){
+        segment_size = min(PROBE_SIZES[probe_index], agreed_segment_size);
+        congestion->set_mss(payload_limit());
+        probe_failures = 0;
+        probe_index++;
+    }
+    else if(++probe_failures == MAX_PROBES){
+        probing = false;
+    }
+
+#ifdef JSTP_DEBUG
+    cout << "Probe " << (acked ? "succeeded" : "failed") 
+         << ", segment size " << segment_size << endl;
+#endif
+}
+
+//Send every segment waiting in the batch with as few syscalls as we can
+void jstp_stream::flush_batch(){
+    if(batch_size > 0){
+        stream_sock.send_batch(batch_datagrams, batch_size);
+        batch_size = 0;
+    }
 }
 
 //Receiver thread main function
@@ -296,153 +856,731 @@ void jstp_stream::receiver_main(){
         //First thing we do is try to get a segment out of the socket, we only
         //wait at most one timout interval because we probably have other things
         //to do at that point even if we don't get a segment.
-        jstp_segment incoming_seg;
+        size_t wait = receiver_wait_usecs();
         timeval tv;
-        tv.tv_sec = 0;
-        tv.tv_usec = TIMEOUT_USECS;
-        bool got_segment = stream_sock.recv(incoming_seg, true, tv);
-
-        //In this block we process whatever segment we received
-        if(got_segment){
-            
-            //If the incoming segment carries an exit flag...
-            if(incoming_seg.get_exit_flag()){
-                //First and foremost, make sure we are closing down our own
-                //connection when this happens.
-                closing.store(true);
-
-                //Store the sequence number they are sending us, they won't quit
-                //until they see us send it back.
-                peer_exit_number.store(incoming_seg.get_sequence());
-
-                //If they sent us our own closing sequence number, and we are
-                //already in the termination state, then we are clear to exit.
-                if(incoming_seg.get_ack() == self_exit_number.load() &&
-                   terminating.load()){
-                    running.store(false); 
-                }
-            }
+        tv.tv_sec = wait / 1000000;
+        tv.tv_usec = wait % 1000000;
+        receive_segments(tv);
 
-            //If the incoming segment doesn't have an exit flag then we know if
-            //can carry some ammount of data and or other informatin we care
-            //about.
-            else{
-            
-                //TODO commentary
-                other_rwnd.store(incoming_seg.get_window());
-                send_buffer_mutex.lock();
-                size_t new_acked_bytes = incoming_seg.get_ack() 
-                                         - sender_base_sequence;
-                sender_base_sequence += new_acked_bytes;
-                offset -= new_acked_bytes;
-                send_buffer.erase(send_buffer.begin(), 
-                                  send_buffer.begin() + new_acked_bytes);
-                if(offset == 0){
-                    data_on_wire.store(false); 
-                }
-                send_buffer_mutex.unlock();
-                //If the number of new acked bytes was nonzero...
-                if(new_acked_bytes != 0){
-                    //... that means we got a new ack. Our timeout timepoint should
-                    //be adjusted.
-                    last_new_ack = std::chrono::monotonic_clock::now(); 
-                }
+        //Now, we do all the regular tasks which happen even if we didn't get a
+        //segment.
+        check_timeout();
+
+        //Finally, the last thing we do is wake the sender thread. This
+        //guarentees that it gets woken up at least once per timeout interval
+        //and at least once per packet recvd.
+        wake_sender();
+    }
+}
+
+//While data is on the wire we only wait until the retransmission timer
+//expires, and while terminating until the termination timer does. Otherwise
+//we wake up every so often to keep the sender going.
+size_t jstp_stream::receiver_wait_usecs(){
+    size_t wait = IDLE_WAIT_USECS;
+    if(terminating.load() && exit_timer_running){
+        size_t elapsed = std::chrono::duration_cast<
+            std::chrono::microseconds>(std::chrono::steady_clock::now() - 
+                                       exit_timer).count();
+        wait = elapsed < IDLE_WAIT_USECS ? IDLE_WAIT_USECS - elapsed : 0;
+    }
+    else if(data_on_wire.load()){
+        size_t elapsed = std::chrono::duration_cast<
+            std::chrono::microseconds>(std::chrono::steady_clock::now() - 
+                                       last_new_ack).count();
+        size_t rto = rtt.get_rto();
+        wait = elapsed < rto ? rto - elapsed : 0;
+    }
+    return wait;
+}
+
+//Drain as much of the socket as we can in one go, waiting up to tv for the
+//first segment. Each segment is parsed where the socket received it, its
+//payload is only good until the next recv.
+size_t jstp_stream::receive_segments(timeval tv){
+    const uint8_t* raw[udp_socket::MAX_BATCH];
+    size_t raw_lengths[udp_socket::MAX_BATCH];
+    size_t received = stream_sock.recv_batch(raw, raw_lengths, 
+                                             udp_socket::MAX_BATCH, 
+                                             true, tv);
+    for(size_t i = 0; i < received; i++){
+        if(incoming_seg.parse(raw[i], raw_lengths[i])){
+            process_segment(incoming_seg);
+        }
+    }
+    return received;
+}
 
-                //If it was the segment we expected
-                if(incoming_seg.get_sequence() == self_ack_number.load()){
+//Fire the retransmission timer if it is due
+void jstp_stream::check_timeout(){
+    //Figure out what time it is now and how long it has been since the last
+    //timeout.
+    std::chrono::steady_clock::time_point now = 
+                                      std::chrono::steady_clock::now();
+
+    //Start the termination timer once the sender starts terminating, and
+    //have it send our exit again every time it goes off
+    if(terminating.load()){
+        if(!exit_timer_running){
+            exit_timer_running = true;
+            exit_timer = now;
+        }
+        else if((size_t)std::chrono::duration_cast<std::chrono::microseconds>
+                (now - exit_timer).count() >= IDLE_WAIT_USECS){
+            exit_timer = now;
+            exit_due.store(true);
+        }
+    }
 
-                    //The first thing we need to check is if we have room to buffer
-                    //it. Lock the recv buffer
-                    recv_buffer_mutex.lock();
+    //The client hasn't said anything yet, our synack may have been lost
+    if(synack_pending.load() && 
+       (size_t)std::chrono::duration_cast<std::chrono::microseconds>
+       (now - synack_sent_at).count() >= synack_wait){
+        send_buffer_mutex.lock();
+        stream_sock.send(synack);
+        send_buffer_mutex.unlock();
+        synack_sent_at = now;
+        synack_wait = min(2 * synack_wait, MAX_SYN_TIMEOUT_USECS);
+    }
+    size_t diff = std::chrono::duration_cast<std::chrono::microseconds>
+                  (now - last_new_ack).count();
+
+    //If the difference is over the retransmission timeout and there is
+    //some ammount of data on the wire which is unacked...
+    if(diff >= rtt.get_rto() && data_on_wire.load()){
+        send_buffer_mutex.lock(); 
+
+        //Back off the timer and drop any measurement in progress, the
+        //congestion controller gets to react too.
+        rtt.backoff();
+        timing = false;
+        congestion->on_timeout();
+
+        //... then either resend the oldest segment or wind back the
+        //sender window. Whatever was sacked before the timeout is forgotten,
+        //the peer sacks it again if it still has it.
+        if(mode == recovery_mode::SELECTIVE_REPEAT){
+            scoreboard.clear();
+            in_recovery = true;
+            recovery_point = sender_base_sequence + offset;
+            retransmit_pending.store(true);
+        }
+        else{
+            offset = 0;
+            data_on_wire.store(false);
+        }
+        send_buffer_mutex.unlock(); 
+        force_send.store(true);
+
+        //Restart the timer so we don't fire again before the
+        //retransmission has had a chance to be acked.
+        last_new_ack = now;
+#ifdef JSTP_DEBUG
+        cout << "Timeout event" << endl;
+#endif
+    }
+}
 
-                    //If there is space...
-                    size_t available_space = BUFF_CAPACITY - recv_buffer.size();
-                    if(available_space > incoming_seg.get_length()){
+//Update our state from one segment the peer sent us
+void jstp_stream::process_segment(jstp_segment& incoming_seg){
 
-                        //We need to update the sequence number we expect
-                        uint32_t new_expected = self_ack_number.load() + 
-                                                incoming_seg.get_length();
-                        self_ack_number.store(new_expected);
+    //Once we agreed on checksums a segment without one can't be trusted
+    if(checksums && !incoming_seg.get_checksum_flag()){
+        return;
+    }
 
+    //Anything from the client means it got our synack. On the client side a
+    //synack means the server didn't get anything from us yet, so answer it
+    //with a bare ack.
+    synack_pending.store(false);
+    if(incoming_seg.get_syn_flag()){
+        force_send.store(true);
+        return;
+    }
 
-                        //We need to reduce the size of our rwnd
-                        self_rwnd -= incoming_seg.get_length();
+    //If the incoming segment carries an exit flag...
+    if(incoming_seg.get_exit_flag()){
+        //First and foremost, make sure we are closing down our own
+        //connection when this happens. Nothing more is coming, so anyone
+        //waiting on data can stop.
+        closing.store(true);
+        wake_receivers();
+
+        //Store the sequence number they are sending us, they won't quit
+        //until they see us send it back, so the sender does that next.
+        peer_exit_number.store(incoming_seg.get_sequence());
+
+        //If they sent us our own closing sequence number, and we are
+        //already in the termination state, then we are clear to exit once
+        //we have answered.
+        if(incoming_seg.get_ack() == self_exit_number.load() &&
+           terminating.load()){
+            exit_acked.store(true);
+        }
+        exit_owed.store(true);
+    }
 
-                        //Finally, we should copy the data into our recv buffer
-                        copy(incoming_seg.payload_begin(), 
-                             incoming_seg.payload_end(),
-                             back_inserter(recv_buffer));
+    //If the incoming segment doesn't have an exit flag then we know if
+    //can carry some ammount of data and or other informatin we care
+    //about.
+    else{
+    
+        //Every segment carries the peer's receive window and a
+        //cumulative ack, update our side of the connection first.
+        other_rwnd.store(incoming_seg.get_window());
+        send_buffer_mutex.lock();
+
+        //Only acks which land inside of the send buffer tell us
+        //anything new, stale or bogus acks are ignored.
+        uint32_t new_acked_bytes = incoming_seg.get_ack() 
+                                   - sender_base_sequence;
+        if(new_acked_bytes > send_buffer.size()){
+            new_acked_bytes = 0;
+        }
+        sender_base_sequence += new_acked_bytes;
+        send_buffer.consume(new_acked_bytes);
+        acked_total += new_acked_bytes;
+
+        //That freed up room and might have been the last of it, let anyone
+        //waiting know right away instead of after the sender's next look.
+        std::vector<std::function<void(bool)>> acked;
+        if(new_acked_bytes != 0){
+            take_completions(false, acked);
+            send_progress.notify_all();
+        }
+        high_water -= min(high_water, (size_t)new_acked_bytes);
+
+        //Let the congestion controller know how the ack looked. A
+        //bare ack which doesn't move the window while data is out is
+        //a duplicate.
+        if(new_acked_bytes != 0){
+            dup_acks = 0;
+            congestion->on_ack(new_acked_bytes, rtt.get_stats().srtt);
+        }
+        else if(incoming_seg.get_length() == 0 && offset > 0){
+            dup_acks++;
+            congestion->on_dup_ack();
+
+            //Enough duplicates mean the segment at the base was lost,
+            //resend it now rather than waiting out the timer. Only
+            //once per loss, the duplicates keep coming until the
+            //retransmission lands.
+            if(dup_acks == congestion_controller::DUP_ACK_THRESHOLD &&
+               !in_recovery){
+                fast_retransmit();
+            }
+        }
 
-                        force_send.store(true);
+        //An ack covering the whole probe means the path took it
+        if(probe_outstanding && 
+           (int32_t)(sender_base_sequence - probe_end) >= 0){
+            probe_finished(true);
+        }
 
-                    }
-                    recv_buffer_mutex.unlock();
-                }
+        //If this acks the segment being timed we have a new sample
+        if(timing && (int32_t)(sender_base_sequence - 
+                               timed_sequence) >= 0){
+            timing = false;
+            rtt.sample(std::chrono::duration_cast<
+                std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - timed_at
+                ).count());
+        }
+
+        //Move the scoreboard along with the window and record any
+        //ranges the peer holds beyond the ack.
+        scoreboard.advance(new_acked_bytes);
+        retransmit_next -= min(retransmit_next, 
+                               (size_t)new_acked_bytes);
+        for(const sack_block& block: incoming_seg.get_sack_blocks()){
+            uint32_t left = block.left - sender_base_sequence;
+            uint32_t right = block.right - sender_base_sequence;
+            if(left < right && right <= send_buffer.size()){
+                scoreboard.mark(left, right);
             }
         }
-        //Now, we do all the regular tasks which happen even if we didn't get a
-        //segment.
 
-        //Figure out what time it is now and how long it has been since the last
-        //timeout.
-        std::chrono::monotonic_clock::time_point now = 
-                                          std::chrono::monotonic_clock::now();
-        size_t diff = std::chrono::duration_cast<std::chrono::microseconds>
-                      (now - last_new_ack).count();
-
-        //If the difference is over the constant threshold and there is some
-        //ammount of data on the wire which is unacked...
-        if(diff > jstp_stream::TIMEOUT_USECS && data_on_wire.load()){
-            //... then wind back the sender window.
-            send_buffer_mutex.lock(); 
-            offset = 0;
-            data_on_wire.store(false);
-            send_buffer_mutex.unlock(); 
+        //A Go-Back-N rewind might have left the offset behind data
+        //which was acked from an earlier pass.
+        offset -= min(offset, (size_t)new_acked_bytes);
+        if(offset == 0){
+            data_on_wire.store(false); 
+        }
+
+        //In selective repeat, an ack which moves the window but
+        //doesn't cover everything that was on the wire when we lost a
+        //segment points straight at the next hole. With SACK the
+        //scoreboard already knows where the holes are.
+        if(in_recovery && new_acked_bytes != 0){
+            if((int32_t)(sender_base_sequence - recovery_point) >= 0){
+                in_recovery = false; 
+                congestion->on_recovery_exit();
+            }
+            else if(!sack_enabled && 
+                    mode == recovery_mode::SELECTIVE_REPEAT){
+                retransmit_pending.store(true);
+            }
+        }
+        send_buffer_mutex.unlock();
+        for(auto& done: acked){
+            done(true);
+        }
+
+        //If the number of new acked bytes was nonzero...
+        if(new_acked_bytes != 0){
+            //... that means we got a new ack. Our timeout timepoint should
+            //be adjusted and any backoff undone.
+            last_new_ack = std::chrono::steady_clock::now(); 
+            rtt.reset_backoff();
+        }
+
+        //Segments without a payload are just acks, nothing to buffer
+        if(incoming_seg.get_length() > 0){
+
+            //The first thing we need to check is if we have room to buffer
+            //it. Lock the recv buffer
+            recv_buffer_mutex.lock();
+
+            //If it was the segment we expected and there is space...
+            size_t available_space = BUFF_CAPACITY - recv_buffer.size()
+                                     - reassembly_bytes;
+            if(incoming_seg.get_sequence() == self_ack_number.load() &&
+               available_space > incoming_seg.get_length()){
+
+                //We need to update the sequence number we expect
+                uint32_t new_expected = self_ack_number.load() + 
+                                        incoming_seg.get_length();
+                self_ack_number.store(new_expected);
+                recv_offset += incoming_seg.get_length();
+
+                //Finally, we should copy the data into our recv buffer
+                recv_buffer.write(incoming_seg.payload_data(), 
+                                  incoming_seg.get_length());
+
+                //The segment might have filled a hole, anything
+                //waiting behind it can now be delivered too.
+                drain_reassembly_buffer();
+            }
+
+            //Selective repeat holds on to out of order segments
+            else if(mode == recovery_mode::SELECTIVE_REPEAT){
+                store_out_of_order(incoming_seg);
+                dup_acks_owed++;
+            }
+            else{
+                dup_acks_owed++;
+            }
+
+            //Either way we ack what we have, for an out of order
+            //segment this is a duplicate ack.
+            update_self_rwnd();
+            recv_buffer_mutex.unlock();
+            recv_ready.notify_all();
             force_send.store(true);
-            cout << "Timeout event" << endl;
         }
+    }
+}
 
-        //Finally, the last thing we do is wake the sender thread. This
-        //guarentees that it gets woken up at least once per timeout interval
-        //and at least once per packet recvd.
-        sender_condition_var.notify_one();
+//Start recovering from a loss signalled by duplicate acks. Selective repeat
+//resends just the base segment, Go-Back-N rewinds the same way it does on a
+//timeout. Expects the send buffer mutex to be held.
+void jstp_stream::fast_retransmit(){
+    in_recovery = true;
+    recovery_point = sender_base_sequence + offset;
+    congestion->on_fast_retransmit();
+
+    if(mode == recovery_mode::SELECTIVE_REPEAT){
+        retransmit_pending.store(true);
+    }
+    else{
+        offset = 0;
+        data_on_wire.store(false);
+    }
+    force_send.store(true);
+
+    //Whatever we resend now deserves a full timeout to get acked
+    last_new_ack = std::chrono::steady_clock::now();
+    timing = false;
+
+#ifdef JSTP_DEBUG
+    cout << "Fast retransmit" << endl;
+#endif
+}
+
+//Hold on to a segment which arrived ahead of the one we expected. Segments
+//behind the expected one are duplicates and those too far ahead wouldn't fit
+//in the receive buffer, both are dropped.
+void jstp_stream::store_out_of_order(jstp_segment& seg){
+    uint32_t distance = seg.get_sequence() - self_ack_number.load();
+    size_t used = recv_buffer.size() + reassembly_bytes;
+    if((int32_t)distance <= 0 || 
+       distance + seg.get_length() > BUFF_CAPACITY - used){
+        return;
+    }
+
+    //Keep only one copy of each segment, a retransmission of something we
+    //already hold adds nothing.
+    uint64_t key = recv_offset + distance;
+    if(reassembly_buffer.count(key) != 0){
+        return;
     }
+    reassembly_buffer[key].assign(seg.payload_data(), 
+                                  seg.payload_data() + seg.get_length());
+    reassembly_bytes += seg.get_length();
+    last_stored_key = key;
+}
+
+//Summarize the reassembly buffer as SACK blocks. Adjacent segments are merged
+//into a single block and, as in TCP, the block holding the most recently
+//stored segment goes first so the sender hears about it even when there are
+//more blocks than fit in a segment.
+vector<sack_block> jstp_stream::build_sack_blocks(){
+    vector<sack_block> blocks;
+    size_t first = 0;
+    auto it = reassembly_buffer.begin();
+    while(it != reassembly_buffer.end()){
+        uint64_t left = it->first;
+        uint64_t right = it->first + it->second.size();
+        bool has_last = (it->first == last_stored_key);
+        it++;
+        while(it != reassembly_buffer.end() && it->first <= right){
+            right = std::max(right, it->first + it->second.size());
+            has_last = has_last || (it->first == last_stored_key);
+            it++;
+        }
+
+        //Convert from stream offsets back into sequence numbers
+        sack_block block;
+        block.left = self_ack_number.load() + (left - recv_offset);
+        block.right = self_ack_number.load() + (right - recv_offset);
+        if(has_last){
+            first = blocks.size();
+        }
+        blocks.push_back(block);
+    }
+    std::rotate(blocks.begin(), blocks.begin() + first, 
+                blocks.begin() + first + 1);
+    return blocks;
+}
+
+//Move every segment which is now contiguous with the data we have already
+//delivered from the reassembly buffer into the recv buffer.
+void jstp_stream::drain_reassembly_buffer(){
+    auto it = reassembly_buffer.begin();
+    while(it != reassembly_buffer.end() && it->first <= recv_offset){
+        const vector<uint8_t>& payload = it->second;
+
+        //Segments may overlap what we already have if the sender resent a
+        //different slice of the stream, skip the bytes we've seen.
+        size_t overlap = recv_offset - it->first;
+        if(overlap < payload.size()){
+            recv_buffer.write(payload.data() + overlap, 
+                              payload.size() - overlap);
+            recv_offset += payload.size() - overlap;
+            self_ack_number.store(self_ack_number.load() + 
+                                  payload.size() - overlap);
+        }
+        reassembly_bytes -= payload.size();
+        it = reassembly_buffer.erase(it);
+    }
+}
+
+//Our advertised window is whatever space is left over in the recv buffer
+void jstp_stream::update_self_rwnd(){
+    self_rwnd.store(BUFF_CAPACITY - recv_buffer.size() - reassembly_bytes);
 }
 
 //Send and recv methods, relatively simple in retrospect
 bool jstp_stream::send(const vector<uint8_t>& v){
-    //Aquire the send buffer mutex
+    //Put as much in the buffer as fits, waiting for acks to make room for
+    //the rest.
+    size_t sent = 0;
+    while(sent < v.size()){
+        size_t n = send_partial(v.data() + sent, v.size() - sent);
+        if(n == 0){
+            std::unique_lock<mutex> l(send_buffer_mutex);
+            send_progress.wait(l, [this](){ 
+                return send_buffer.available() > 0 || closing.load(); 
+            });
+            if(closing.load()){
+                return false;
+            }
+        }
+        sent += n;
+    }
+
+    //Finally, wait for the send buffer to be fully flushed before returning
+    return flush();
+}
+
+size_t jstp_stream::send_partial(const uint8_t* data, size_t n){
     send_buffer_mutex.lock();
+    size_t written = 0;
+    if(!closing.load()){
+        written = send_buffer.write(data, n);
+        queued_total += written;
+    }
+    send_buffer_mutex.unlock();
 
-    //Figure out how much space is left in the buffer
-    size_t available = BUFF_CAPACITY - send_buffer.size();
+    //Signal the sender that something needs to be sent
+    if(written > 0){
+        wake_sender();
+    }
+    return written;
+}
 
-    //If there isn't enough space, then report back false
-    if(available < v.size()){
+//The vector is held by the send queue until it has all been acked. A send
+//which has nothing left to wait for completes right away.
+void jstp_stream::send_async(vector<uint8_t> v, 
+                             std::function<void(bool)> done){
+    auto owned = std::make_shared<vector<uint8_t>>(std::move(v));
+    send_buffer_mutex.lock();
+    if(closing.load()){
         send_buffer_mutex.unlock();
-        return false; 
+        done(false);
+        return;
+    }
+    send_buffer.write_external(owned->data(), owned->size(), owned);
+    queued_total += owned->size();
+    bool now = acked_total == queued_total;
+    if(!now){
+        completions.push_back(completion{queued_total, done});
+    }
+    send_buffer_mutex.unlock();
+
+    if(now){
+        done(true);
+        return;
+    }
+    wake_sender();
+}
+
+std::future<bool> jstp_stream::send_async(vector<uint8_t> v){
+    auto promise = std::make_shared<std::promise<bool>>();
+    send_async(std::move(v), [promise](bool ok){ promise->set_value(ok); });
+    return promise->get_future();
+}
+
+//Every completion which is due, or all of them when the stream is closing.
+//Expects the send buffer mutex to be held.
+void jstp_stream::take_completions(bool all, 
+                                   vector<std::function<void(bool)>>& out){
+    while(!completions.empty() && 
+          (all || completions.front().end <= acked_total)){
+        out.push_back(std::move(completions.front().done));
+        completions.pop_front();
     }
+}
 
-    //Put the data in the buffer
-    copy(v.begin(), v.end(), back_inserter(send_buffer));
+//No room check here, the bytes don't take up any of the buffer
+bool jstp_stream::send_external(const uint8_t* data, size_t n,
+                                std::shared_ptr<const void> owner){
+    send_buffer_mutex.lock();
+    bool queued = !closing.load();
+    if(queued){
+        send_buffer.write_external(data, n, owner);
+        queued_total += n;
+    }
     send_buffer_mutex.unlock();
+    if(!queued){
+        return false;
+    }
 
-    //Signal the sender that something needs to be sent
+    wake_sender();
+    return flush();
+}
+
+//On a reactor, read everything waiting without blocking, check the timer and
+//let the sender go a few times. Both are capped so one busy stream can't hog
+//the reactor, if it still had more to do it asks to go again.
+bool jstp_stream::reactor_step(){
+    bool done = true;
+    if(running.load()){
+        //A shared socket is read by the acceptor, not us
+        timeval tv = {0, 0};
+        size_t batches = 0;
+        while(!shared_acceptor && batches < REACTOR_BATCHES &&
+              receive_segments(tv) == udp_socket::MAX_BATCH){
+            batches++;
+        }
+        if(batches == REACTOR_BATCHES){
+            done = false;
+        }
+        check_timeout();
+
+        for(batches = 0; running.load() && !sender_step(); batches++){
+            if(batches == REACTOR_BATCHES){
+                done = false;
+                break;
+            }
+        }
+    }
+
+    //Let the destructor know once we have finished closing
+    if(!running.load()){
+        {
+            unique_lock<mutex> l(sender_notify_lock);
+        }
+        stopped.notify_all();
+        wake_receivers();
+        return true;
+    }
+    return done;
+}
+
+//The loss simulation still gets its say, it would have if the segment came in
+//on our own socket. Processing it may have given the sender something to do.
+void jstp_stream::deliver(jstp_segment& seg){
+    if(!running.load() || stream_sock.was_dropped()){
+        return;
+    }
+    process_segment(seg);
+    reactor->wake(this);
+}
+
+//Closing goes at the same pace as the threads would go, when there is data on
+//the wire we need to be back when the retransmission timer is up, and the
+//same goes for a synack the client hasn't answered yet. Otherwise an idle
+//stream doesn't need a timer at all, it gets run when the peer sends
+//something or the user gives it something to send.
+size_t jstp_stream::reactor_timer_usecs(){
+    if(!running.load()){
+        return 0;
+    }
+    if(terminating.load() && exit_timer_running){
+        return std::max(receiver_wait_usecs(), (size_t)1);
+    }
+    if(closing.load() || terminating.load()){
+        return IDLE_WAIT_USECS;
+    }
+    if(data_on_wire.load()){
+        return std::max(receiver_wait_usecs(), (size_t)1);
+    }
+    if(synack_pending.load()){
+        return IDLE_WAIT_USECS;
+    }
+    return 0;
+}
+
+//The flag is set under the lock the sender naps with, so a wake up that comes
+//in before the sender gets around to napping isn't lost.
+void jstp_stream::wake_sender(){
+    if(reactor){
+        reactor->wake(this);
+        return;
+    }
+    sender_notify_lock.lock();
+    sender_woken = true;
+    sender_notify_lock.unlock();
     sender_condition_var.notify_one();
+}
 
-    //Finally, wait for the send buffer to be fully flushed before returning
-    std::unique_lock<mutex> l(flush_lock);
-    flushed.wait(l);
+//Everyone who empties the send buffer notifies with the send buffer mutex
+//held, so checking the size under it means we can't miss the last notify.
+//Closing empties it without the acks ever showing up.
+bool jstp_stream::flush(){
+    std::unique_lock<mutex> l(send_buffer_mutex);
+    send_progress.wait(l, [this](){ return send_buffer.size() == 0; });
+    return acked_total == queued_total;
+}
 
-    return true;
+uint64_t jstp_stream::get_retransmitted_bytes(){
+    return retransmitted_bytes.load();
+}
+
+std::chrono::microseconds jstp_stream::get_rto(){
+    return std::chrono::microseconds(rtt.get_rto());
+}
+
+rtt_stats jstp_stream::get_rtt_stats(){
+    return rtt.get_stats();
+}
+
+uint64_t jstp_stream::get_syscalls(){
+    return stream_sock.get_syscalls();
+}
+
+bool jstp_stream::enable_offload(){
+    return stream_sock.enable_offload();
+}
+
+bool jstp_stream::get_binary_framing(){
+    return binary_framing;
+}
+
+bool jstp_stream::get_checksums(){
+    return checksums;
+}
+
+void jstp_stream::set_corruption_probability(double p){
+    stream_sock.set_corruption_probability(p);
+}
+
+size_t jstp_stream::get_segment_size(){
+    send_buffer_mutex.lock();
+    size_t size = segment_size;
+    send_buffer_mutex.unlock();
+    return size;
+}
+
+//Drop to the base size and let probing find its way back up
+void jstp_stream::enable_mss_probing(){
+    send_buffer_mutex.lock();
+    stream_sock.set_dont_fragment(true);
+    segment_size = min(BASE_SEGMENT_SIZE, agreed_segment_size);
+    congestion->set_mss(payload_limit());
+    probing = true;
+    probe_index = 0;
+    probe_failures = 0;
+    probe_outstanding = false;
+    send_buffer_mutex.unlock();
+}
+
+size_t jstp_stream::get_cwnd(){
+    send_buffer_mutex.lock();
+    size_t cwnd = min(window_limit, congestion->get_cwnd());
+    send_buffer_mutex.unlock();
+    return cwnd;
 }
 
 vector<uint8_t> jstp_stream::recv(){
     recv_buffer_mutex.lock();
-    vector<uint8_t> out;
-    out.reserve(recv_buffer.size());
-    copy(recv_buffer.begin(), recv_buffer.end(), back_inserter(out));
-    recv_buffer.clear();
+    vector<uint8_t> out = take_received();
+    recv_buffer_mutex.unlock();
+    return out;
+}
+
+vector<uint8_t> jstp_stream::recv_wait(){
+    std::unique_lock<mutex> l(recv_buffer_mutex);
+    recv_ready.wait(l, [this](){ return recv_done(); });
+    return take_received();
+}
+
+vector<uint8_t> jstp_stream::recv_wait(std::chrono::microseconds timeout){
+    std::unique_lock<mutex> l(recv_buffer_mutex);
+    recv_ready.wait_for(l, timeout, [this](){ return recv_done(); });
+    return take_received();
+}
+
+//Waiters check the closing flag with the recv buffer mutex held, taking it
+//here means they are either already asleep and get the notify or haven't
+//looked at the flag yet.
+void jstp_stream::wake_receivers(){
+    recv_buffer_mutex.lock();
     recv_buffer_mutex.unlock();
+    recv_ready.notify_all();
+}
+
+//Whether a recv_wait can stop waiting, expects the recv buffer mutex held
+bool jstp_stream::recv_done(){
+    return recv_buffer.size() > 0 || closing.load() || !running.load();
+}
+
+//Empty the recv buffer out, expects the recv buffer mutex to be held
+vector<uint8_t> jstp_stream::take_received(){
+    vector<uint8_t> out;
+    out.resize(recv_buffer.size());
+    recv_buffer.read(out.data(), out.size());
+    update_self_rwnd();
     return out;
 }
@@ -13,49 +13,166 @@
 //Project specific headers
 #include "udp_socket.hpp"
 #include "jstp_segment.hpp"
+#include "jstp_scoreboard.hpp"
+#include "jstp_rtt.hpp"
+#include "jstp_congestion.hpp"
+#include "ring_buffer.hpp"
+#include "send_queue.hpp"
+#include "jstp_reactor.hpp"
 
 //STL includes
 #include <string>
+#include <map>
+#include <unordered_map>
+#include <set>
 #include <deque>
+#include <vector>
+#include <memory>
 #include <mutex>
 #include <atomic>
 #include <thread>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
+#include <future>
 
 //Cstd includes
 #include <cstdint>
 
+//Streams can recover from lost segments in one of two ways. Go-Back-N rewinds
+//the sender to the oldest unacked byte and resends everything after it.
+//Selective repeat has the receiver hold on to out of order segments so that the
+//sender only needs to fill in the holes.
+namespace recovery_mode{
+    enum Enum{GO_BACK_N, SELECTIVE_REPEAT};
+};
+
+//Look a recovery mode up by the name it goes by, go-back-n or selective, false
+//if there isn't one
+bool parse_recovery_mode(const std::string& name, recovery_mode::Enum&);
+
 //The connector class, used to construct streams on the client side.
 class jstp_connector{
     friend class jstp_stream;
     public:
-        jstp_connector(std::string hostname, uint16_t portno);
+        //Streams made from a connector given a reactor run on the reactor
+        //instead of starting threads of their own. Unless told not to they
+        //ask the server to put a checksum on every segment.
+        jstp_connector(std::string hostname, uint16_t portno,
+                       jstp_reactor* reactor = nullptr, bool checksums = true);
+
+        //For testing the handshake, the next n synacks to reach a stream made
+        //from this connector are thrown away as if the network lost them.
+        void drop_synacks(size_t n);
     private:
         std::string hostname;
         uint16_t port;
+        jstp_reactor* reactor;
+        bool checksums;
+        size_t synack_drops;
 };
 
 //The acceptor class, used to construct streams on the server side
 class jstp_acceptor{
     friend class jstp_stream;
+    friend class jstp_reactor;
     public:
-        jstp_acceptor(uint16_t portno);
+        //Same deal with the reactor as the connector. Given a reactor, the
+        //acceptor can also share its own socket with the streams made from it
+        //instead of each of them binding an ephemeral port. Segments then
+        //carry a connection ID and the reactor sorts everything arriving on
+        //the one port out to the right stream. Clients which don't know about
+        //connection IDs still get a socket of their own. With reuse_port
+        //several acceptors can listen on the same port and the kernel splits
+        //the clients between them.
+        jstp_acceptor(uint16_t portno, jstp_reactor* reactor = nullptr,
+                      bool share_socket = false, bool reuse_port = false);
+        ~jstp_acceptor();
+
+        //Can't be coppied, streams point back at it
+        jstp_acceptor(const jstp_acceptor&) = delete;
+        jstp_acceptor& operator=(const jstp_acceptor&) = delete;
+
+        //How many of the most recent SYNs are remembered, and how many of
+        //them can wait for a stream to be made when sharing the socket
+        static const size_t SYN_MEMORY = 4096;
     private:
         udp_socket acceptor_socket;
+        jstp_reactor* reactor;
+        bool shared;
+
+        //Clients resend their SYN until they hear back, so a busy server can
+        //find the same one waiting several times. Each SYN is known by the
+        //client's address, port and ISN, only the first one is accepted.
+        typedef std::pair<uint64_t, uint32_t> syn_key;
+        std::set<syn_key> recent_syns;
+        std::deque<syn_key> syn_order;
+        bool first_syn(const sockaddr_in&, uint32_t isn);
+
+        //Shared socket support, everything here is protected by the demux
+        //mutex. The reactor calls demux whenever the socket is readable, SYNs
+        //are queued for next_syn and everything else goes straight to the
+        //stream with its connection ID. A stream reserves its ID during the
+        //handshake and is only attached once it is ready for segments.
+        std::mutex demux_mutex;
+        std::condition_variable syn_ready;
+        struct pending_syn{
+            jstp_segment seg;
+            sockaddr_in from;
+        };
+        std::deque<pending_syn> pending_syns;
+        std::unordered_map<uint32_t, jstp_stream*> connections;
+        uint32_t next_connection_id;
+        jstp_segment demux_seg;
+        void demux();
+        void next_syn(jstp_segment&, sockaddr_in&);
+        uint32_t reserve_connection_id();
+        void attach(uint32_t, jstp_stream*);
+        void detach(uint32_t);
 };
 
 //The stream class, symetric once constructed. Used for transfering user data to
 //and from both end systems.
 class jstp_stream{
+    friend class jstp_reactor;
+    friend class jstp_acceptor;
     public:
         //Settings
-        static const size_t BUFF_CAPACITY = 64000000;  //64kB TODO tune this
-        static const size_t TIMEOUT_USECS = 125000;
+        static const size_t BUFF_CAPACITY = 67108864;  //64MiB, a power of two
+        static const size_t IDLE_WAIT_USECS = 125000;
+
+        //Path MTU probing starts out at the base segment size and gives up on
+        //a size after this many lost probes in a row.
+        static const size_t BASE_SEGMENT_SIZE = 1200;
+        static const size_t MAX_PROBES = 3;
+
+        //The client resends its SYN if nothing comes back in this long,
+        //doubling the wait each time up to the max. The server does the same
+        //with its SYN-ACK until the client answers it.
+        static const size_t SYN_TIMEOUT_USECS = 250000;
+        static const size_t MAX_SYN_TIMEOUT_USECS = 4000000;
+
+        //How many times the termination timer resends our exit segment
+        //before we give up on the peer
+        static const size_t TERMINATION_TRIES = 5;
+
+        //On a reactor, the most batches read or sent in one turn before the
+        //stream goes to the back of the line.
+        static const size_t REACTOR_BATCHES = 4;
         
         //Constructed from either an acceptor or a connector, no default.
-        jstp_stream(jstp_acceptor&, double loss_probability, size_t window);
-        jstp_stream(jstp_connector&, double loss_probability, size_t window);
+        //The window is the most the stream will ever have on the wire, the
+        //congestion controller may hold it to less. The segment size is the
+        //biggest segment this side can take, the stream uses the smaller of
+        //it and whatever the peer says it can take.
+        jstp_stream(jstp_acceptor&, double loss_probability, size_t window,
+                    recovery_mode::Enum = recovery_mode::GO_BACK_N,
+                    congestion_type::Enum = congestion_type::NONE,
+                    size_t segment_size = jstp_segment::DEFAULT_SEGMENT_SIZE);
+        jstp_stream(jstp_connector&, double loss_probability, size_t window,
+                    recovery_mode::Enum = recovery_mode::GO_BACK_N,
+                    congestion_type::Enum = congestion_type::NONE,
+                    size_t segment_size = jstp_segment::DEFAULT_SEGMENT_SIZE);
 
         //Can't be coppied or moved
         jstp_stream(jstp_stream& other) = delete;
@@ -63,10 +180,80 @@ class jstp_stream{
         //Destructor does cleanup TODO
         ~jstp_stream();
 
-        //Interface to the streams, looks a lot like TCP for a reason
+        //Interface to the streams, looks a lot like TCP for a reason. Send
+        //waits for room in the send buffer as it needs it and then for all of
+        //it to be acked, it only returns false if the stream closed first.
         bool send(const std::vector<uint8_t>&);
         std::vector<uint8_t> recv();
 
+        //Never waits. Copies as much of the data as fits into the send buffer
+        //and returns how much that was, zero if it is full or closing.
+        size_t send_partial(const uint8_t*, size_t n);
+
+        //Never waits either, the vector is kept as is and sent straight out
+        //of instead of being coppied, so it doesn't need room in the buffer.
+        //Once all of it has been acked the callback gets true, or false if the
+        //stream closes first. Callbacks run on whichever thread saw the ack
+        //and must not wait on the stream (send, flush, recv_wait), the other
+        //sends are fine. The future version is the same thing.
+        void send_async(std::vector<uint8_t>, std::function<void(bool)>);
+        std::future<bool> send_async(std::vector<uint8_t>);
+
+        //Wait until everything sent so far has been acked. Returns false if
+        //the stream closed with some of it still unacked.
+        bool flush();
+
+        //Like recv but waits for data to show up instead of coming back
+        //empty. The timed one gives up once the timeout is up and both give
+        //up once the stream is closing, so empty means there was nothing.
+        std::vector<uint8_t> recv_wait();
+        std::vector<uint8_t> recv_wait(std::chrono::microseconds timeout);
+
+        //Send n bytes straight out of memory the caller owns, they are never
+        //coppied into the send buffer. The owner is kept alive until all of
+        //the bytes have been acked, then let go of. Like send, this doesn't
+        //return until everything has been flushed.
+        bool send_external(const uint8_t*, size_t n, 
+                           std::shared_ptr<const void> owner);
+
+        //Total number of payload bytes this side has sent more than once
+        uint64_t get_retransmitted_bytes();
+
+        //The retransmission timeout currently in effect and a summary of the
+        //round trip times measured so far.
+        std::chrono::microseconds get_rto();
+        rtt_stats get_rtt_stats();
+
+        //The congestion window currently in effect
+        size_t get_cwnd();
+
+        //How many syscalls the stream's socket has made to move data
+        uint64_t get_syscalls();
+
+        //Opt in to UDP segmentation offload on this side, the peer doesn't
+        //need to know. Returns true if the kernel took both GSO and GRO.
+        bool enable_offload();
+
+        //Whether both sides said in the handshake that they can read file
+        //messages in the binary framing, otherwise they have to be text.
+        bool get_binary_framing();
+
+        //Whether both sides said in the handshake that they can check
+        //segment checksums, every segment carries one if they did.
+        bool get_checksums();
+
+        //Flip a bit in this fraction of the segments which reach us, on top
+        //of the simulated loss. For seeing what the checksums catch.
+        void set_corruption_probability(double);
+
+        //The size of the segments we are sending right now, headers included
+        size_t get_segment_size();
+
+        //Opt in to path MTU probing on this side. Sending drops to the base
+        //segment size and then works its way back up towards the size agreed
+        //in the handshake for as long as the path takes bigger segments.
+        void enable_mss_probing();
+
     private:
         //The socket which we will use to communicate with our peer
         udp_socket stream_sock;
@@ -75,6 +262,28 @@ class jstp_stream{
         std::atomic<bool> running; 
         std::atomic<bool> closing;
         std::atomic<bool> terminating;
+        size_t termination_tries;
+
+        //The termination timer goes off every IDLE_WAIT_USECS while we are
+        //terminating and only then does a try get used up. Its time is only
+        //looked at by the receiver, or the reactor. A peer's exit gets
+        //answered straight away without using a try, and once the peer acks
+        //our exit we stop.
+        std::chrono::steady_clock::time_point exit_timer;
+        bool exit_timer_running;
+        bool exit_sent;
+        std::atomic<bool> exit_due;
+        std::atomic<bool> exit_owed;
+        std::atomic<bool> exit_acked;
+
+        //The server side keeps its SYN-ACK around until the first segment
+        //from the client shows up, the client can't ask for it again since
+        //the acceptor ignores SYNs it has already seen. Only the timer
+        //touches the time and wait once the stream is running.
+        jstp_segment synack;
+        std::atomic<bool> synack_pending;
+        std::chrono::steady_clock::time_point synack_sent_at;
+        size_t synack_wait;
 
         //Used in the termination process
         std::atomic<uint32_t> self_exit_number;
@@ -87,37 +296,220 @@ class jstp_stream{
         std::atomic<bool> force_send;
         std::atomic<bool> data_on_wire;
         size_t window_limit;
+        recovery_mode::Enum mode;
+
+        //Decides how much of the window we may actually use, only touched
+        //with the send buffer mutex held.
+        std::unique_ptr<congestion_controller> congestion;
+
+        //Set during the handshake if both sides understand SACK blocks, only
+        //selective repeat asks for them.
+        bool sack_enabled;
+
+        //Set during the handshake if both sides can read binary file messages
+        bool binary_framing;
+
+        //Set during the handshake if the client asked for segment checksums,
+        //servers always agree. Segments without one are dropped.
+        bool checksums;
+
+        //Set during the handshake if the server is sharing one socket between
+        //its streams, every segment we send has to carry the ID. Zero means
+        //no ID. On the server, the acceptor whose socket we share.
+        uint32_t connection_id;
+        jstp_acceptor* shared_acceptor;
+
+        //Bytes of header on every segment, which the payload has to make room
+        //for. Bigger with a connection ID or a checksum.
+        size_t header_size;
+
+        //Hand over a segment the acceptor's demux picked up for us
+        void deliver(jstp_segment&);
+
+        //The segment size in use, headers included, and the one agreed in the
+        //handshake which is as big as segments ever get. Only touched with
+        //the send buffer mutex held.
+        size_t segment_size;
+        size_t agreed_segment_size;
+        size_t payload_limit();
+
+        //Path MTU probing in the style of DPLPMTUD. Now and then a segment
+        //full of data goes out at the next size up, if it is acked without
+        //having been resent the path takes segments that big. Protected by
+        //the send buffer mutex.
+        bool probing;
+        size_t probe_index;
+        size_t probe_failures;
+        bool probe_outstanding;
+        uint32_t probe_start;
+        uint32_t probe_end;
+        size_t probe_payload_due();
+        void probe_finished(bool acked);
 
         //The send buffer and associated things
         std::mutex send_buffer_mutex;
-        std::deque<uint8_t> send_buffer;
+        send_queue send_buffer;
         uint32_t sender_base_sequence;
         size_t offset;
+
+        //Used by selective repeat to resend only the segment at the base of
+        //the window. Recovery lasts until everything which was on the wire
+        //when the loss was detected (up to recovery_point) has been acked.
+        std::atomic<bool> retransmit_pending;
+        bool in_recovery;
+        uint32_t recovery_point;
+
+        //Duplicate acks seen in a row, enough of them starts a fast
+        //retransmit without waiting for the timer.
+        size_t dup_acks;
+
+        //Out of order segments received since we last sent an ack. The peer
+        //counts duplicate acks to spot a loss so each of them is owed its own
+        //ack, even when a whole batch of them arrived at once.
+        std::atomic<size_t> dup_acks_owed;
+
+        //With SACK, the scoreboard tells the sender which holes to fill during
+        //recovery, retransmit_next is how far through them it has gotten.
+        sack_scoreboard scoreboard;
+        size_t retransmit_next;
+
+        //Highest offset ever sent, anything sent below it is a retransmission
+        size_t high_water;
+        std::atomic<uint64_t> retransmitted_bytes;
         
-        //Used to determine if the send buffer has been fully flushed
-        std::mutex flush_lock;
-        std::condition_variable flushed;
+        //Notified whenever acks free up some of the send buffer or it gets
+        //cleared, waited on with the send buffer mutex by anyone waiting for
+        //room or for the buffer to be flushed.
+        std::condition_variable send_progress;
+
+        //Async sends waiting on acks. Bytes queued and acked are counted from
+        //the start of the stream, each completion is due once acked_total
+        //reaches its end. Protected by the send buffer mutex, the callbacks
+        //are collected and run once it is released.
+        struct completion{
+            uint64_t end;
+            std::function<void(bool)> done;
+        };
+        std::deque<completion> completions;
+        uint64_t queued_total;
+        uint64_t acked_total;
+        void take_completions(bool all, 
+                              std::vector<std::function<void(bool)>>& out);
 
         //The receiver buffer and assiciated things
         std::mutex recv_buffer_mutex;
-        std::deque<uint8_t> recv_buffer;
+        ring_buffer recv_buffer;
+
+        //Signalled by the receiver whenever data lands in the recv buffer or
+        //the stream starts closing, recv_wait sleeps on it.
+        std::condition_variable recv_ready;
+        void wake_receivers();
+        bool recv_done();
+        std::vector<uint8_t> take_received();
+
+        //Out of order segments held by selective repeat, keyed by their offset
+        //in the byte stream so that sequence number wraparound doesn't upset
+        //the ordering. recv_offset is the stream offset of self_ack_number.
+        std::map<uint64_t, std::vector<uint8_t>> reassembly_buffer;
+        size_t reassembly_bytes;
+        uint64_t recv_offset;
+        uint64_t last_stored_key;
+        //Helpers for the receiver, these expect the recv buffer mutex to be
+        //held by the caller.
+        void store_out_of_order(jstp_segment&);
+        void drain_reassembly_buffer();
+        void update_self_rwnd();
+        std::vector<sack_block> build_sack_blocks();
 
-        //Timeval which indicates when the next timeout will happen
-        std::chrono::monotonic_clock::time_point last_new_ack;
+        //When the retransmission timer was last started, it expires one RTO
+        //after this point.
+        std::chrono::steady_clock::time_point last_new_ack;
+
+        //Round trip time measurement. Only one segment is timed at a time and
+        //the measurement is thrown out if any retransmission happens before
+        //it is acked (Karn's algorithm). The estimator does its own locking
+        //and keeps the RTO in an atomic, so the timer reads it without taking
+        //any lock. The timed segment is protected by the send buffer mutex.
+        rtt_estimator rtt;
+        bool timing;
+        uint32_t timed_sequence;
+        std::chrono::steady_clock::time_point timed_at;
 
         //Sender thread support
         std::thread sender_thread;
         std::mutex sender_notify_lock;
         std::condition_variable sender_condition_var;
+        bool sender_woken;
+        void wake_sender();
         void sender_main();
 
+        //One go at sending whatever the windows allow, returns true if there
+        //is nothing left to do until something changes.
+        bool sender_step();
+
+        //Called from the receiver when duplicate acks signal a loss
+        void fast_retransmit();
+
+        //Builds one segment carrying up to length bytes of the send buffer
+        //from start and adds it to the outgoing batch, returns how many bytes
+        //actually fit. Expects the send buffer mutex to be held by the caller.
+        size_t transmit(size_t start, size_t length);
+
+        //How many new bytes, up to limit, the windows let us put in the next
+        //segment. Expects the send buffer mutex to be held.
+        size_t sendable_bytes(size_t limit);
+
+        //Segments built by transmit wait in the batch until flush_batch sends
+        //them all in one go. Only the headers are kept here, the payloads are
+        //still in the send buffer (or memory it points at) so the batch has to
+        //be flushed before the send buffer mutex is released.
+        struct pending_segment{
+            uint8_t header[jstp_segment::MAX_HEADER_SIZE];
+            iovec iov[1 + send_queue::MAX_SPANS];
+        };
+        pending_segment batch[udp_socket::MAX_BATCH];
+        udp_socket::datagram batch_datagrams[udp_socket::MAX_BATCH];
+        size_t batch_size;
+        void flush_batch();
+
         //Receiver thread support
         std::thread receiver_thread;
         void receiver_main();
 
+        //The pieces of the receiver loop. How long it can wait for a segment
+        //before the retransmission timer needs looking at, reading and
+        //handling a batch of segments (returns how many came in), and firing
+        //the timer if it is due. The segment is kept around between calls.
+        size_t receiver_wait_usecs();
+        size_t receive_segments(timeval tv);
+        void check_timeout();
+        jstp_segment incoming_seg;
+
+        //Reactor support, null if the stream has its own threads. Instead of
+        //the two loops, the reactor calls reactor_step whenever the socket is
+        //readable, the stream is woken or its timer is up. It returns false
+        //if the stream still has more to do right away. reactor_timer_usecs
+        //says when it next needs to run, zero for only when something
+        //happens. The destructor waits on stopped for the stream to finish
+        //closing, the reactor's timer and queue state live here too.
+        jstp_reactor* reactor;
+        bool reactor_step();
+        size_t reactor_timer_usecs();
+        std::condition_variable stopped;
+        uint64_t timer_tick;
+        std::atomic<bool> queued;
+
+        //Handles everything one received segment tells us
+        void process_segment(jstp_segment&);
+
         //Function which starts threads and inits variables, used by the
         //constructor
-        void init(uint32_t, uint32_t);
+        void init(uint32_t, uint32_t, jstp_reactor*);
+
+        //Settle on a segment size with the peer and set up everything which
+        //depends on it, used by the constructors.
+        void agree_segment_size(size_t peer_segment_size, 
+                                congestion_type::Enum);
 
         //Needed to make output for debug messages at all readable
         std::mutex cout_mutex;
@@ -0,0 +1,138 @@
+//Load generator for a server running with a concurrency limit. Opens a bunch
+//of client connections at once, each of which asks for the same file, and
+//reports the aggregate throughput and how long the transfers took to finish.
+//
+//Usage, <executable> hostname port filename clients [window] [loss]
+//    Every client connects, sends its request and reads the whole reply. The
+//    data is thrown away, only its length is kept. Completion times are from
+//    the start of the connection to the last byte of the reply.
+
+#include <iostream>
+using std::cout; using std::cerr; using std::endl; using std::ostream;
+#include <iomanip>
+using std::fixed; using std::setprecision;
+#include <string>
+using std::string; using std::stoul; using std::stod;
+#include <vector>
+using std::vector;
+#include <thread>
+using std::thread;
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+using std::min; using std::max; using std::sort;
+
+#include "file_layer.hpp"
+#include "jstp_streams.hpp"
+
+//Defaults used when the user doesn't specify otherwise
+static const size_t DEFAULT_WINDOW = 64000;
+
+//How one client's transfer went
+struct client_result{
+    bool ok;
+    uint64_t bytes;
+    double seconds;
+};
+
+//Fetch the file once, throwing the body away as it arrives
+static client_result fetch(const string& hostname, uint16_t port,
+                           const string& filename, size_t window,
+                           double loss){
+    client_result result = {false, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+
+    jstp_connector connector(hostname, port);
+    jstp_stream stream(connector, loss, window);
+
+    outgoing_message request;
+    request.set_action(action_type::REQUEST);
+    request.set_filename(filename);
+    request.send(stream);
+
+    incoming_message response;
+    discard_buffer nothing;
+    ostream discard(&nothing);
+    if(response.recv_header(stream) &&
+       response.get_action() == action_type::DATA &&
+       response.recv_body(stream, discard)){
+        result.ok = true;
+        result.bytes = response.get_length();
+    }
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 5 || argc > 7){
+        cerr << "Usage: " << argv[0]
+             << " hostname port filename clients [window] [loss]" << endl;
+        return 1;
+    }
+    string hostname(argv[1]);
+    string filename(argv[3]);
+    uint16_t port;
+    size_t clients;
+    size_t window = DEFAULT_WINDOW;
+    double loss = 0;
+    try{
+        port = stoul(argv[2]);
+        clients = stoul(argv[4]);
+        if(argc > 5) window = stoul(argv[5]);
+        if(argc > 6) loss = stod(argv[6]);
+    }
+    catch(std::logic_error& e){
+        cerr << "Could not parse the load generator arguments" << endl;
+        return 1;
+    }
+    if(clients == 0){
+        cerr << "Need at least one client" << endl;
+        return 1;
+    }
+
+    //Every client gets a thread and they all start at once
+    vector<client_result> results(clients);
+    vector<thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < clients; i++){
+        threads.push_back(thread([&, i](){
+            results[i] = fetch(hostname, port, filename, window, loss);
+        }));
+    }
+    for(thread& t: threads){
+        t.join();
+    }
+    double wall = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    //Summarize the ones which made it
+    vector<double> times;
+    uint64_t total = 0;
+    for(client_result& r: results){
+        if(r.ok){
+            times.push_back(r.seconds);
+            total += r.bytes;
+        }
+    }
+    cout << clients << " clients fetching \"" << filename << "\", window "
+         << window << ", loss " << loss << endl;
+    cout << "    Completed       = " << times.size() << " of " << clients
+         << endl;
+    if(times.empty()){
+        return 1;
+    }
+    sort(times.begin(), times.end());
+    auto percentile = [&](double p){
+        return times[min(times.size() - 1, (size_t)(p * times.size()))];
+    };
+    cout << "    Wall time       = " << fixed << setprecision(3) << wall
+         << " s" << endl;
+    cout << "    Throughput      = " << total / wall / 1000000 << " MB/s"
+         << endl;
+    cout << "    Completion (ms):" << endl;
+    cout << "        p50 = " << percentile(0.5) * 1000 << endl;
+    cout << "        p99 = " << percentile(0.99) * 1000 << endl;
+    cout << "        max = " << times.back() * 1000 << endl;
+    return times.size() == clients ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+/* Implementation of the class defined in mapped_file.hpp */
+
+#include "mapped_file.hpp"
+
+//STL
+#include <string>
+using std::string;
+#include <memory>
+using std::shared_ptr;
+
+//Posix
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//Cstd
+#include <cerrno>
+
+shared_ptr<mapped_file> mapped_file::open(const string& path){
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+        close(fd);
+        return nullptr;
+    }
+
+    //Someone with the file open for writing could cut it short while we are
+    //still sending out of the mapping, and touching a mapped page past the
+    //new end is a SIGBUS. A read lease is refused with EAGAIN exactly when
+    //the file is open for writing, so those get left to a file stream. If
+    //we aren't allowed leases at all we can't tell and map it anyway.
+    if(fcntl(fd, F_SETLEASE, F_RDLCK) == 0){
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+    }
+    else if(errno == EAGAIN){
+        close(fd);
+        return nullptr;
+    }
+
+    //Empty files can't be mapped, but there is nothing to send anyway
+    uint64_t length = st.st_size;
+    void* mapping = nullptr;
+    if(length > 0){
+        mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED){
+            close(fd);
+            return nullptr;
+        }
+
+        //We read it front to back, so let the kernel read ahead aggressively
+        madvise(mapping, length, MADV_SEQUENTIAL);
+    }
+
+    //The mapping stays valid after the descriptor is gone
+    close(fd);
+    return shared_ptr<mapped_file>(new mapped_file((const uint8_t*)mapping, 
+                                                   length));
+}
+
+//The copy is anonymous memory so it gets unmapped like any other mapping, and
+//so it can be made read only once it has been filled in.
+shared_ptr<mapped_file> mapped_file::load(int fd, uint64_t length){
+    void* copy = nullptr;
+    if(length > 0){
+        copy = mmap(nullptr, length, PROT_READ | PROT_WRITE, 
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(copy == MAP_FAILED){
+            return nullptr;
+        }
+        uint64_t done = 0;
+        while(done < length){
+            ssize_t n = pread(fd, (uint8_t*)copy + done, length - done, done);
+            if(n <= 0){
+                munmap(copy, length);
+                return nullptr;
+            }
+            done += n;
+        }
+        mprotect(copy, length, PROT_READ);
+    }
+    return shared_ptr<mapped_file>(new mapped_file((const uint8_t*)copy, 
+                                                   length));
+}
+
+mapped_file::mapped_file(const uint8_t* mapping, uint64_t length):
+    mapping(mapping), length(length){}
+
+mapped_file::~mapped_file(){
+    if(mapping != nullptr){
+        munmap((void*)mapping, length);
+    }
+}
+
+const uint8_t* mapped_file::data(){
+    return mapping;
+}
+
+uint64_t mapped_file::size(){
+    return length;
+}
@@ -0,0 +1,50 @@
+/* This file defines a read only view of a whole file mapped into memory. The
+ * server sends files straight out of the mapping so the bytes never get
+ * coppied into user space buffers, the page cache is the only copy there is.
+ *
+ * A file can also be loaded into memory of its own instead, which is still
+ * read only but is a snapshot of the file, see file_cache.hpp.
+ *
+ * A mapping is only as good as the file under it. Files open for writing when
+ * we go to map them aren't mapped, but one that gets opened and truncated
+ * afterwards, while its mapping is still being sent, takes the server down
+ * with a SIGBUS. Files which get rewritten in place while being served should
+ * go through the file cache, whose copies can't change.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+#include <memory>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+class mapped_file{
+    public:
+        //Map the whole file, returns nullptr if it can't be opened or
+        //mapped or someone has it open for writing. Shared since the streams sending out of it hold on to it
+        //until the last byte has been acked.
+        static std::shared_ptr<mapped_file> open(const std::string& path);
+
+        //Read length bytes of the open file into anonymous memory and make
+        //that read only. Nothing done to the file afterwards shows through.
+        //Returns nullptr if it couldn't all be read.
+        static std::shared_ptr<mapped_file> load(int fd, uint64_t length);
+        ~mapped_file();
+
+        //Owns the mapping, can't be coppied
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        const uint8_t* data();
+        uint64_t size();
+
+    private:
+        mapped_file(const uint8_t*, uint64_t);
+
+        const uint8_t* mapping;
+        uint64_t length;
+};
@@ -0,0 +1,146 @@
+/* Implementation of the class and function defined in resumable_fetch.hpp */
+
+#include "resumable_fetch.hpp"
+#include "file_layer.hpp"
+
+//Posix
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//STL
+#include <string>
+using std::string;
+#include <fstream>
+using std::ifstream;
+
+const uint64_t checkpoint::INTERVAL;
+
+checkpoint::checkpoint(const string& path): sidecar(path + ".checkpoint"){
+}
+
+//One line, the size of the file and then how much of it is on disk
+bool checkpoint::load(uint64_t& size, uint64_t& offset){
+    ifstream ifs(sidecar);
+    if(!(ifs >> size >> offset)){
+        return false;
+    }
+    return offset <= size;
+}
+
+//Write the new checkpoint beside the old one and rename it over the top, then
+//sync the directory so the rename sticks too.
+bool checkpoint::save(uint64_t size, uint64_t offset){
+    string temp = sidecar + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return false;
+    }
+    string line = std::to_string(size) + " " + std::to_string(offset) + "\n";
+    bool written = write(fd, line.data(), line.size()) == (ssize_t)line.size()
+                   && fsync(fd) == 0;
+    close(fd);
+    if(!written || rename(temp.c_str(), sidecar.c_str()) != 0){
+        unlink(temp.c_str());
+        return false;
+    }
+
+    size_t slash = sidecar.rfind('/');
+    string dir = slash == string::npos ? "." : sidecar.substr(0, slash + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY);
+    if(dir_fd >= 0){
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return true;
+}
+
+void checkpoint::remove(){
+    unlink(sidecar.c_str());
+}
+
+fetch_status::Enum resumable_fetch(jstp_stream& stream, const string& filename,
+                                   const string& path, uint64_t& length,
+                                   uint64_t& resumed){
+    //Only trust the checkpoint if the output still has everything it says is
+    //there, and only a peer with the binary framing can take an offset.
+    checkpoint saved(path);
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    struct stat existing;
+    bool resuming = stream.get_binary_framing() && 
+                    saved.load(size, offset) && 
+                    stat(path.c_str(), &existing) == 0 &&
+                    (uint64_t)existing.st_size >= offset;
+
+    //Sending the size means a server whose copy has changed starts over
+    outgoing_message request;
+    request.set_action(action_type::REQUEST);
+    request.set_filename(filename);
+    request.set_digest();
+    request.set_compressed();
+    if(resuming){
+        request.set_offset(offset);
+        request.set_size(size);
+    }
+    request.send(stream);
+
+    incoming_message response;
+    if(!response.recv_header(stream)){
+        return fetch_status::FAILED;
+    }
+    if(response.get_action() == action_type::DENY){
+        return fetch_status::DENIED;
+    }
+    if(response.get_action() != action_type::DATA){
+        return fetch_status::FAILED;
+    }
+
+    //Wherever the server decided to start, a server from before offsets
+    //starts at the beginning and doesn't say so.
+    if(!response.get_offset(offset)){
+        offset = 0;
+    }
+    if(!response.get_size(size)){
+        size = response.get_length();
+    }
+    int flags = O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0);
+    int fd = open(path.c_str(), flags, 0644);
+    if(fd < 0){
+        return fetch_status::FAILED;
+    }
+    length = size;
+    resumed = offset;
+
+    //Sync and move the checkpoint along every INTERVAL bytes
+    uint64_t checkpointed = offset;
+    uint64_t reached = offset;
+    auto progress = [&](uint64_t written){
+        reached = written;
+        if(written - checkpointed >= checkpoint::INTERVAL && 
+           fdatasync(fd) == 0 && saved.save(size, written)){
+            checkpointed = written;
+        }
+    };
+    bool complete = response.recv_body(stream, fd, offset, progress);
+
+    //Whatever made it, make sure the next fetch knows about it. All of it
+    //arriving and still failing means it didn't match the digest, some of
+    //what we have is wrong and there is no telling which part so the next
+    //fetch starts over.
+    if(!complete){
+        if(reached == size){
+            saved.remove();
+        }
+        else if(reached > checkpointed && fdatasync(fd) == 0){
+            saved.save(size, reached);
+        }
+        close(fd);
+        return fetch_status::FAILED;
+    }
+    //Anything an earlier attempt left past the end doesn't belong
+    bool trimmed = ftruncate(fd, size) == 0;
+    close(fd);
+    saved.remove();
+    return trimmed ? fetch_status::DONE : fetch_status::FAILED;
+}
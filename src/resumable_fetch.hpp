@@ -0,0 +1,50 @@
+/* This file defines a resumable fetch, which pulls a file down over one stream
+ * and keeps a small checkpoint file next to the output saying how much of it
+ * is safely on disk. If the transfer dies part way through, the next fetch of
+ * the same file asks the server to start from there instead of from the
+ * beginning.
+ *
+ * The checkpoint is only ever moved forward after the data it covers has been
+ * synced, and it is replaced with a rename so it is never half written. It is
+ * removed once the whole file has arrived.
+ */
+
+#pragma once
+
+//STL includes
+#include <string>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+#include "jstp_streams.hpp"
+#include "striped_fetch.hpp"
+
+//The checkpoint for one output file, kept beside it with an extra extension
+class checkpoint{
+    public:
+        //How much gets written between checkpoints, each one costs a sync
+        static const uint64_t INTERVAL = 64000000;
+
+        explicit checkpoint(const std::string& path);
+
+        //Read back the size of the file being fetched and how far we got,
+        //returns false if there is no checkpoint or it doesn't make sense.
+        bool load(uint64_t& size, uint64_t& offset);
+
+        //Record progress, the data up to offset has to be synced already
+        bool save(uint64_t size, uint64_t offset);
+        void remove();
+
+    private:
+        std::string sidecar;
+};
+
+//Fetch filename over the stream into the file at path, picking up wherever a
+//checkpoint says an earlier fetch stopped. Length is set to the size of the
+//file and resumed to where this fetch started writing it. A failed fetch
+//leaves a checkpoint behind for the next one.
+fetch_status::Enum resumable_fetch(jstp_stream&, const std::string& filename,
+                                   const std::string& path, uint64_t& length,
+                                   uint64_t& resumed);
@@ -0,0 +1,130 @@
+/* Implementation of the class defined in ring_buffer.hpp */
+
+#include "ring_buffer.hpp"
+
+//Cstd
+#include <cstring>
+
+//STL
+#include <algorithm>
+using std::min;
+
+//Storage starts out this big unless the capacity is smaller
+static const size_t INITIAL_STORAGE = 65536;
+
+//Round up to the next power of two
+static size_t round_up(size_t n){
+    size_t p = 1;
+    while(p < n){
+        p <<= 1;
+    }
+    return p;
+}
+
+ring_buffer::ring_buffer(size_t capacity): 
+    storage(nullptr), storage_size(0), max_capacity(round_up(capacity)),
+    head(0), count(0){}
+
+ring_buffer::~ring_buffer(){
+    delete [] storage;
+}
+
+size_t ring_buffer::size(){
+    return count;
+}
+
+size_t ring_buffer::capacity(){
+    return max_capacity;
+}
+
+size_t ring_buffer::available(){
+    return max_capacity - count;
+}
+
+size_t ring_buffer::write(const uint8_t* data, size_t n){
+    n = min(n, available());
+    if(n == 0){
+        return 0;
+    }
+    grow(count + n);
+
+    //Copy in up to two pieces, the second one wraps to the start of storage
+    size_t mask = storage_size - 1;
+    size_t tail = (head + count) & mask;
+    size_t first = min(n, storage_size - tail);
+    memcpy(storage + tail, data, first);
+    memcpy(storage, data + first, n - first);
+    count += n;
+    return n;
+}
+
+size_t ring_buffer::peek(size_t offset, uint8_t* out, size_t n){
+    byte_span s[2];
+    size_t used = spans(offset, n, s);
+    size_t copied = 0;
+    for(size_t i = 0; i < used; i++){
+        memcpy(out + copied, s[i].data, s[i].size);
+        copied += s[i].size;
+    }
+    return copied;
+}
+
+size_t ring_buffer::read(uint8_t* out, size_t n){
+    size_t copied = peek(0, out, n);
+    consume(copied);
+    return copied;
+}
+
+void ring_buffer::consume(size_t n){
+    n = min(n, count);
+    count -= n;
+
+    //An empty buffer may as well start back at the beginning
+    head = count == 0 ? 0 : (head + n) & (storage_size - 1);
+}
+
+void ring_buffer::clear(){
+    head = 0;
+    count = 0;
+}
+
+size_t ring_buffer::spans(size_t offset, size_t n, byte_span out[2]){
+    if(offset >= count){
+        return 0;
+    }
+    n = min(n, count - offset);
+    if(n == 0){
+        return 0;
+    }
+
+    size_t start = (head + offset) & (storage_size - 1);
+    size_t first = min(n, storage_size - start);
+    out[0].data = storage + start;
+    out[0].size = first;
+    if(first == n){
+        return 1;
+    }
+    out[1].data = storage;
+    out[1].size = n - first;
+    return 2;
+}
+
+//Double the storage until n bytes fit, moving the contents so that they start
+//at the beginning of the new storage.
+void ring_buffer::grow(size_t n){
+    if(n <= storage_size){
+        return;
+    }
+    size_t new_size = storage_size == 0 ? min(INITIAL_STORAGE, max_capacity)
+                                        : storage_size;
+    while(new_size < n){
+        new_size <<= 1;
+    }
+
+    uint8_t* new_storage = new uint8_t[new_size];
+    peek(0, new_storage, count);
+    delete [] storage;
+    storage = new_storage;
+    storage_size = new_size;
+    head = 0;
+}
@@ -0,0 +1,65 @@
+/* This file defines the byte ring buffer jstp_stream uses for its send and
+ * receive buffers. Data goes in and out in bulk with memcpy, and any range of
+ * buffered bytes can be looked at in place as at most two contiguous spans
+ * (two when the range wraps around the end of the storage).
+ */
+
+#pragma once
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//A contiguous run of bytes owned by someone else
+struct byte_span{
+    const uint8_t* data;
+    size_t size;
+};
+
+//The storage is always a power of two in size so positions can be wrapped with
+//a mask. It starts out small and doubles whenever a write needs more room, up
+//to the capacity given at construction, so idle streams stay cheap.
+class ring_buffer{
+    public:
+        ring_buffer(size_t capacity);
+        ~ring_buffer();
+
+        //Owns raw storage, can't be coppied
+        ring_buffer(const ring_buffer&) = delete;
+        ring_buffer& operator=(const ring_buffer&) = delete;
+
+        //Sizes, in bytes
+        size_t size();
+        size_t capacity();
+        size_t available();
+
+        //Append up to n bytes, returns how many fit
+        size_t write(const uint8_t*, size_t n);
+
+        //Copy up to n bytes out starting offset bytes past the front, leaves
+        //the buffer untouched. Returns how many bytes were copied.
+        size_t peek(size_t offset, uint8_t*, size_t n);
+
+        //Copy up to n bytes off the front and remove them
+        size_t read(uint8_t*, size_t n);
+
+        //Drop bytes from the front without looking at them
+        void consume(size_t n);
+        void clear();
+
+        //Fill out with the spans covering up to n bytes starting offset bytes
+        //past the front, returns how many spans were used (0, 1 or 2).
+        size_t spans(size_t offset, size_t n, byte_span out[2]);
+
+    private:
+        uint8_t* storage;
+        size_t storage_size;
+        size_t max_capacity;
+
+        //Position of the front and the number of bytes buffered
+        size_t head;
+        size_t count;
+
+        //Make sure at least n bytes of storage exist
+        void grow(size_t n);
+};
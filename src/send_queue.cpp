@@ -0,0 +1,118 @@
+/* Implementation of the class defined in send_queue.hpp */
+
+#include "send_queue.hpp"
+
+//STL
+#include <algorithm>
+using std::min;
+#include <memory>
+using std::shared_ptr;
+
+const size_t send_queue::MAX_SPANS;
+
+send_queue::send_queue(size_t capacity): ring(capacity), count(0){}
+
+size_t send_queue::size(){
+    return count;
+}
+
+size_t send_queue::available(){
+    return ring.available();
+}
+
+size_t send_queue::write(const uint8_t* data, size_t n){
+    n = ring.write(data, n);
+    if(n == 0){
+        return 0;
+    }
+
+    //Back to back writes share one extent
+    if(!extents.empty() && extents.back().data == nullptr){
+        extents.back().size += n;
+    }
+    else{
+        extents.push_back(extent{nullptr, n, nullptr});
+    }
+    count += n;
+    return n;
+}
+
+void send_queue::write_external(const uint8_t* data, size_t n,
+                                shared_ptr<const void> owner){
+    if(n == 0){
+        return;
+    }
+    extents.push_back(extent{data, n, owner});
+    count += n;
+}
+
+void send_queue::consume(size_t n){
+    n = min(n, count);
+    count -= n;
+    while(n > 0){
+        extent& front = extents.front();
+        size_t used = min(n, front.size);
+        if(front.data == nullptr){
+            ring.consume(used);
+        }
+        else{
+            front.data += used;
+        }
+        front.size -= used;
+        n -= used;
+
+        //Dropping the extent lets go of the owner too
+        if(front.size == 0){
+            extents.pop_front();
+        }
+    }
+}
+
+void send_queue::clear(){
+    ring.clear();
+    extents.clear();
+    count = 0;
+}
+
+size_t send_queue::spans(size_t offset, size_t n, byte_span* out, 
+                         size_t max_spans){
+    size_t used = 0;
+
+    //Bytes of the ring that come before the extent we are looking at, the
+    //ring holds the coppied extents back to back in order.
+    size_t ring_offset = 0;
+    for(auto it = extents.begin(); it != extents.end(); it++){
+        if(n == 0 || used == max_spans){
+            break;
+        }
+
+        //Skip extents which are entirely before the range
+        if(offset >= it->size){
+            offset -= it->size;
+            if(it->data == nullptr){
+                ring_offset += it->size;
+            }
+            continue;
+        }
+
+        size_t take = min(n, it->size - offset);
+        if(it->data == nullptr){
+            byte_span s[2];
+            size_t got = ring.spans(ring_offset + offset, take, s);
+            take = 0;
+            for(size_t i = 0; i < got && used < max_spans; i++){
+                out[used++] = s[i];
+                take += s[i].size;
+            }
+            ring_offset += it->size;
+        }
+        else{
+            out[used].data = it->data + offset;
+            out[used].size = take;
+            used++;
+        }
+        n -= take;
+        offset = 0;
+    }
+    return used;
+}
@@ -0,0 +1,68 @@
+/* This file defines the queue of bytes jstp_stream sends out of. Bytes handed
+ * to send() are coppied into a ring buffer like before, but a caller can also
+ * queue a range of memory it owns (a mapped file, say) and the stream will
+ * send straight out of it without ever copying it. The queue keeps the ranges
+ * in order and hands out spans for any part of it so the sender can point its
+ * iovecs at them, retransmissions just look at the same memory again.
+ */
+
+#pragma once
+
+//Project specific headers
+#include "ring_buffer.hpp"
+
+//STL includes
+#include <deque>
+#include <memory>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+class send_queue{
+    public:
+        //Most spans a single call to spans will hand out
+        static const size_t MAX_SPANS = 4;
+
+        //The capacity only limits coppied bytes, external ones are free
+        send_queue(size_t capacity);
+
+        //Bytes queued up, of either kind
+        size_t size();
+
+        //Room left for coppied bytes
+        size_t available();
+
+        //Copy up to n bytes onto the end, returns how many fit
+        size_t write(const uint8_t*, size_t n);
+
+        //Queue n bytes of someone else's memory without copying them. The
+        //owner is held on to until the last of the bytes is consumed so the
+        //memory stays valid for as long as we might need to resend it.
+        void write_external(const uint8_t*, size_t n, 
+                            std::shared_ptr<const void> owner);
+
+        //Drop bytes from the front, they have been acked
+        void consume(size_t n);
+        void clear();
+
+        //Fill out with the spans covering up to n bytes starting offset bytes
+        //past the front, returns how many were used. Ranges made up of lots
+        //of little pieces may come up short if we run out of spans, add up
+        //the sizes to see how much was covered.
+        size_t spans(size_t offset, size_t n, byte_span* out, 
+                     size_t max_spans = MAX_SPANS);
+
+    private:
+        //A run of bytes in the queue, either in the ring (data is null) or
+        //out in memory held alive by owner.
+        struct extent{
+            const uint8_t* data;
+            size_t size;
+            std::shared_ptr<const void> owner;
+        };
+
+        ring_buffer ring;
+        std::deque<extent> extents;
+        size_t count;
+};
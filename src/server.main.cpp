@@ -1,23 +1,308 @@
 //TODO boilerplate
 //The main file for the sender program
 #include <string>
-using std::string; using std::stoi; using std::stod;
+using std::string; using std::stoi; using std::stod; using std::stoull;
 #include <iostream>
 using std::cout; using std::cerr; using std::endl;
+using std::ostream;
 #include <fstream>
 using std::ifstream;
 #include <stdexcept>
+#include <memory>
+using std::shared_ptr; using std::unique_ptr;
+#include <thread>
+using std::thread;
+#include <mutex>
+using std::mutex; using std::unique_lock;
+#include <condition_variable>
+using std::condition_variable;
+#include <chrono>
+#include <sstream>
+using std::ostringstream;
+#include <vector>
+using std::vector;
+#include <algorithm>
+using std::max; using std::min;
+#include <cctype>
 //My headers for reliable data transfer and for file transfer
 #include "file_layer.hpp"
 #include "jstp_streams.hpp"
+#include "mapped_file.hpp"
+#include "delta_sync.hpp"
+#include "crc32c.hpp"
+#include "file_cache.hpp"
 
-//Usage, <executable> portnumber
+//Answer one request, returns false if the client didn't get its file. Ranged
+//is set if the client asked for part of the file, it may ask for more. Files
+//come out of the cache if there is one.
+static bool serve_request(jstp_stream& stream, incoming_message& req, 
+                          ostream& log, bool& ranged, file_cache* cache){
+    //Print out some diagnostic messages to the server output
+    log << "The client requested a file by the name of \""
+        << req.get_filename() << "\'" << endl;
+
+    //Map the file if we can, then the body goes straight from the page cache
+    //onto the wire. Anything that can't be mapped, like a pipe or a file
+    //someone is still writing, gets streamed through a file stream instead.
+    //The cache's copies go out the same way as a mapping.
+    shared_ptr<mapped_file> mapping = cache ? cache->get(req.get_filename()) 
+                                            : mapped_file::open(
+                                                  req.get_filename());
+    ifstream ifs;
+    if(!mapping){
+        ifs.open(req.get_filename(), std::ios::binary);
+    }
+
+    //If the file could not be opened...
+    if(!mapping && !ifs.is_open()){
+        //...Print a message and send a deny back to the client
+        log << "Unfortunatly, the file could not be found."
+               "Sending back a deny message" << endl; 
+        outgoing_message deny;
+        deny.set_action(action_type::DENY);
+        deny.set_filename(req.get_filename());
+        log << "Attempting to send" << endl;
+        deny.send(stream);
+        log << "Exiting now" << endl;
+        return false;
+    }
+
+    //Otherwise, we have a good file to send
+    log << "The requested file was opened without any trouble!" << endl;
+
+    //Find out how big it is, the body gets streamed straight out of the file
+    uint64_t size;
+    if(mapping){
+        size = mapping->size();
+    }
+    else{
+        ifs.seekg(0, std::ios::end);
+        size = ifs.tellg();
+    }
+
+    log << "Attempting to craft a response..." << endl;
+    outgoing_message data_msg;
+    data_msg.set_action(action_type::DATA);
+    data_msg.set_filename(req.get_filename());
+
+    //A client which can check a digest gets one after the body
+    uint32_t unused;
+    if(req.get_digest(unused)){
+        data_msg.set_digest();
+    }
+
+    //A client with an old copy sent signatures of it. If only sending what
+    //changed comes out smaller, that is what it gets.
+    if(req.get_delta() && mapping){
+        delta_encoder encoder(req.get_data());
+        if(encoder.valid()){
+            encoder.plan(mapping->data(), size);
+        }
+        if(encoder.valid() && encoder.length() < size){
+            log << "    ... response crafted, a delta of " 
+                << encoder.length() << " bytes with " 
+                << encoder.literal_bytes() << " bytes of new data!" << endl;
+            data_msg.set_delta();
+            data_msg.set_size(size);
+            data_msg.send_header(stream, encoder.length());
+            if(!encoder.send(stream, mapping->data())){
+                cerr << "The client went away before the delta was sent" 
+                     << endl;
+                return false;
+            }
+            data_msg.send_digest(stream, crc32c(0, mapping->data(), size));
+            if(!stream.flush()){
+                cerr << "The client went away before the delta was sent" 
+                     << endl;
+                return false;
+            }
+            log << "    reply sent." << endl;
+            return true;
+        }
+    }
+
+    //Past here the body is the file itself, a client which can read
+    //compressed blocks gets them. The delta above is already about as small
+    //as it gets.
+    if(req.get_compressed()){
+        data_msg.set_compressed();
+    }
+
+    //A range is clamped to the end of the file, the reply says where it
+    //really starts and how big the whole thing is. A client resuming a file
+    //which has changed size since gets all of it again.
+    uint64_t offset = 0;
+    uint64_t length = size;
+    uint64_t expected_size;
+    ranged = req.get_offset(offset);
+    if(ranged){
+        if(req.get_size(expected_size) && expected_size != size){
+            offset = 0;
+        }
+        offset = min(offset, size);
+        length = size - offset;
+        uint64_t range;
+        if(req.get_range(range)){
+            length = min(length, range);
+        }
+        data_msg.set_offset(offset);
+        data_msg.set_size(size);
+    }
+    if(!mapping){
+        ifs.seekg(offset, std::ios::beg);
+    }
+    log << "    ... response crafted, " << length << " bytes of data!" 
+        << endl;
+
+    log << "Attempting to reply..." << endl;
+    if(mapping){
+        if(!data_msg.send_file(stream, mapping, offset, length)){
+            cerr << "The stream closed before the file was all acked" << endl;
+            return false;
+        }
+    }
+    else if(!data_msg.send_file(stream, ifs, length)){
+        cerr << "The file could not be read all the way through" << endl;
+        return false;
+    }
+    log << "    reply sent." << endl;
+    return true;
+}
+
+//Serve one client its file over the stream, chatter about it to log and
+//complain to cerr. Returns false if the transfer didn't happen. A client
+//asking for ranges gets served until it closes the stream.
+static bool serve(jstp_stream& stream, ostream& log, 
+                  file_cache* cache = nullptr){
+    bool served = false;
+    while(true){
+        //Next, we need to accept the segment the client is sending
+        log << "Attempting to receive a request message..." << endl;
+        incoming_message req;
+        if(!req.recv(stream)){
+            if(!served){
+                cerr << "The client closed the connection without a request" 
+                     << endl;
+            }
+            break;
+        }
+        log << "    ...request message received!" << endl;
+
+        bool ranged = false;
+        if(!serve_request(stream, req, log, ranged, cache)){
+            return false;
+        }
+        served = true;
+        if(!ranged){
+            break;
+        }
+    }
+    log << "Exiting now." << endl;
+
+    //Report how the round trip times looked over the connection
+    log << stream.get_rtt_stats().str() << endl;
+
+    return served;
+}
+
+//Everything a worker needs to serve clients forever
+struct server_config{
+    uint16_t port;
+    int window;
+    double loss;
+    int max_concurrent;
+    bool share;
+    congestion_type::Enum congestion;
+    recovery_mode::Enum recovery;
+
+    //Null if files aren't cached, otherwise one cache for every worker. Its
+    //lock is only taken once per request, splitting it up would mean a copy
+    //of every popular file per worker out of a fraction of the budget each.
+    file_cache* cache;
+};
+
+//Accept clients forever, every connection gets a thread of its own. The
+//streams all run on the worker's reactor and each one already talks to its
+//client over its own ephemeral port or connection ID, so the acceptor is free
+//to take the next one as soon as the handshake is done. Once we hit the limit
+//we stop accepting, new clients wait in the acceptor's socket until a
+//transfer finishes. The per connection chatter would be unreadable so it goes
+//nowhere and we print one line per transfer instead.
+//
+//With reuse_port this is one of several workers listening on the same port,
+//each with its own reactor, acceptor and limit. Nothing but the file cache is
+//shared between them, the kernel decides which worker a client's datagrams go
+//to.
+static void serve_forever(const server_config& c, bool reuse_port, 
+                          size_t worker){
+    jstp_reactor reactor;
+    jstp_acceptor acceptor(c.port, &reactor, c.share, reuse_port);
+    mutex slots_mutex;
+    condition_variable slot_freed;
+    int active = 0;
+    uint64_t connections = 0;
+    while(true){
+        {
+            unique_lock<mutex> l(slots_mutex);
+            slot_freed.wait(l, [&](){ return active < c.max_concurrent; });
+            active++;
+        }
+
+        shared_ptr<jstp_stream> stream(new jstp_stream(acceptor, c.loss, 
+                                                       c.window,
+                                                       c.recovery,
+                                                       c.congestion));
+        uint64_t id = ++connections;
+        thread([&, stream, id](){
+            ostream quiet(nullptr);
+            auto start = std::chrono::steady_clock::now();
+            bool served = serve(*stream, quiet, c.cache);
+            double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+
+            //One write per line so workers don't print over each other
+            ostringstream line;
+            if(reuse_port){
+                line << "Worker " << worker << " c";
+            }
+            else{
+                line << "C";
+            }
+            line << "onnection " << id << (served ? " served" : " failed") 
+                 << " in " << seconds << " s";
+            if(c.cache){
+                line << ", cache " << c.cache->get_stats().str();
+            }
+            line << endl;
+            unique_lock<mutex> l(slots_mutex);
+            cout << line.str();
+            active--;
+            slot_freed.notify_one();
+        }).detach();
+    }
+}
+
+//Usage, <executable> portnumber window loss [max_concurrent] [options...]
+//    Options come after the limit, in any order. Without a limit only
+//    congestion= and recovery= can be given, the rest are for serving clients
+//    forever.
+//    shared      Every client talks to the listening port instead of getting
+//                an ephemeral port of its own.
+//    workers=N   Start N workers, each pinned to a core and with a socket of
+//                its own on the listening port (SO_REUSEPORT). The limit is
+//                per worker.
+//    cache=MB    Keep up to this many MB of the files asked for in memory,
+//                shared between all the workers.
+//    congestion=NAME  Congestion controller, fixed, reno or cubic.
+//    recovery=NAME    How lost segments are resent, go-back-n or selective.
+//                     SACK blocks are only used with clients asking for
+//                     selective too.
 int main(int argc, char* argv[]){
 
     //The first step is checking for errors in the user's input.
     //Check that the number of args received is correct
-    if(argc != 4){
-        cerr << "Expected one arg, Received " << argc -1 << endl;
+    if(argc < 4 || argc > 10){
+        cerr << "Expected three to nine args, Received " << argc -1 << endl;
         return 1;
     }
 
@@ -75,61 +360,145 @@ int main(int argc, char* argv[]){
     double prob_loss = 0;
     prob_loss = stod(argv[3]); 
 
+    //With a limit on concurrent transfers we keep serving clients forever.
+    //Anything not starting with a digit is an option, not the limit.
+    int max_concurrent = 0;
+    int first_option = 4;
+    if(argc >= 5 && isdigit((unsigned char)argv[4][0])){
+        first_option = 5;
+        try{
+            max_concurrent = stoi(argv[4]); 
+        }
+        catch(const std::logic_error& e){
+            cerr << "The argument \"" << argv[4] 
+                 << "\" could not be converted to a valid limit" << endl;
+            cerr << "Exiting with status code 1" << endl;
+            return 1;
+        }
+        if(max_concurrent < 1){
+            cerr << "At least one transfer has to be allowed at a time" << endl;
+            cerr << "Exiting with status code 1" << endl;
+            return 1;
+        }
+    }
+
+    bool share = false;
+    int workers = 0;
+    uint64_t cache_mb = 0;
+    congestion_type::Enum congestion = congestion_type::NONE;
+    string congestion_name;
+    recovery_mode::Enum recovery = recovery_mode::GO_BACK_N;
+    string recovery_name;
+    for(int i = first_option; i < argc; i++){
+        string option(argv[i]);
+        if(option == "shared"){
+            share = true;
+            continue;
+        }
+        if(option.compare(0, 8, "workers=") == 0){
+            try{
+                workers = stoi(option.substr(8));
+            }
+            catch(const std::logic_error& e){
+                workers = 0;
+            }
+            if(workers >= 1){
+                continue;
+            }
+        }
+        if(option.compare(0, 6, "cache=") == 0){
+            try{
+                cache_mb = stoull(option.substr(6));
+            }
+            catch(const std::logic_error& e){
+                cache_mb = 0;
+            }
+            if(cache_mb >= 1){
+                continue;
+            }
+        }
+        if(option.compare(0, 11, "congestion=") == 0){
+            congestion_name = option.substr(11);
+            if(parse_congestion_type(congestion_name, congestion)){
+                continue;
+            }
+        }
+        if(option.compare(0, 9, "recovery=") == 0){
+            recovery_name = option.substr(9);
+            if(parse_recovery_mode(recovery_name, recovery)){
+                continue;
+            }
+        }
+        cerr << "The argument \"" << option 
+             << "\" should be \"shared\", \"workers=N\", \"cache=MB\", "
+             << "\"congestion=\" and one of fixed, reno or cubic or "
+             << "\"recovery=\" and one of go-back-n or selective" << endl;
+        cerr << "Exiting with status code 1" << endl;
+        return 1;
+    }
+    if(max_concurrent == 0 && (share || workers > 0 || cache_mb > 0)){
+        cerr << "\"shared\", \"workers=N\" and \"cache=MB\" need a limit on "
+             << "concurrent transfers before them" << endl;
+        cerr << "Exiting with status code 1" << endl;
+        return 1;
+    }
 
     //Print a message to the user summarizing user intent
     cout << "You have requested that I use the following information." << endl;
     cout << "Listening Port Number: " << portnum << endl;
+    if(max_concurrent > 0){
+        cout << "Concurrent transfers : " << max_concurrent << endl;
+    }
+    if(share){
+        cout << "Sharing one socket   : yes" << endl;
+    }
+    if(workers > 0){
+        cout << "Workers              : " << workers << endl;
+    }
+    if(cache_mb > 0){
+        cout << "File cache           : " << cache_mb << " MB" << endl;
+    }
+    if(congestion != congestion_type::NONE){
+        cout << "Congestion control   : " << congestion_name << endl;
+    }
+    if(recovery != recovery_mode::GO_BACK_N){
+        cout << "Loss recovery        : " << recovery_name << endl;
+    }
     cout << endl;
 
-    //Create an acceptor object, use it to try and open a stream
-    jstp_acceptor acceptor(portnum);
-    cout << "Acceptor created!" << endl;
-    jstp_stream stream(acceptor, prob_loss, window);    //TODO use real loss
-    cout << "Stream Created!" << endl;
-
-    //Next, we need to accept the segment the client is sending
-    cout << "Attempting to receive a request message..." << endl;
-    incoming_message req;
-    req.recv(stream);
-    cout << "    ...request message received!" << endl;
-
-    //Print out some diagnostic messages to the server output
-    cout << "The client requested a file by the name of \""
-         << req.get_filename() << "\'" << endl;
-
-    //Try to open a file stream by the name of the user request
-    ifstream ifs;
-    ifs.open(req.get_filename());
-
-    //If the file could not be opened...
-    if(!ifs.is_open()){
-        //...Print a message and send a deny back to the client
-        cout << "Unfortunatly, the file could not be found."
-                "Sending back a deny message" << endl; 
-        outgoing_message deny;
-        deny.set_action(action_type::DENY);
-        deny.set_filename(req.get_filename());
-        cout << "Attempting to send" << endl;
-        deny.send(stream);
-        cout << "Exiting now" << endl;
-        return 1;
+    //Without a limit we serve a single client and exit
+    if(max_concurrent == 0){
+        //Create an acceptor object, use it to try and open a stream
+        jstp_acceptor acceptor(portnum);
+        cout << "Acceptor created!" << endl;
+        jstp_stream stream(acceptor, prob_loss, window, recovery, congestion);
+        cout << "Stream Created!" << endl;
+        return serve(stream, cout) ? 0 : 1;
     }
 
-    //Otherwise, we have a good file to send
-    cout << "The requested file was opened without any trouble!" << endl;
-
-    cout << "Attempting to craft a response..." << endl;
-    outgoing_message data_msg;
-    data_msg.set_action(action_type::DATA);
-    data_msg.set_filename(req.get_filename());
-    data_msg.attach_data(ifs);
-    cout << "    ... response crafted!" << endl;
-    cout << "This is the response: " << endl;
-    cout << data_msg.str() << endl;
-
-    cout << "Attempting to reply..." << endl;
-    data_msg.send(stream);
-    cout << "    reply sent. Exiting now." << endl;
-
-    return 0;
+    //When serving lots of clients their streams all run on a reactor instead
+    //of starting two threads each, the only thread a connection gets is the
+    //one serving it. Either one worker does it all right here, or every
+    //worker gets a core.
+    unique_ptr<file_cache> cache;
+    if(cache_mb > 0){
+        cache.reset(new file_cache(cache_mb * 1000000));
+    }
+    server_config config = {(uint16_t)portnum, window, prob_loss, 
+                            max_concurrent, share, congestion, recovery,
+                            cache.get()};
+    if(workers == 0){
+        serve_forever(config, false, 0);
+    }
+    vector<thread> worker_threads;
+    for(int w = 0; w < workers; w++){
+        worker_threads.push_back(thread([config, w](){
+            pin_to_core(w);
+            serve_forever(config, true, w);
+        }));
+    }
+    for(thread& t: worker_threads){
+        t.join();
+    }
+    return 1;
 }
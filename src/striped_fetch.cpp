@@ -0,0 +1,134 @@
+/* Implementation of the function defined in striped_fetch.hpp */
+
+#include "striped_fetch.hpp"
+#include "file_layer.hpp"
+#include "jstp_streams.hpp"
+
+//Posix
+#include <fcntl.h>
+#include <unistd.h>
+
+//STL
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <thread>
+using std::thread;
+#include <algorithm>
+using std::max;
+
+//Where stripe i of the file starts, the last one ends right at the size
+static uint64_t stripe_start(uint64_t size, size_t stripes, size_t i){
+    return size / stripes * i + size % stripes * i / stripes;
+}
+
+//Ask for one range over the stream and write the reply into place. The server
+//might have clamped it, anything other than exactly what we asked for means
+//it doesn't agree with us about the file.
+static bool fetch_range(jstp_stream& stream, const string& filename, int fd,
+                        uint64_t offset, uint64_t length){
+    outgoing_message request;
+    request.set_action(action_type::REQUEST);
+    request.set_filename(filename);
+    request.set_offset(offset);
+    request.set_range(length);
+    request.set_digest();
+    request.set_compressed();
+    request.send(stream);
+
+    incoming_message response;
+    uint64_t response_offset;
+    if(!response.recv_header(stream) || 
+       response.get_action() != action_type::DATA ||
+       !response.get_offset(response_offset) || response_offset != offset ||
+       response.get_length() != length){
+        return false;
+    }
+    return response.recv_body(stream, fd, offset);
+}
+
+fetch_status::Enum striped_fetch(const string& hostname, uint16_t port,
+                                 const string& filename, const string& path,
+                                 size_t stripes, size_t window, double loss,
+                                 uint64_t& length, 
+                                 congestion_type::Enum congestion,
+                                 recovery_mode::Enum recovery){
+    jstp_connector connector(hostname, port);
+    jstp_stream first(connector, loss, window, recovery, congestion);
+
+    //First find out how big the file is by asking for everything past the
+    //end of it, which is always nothing. Only the offset goes out since a
+    //server from before ranges can't parse the range field, it ignores the
+    //offset and sends the whole file without a size. A peer without the
+    //binary framing just gets asked for the file. Either way we keep
+    //whatever comes back.
+    outgoing_message probe;
+    probe.set_action(action_type::REQUEST);
+    probe.set_filename(filename);
+    if(first.get_binary_framing()){
+        probe.set_offset(UINT64_MAX);
+        probe.set_digest();
+        probe.set_compressed();
+    }
+    probe.send(first);
+
+    incoming_message response;
+    if(!response.recv_header(first)){
+        return fetch_status::FAILED;
+    }
+    if(response.get_action() == action_type::DENY){
+        return fetch_status::DENIED;
+    }
+    if(response.get_action() != action_type::DATA){
+        return fetch_status::FAILED;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return fetch_status::FAILED;
+    }
+    uint64_t size;
+    if(!response.get_size(size)){
+        length = response.get_length();
+        bool complete = response.recv_body(first, fd, 0);
+        close(fd);
+        return complete ? fetch_status::DONE : fetch_status::FAILED;
+    }
+    //The empty body still has to be read for the digest behind it
+    if(!response.recv_body(first, fd, 0) || ftruncate(fd, size) != 0){
+        close(fd);
+        return fetch_status::FAILED;
+    }
+
+    //Every stripe but the first gets a stream of its own, the first one goes
+    //over the stream we already have. Not a vector<bool>, every thread writes
+    //its own entry.
+    stripes = max(stripes, (size_t)1);
+    vector<uint8_t> complete(stripes, false);
+    vector<thread> threads;
+    for(size_t i = 1; i < stripes; i++){
+        threads.push_back(thread([&, i](){
+            jstp_stream stream(connector, loss, window, recovery, 
+                               congestion);
+            uint64_t start = stripe_start(size, stripes, i);
+            complete[i] = fetch_range(stream, filename, fd, start, 
+                                      stripe_start(size, stripes, i + 1) - 
+                                      start);
+        }));
+    }
+    complete[0] = fetch_range(first, filename, fd, 0, 
+                              stripe_start(size, stripes, 1));
+    for(thread& t: threads){
+        t.join();
+    }
+    close(fd);
+
+    length = size;
+    for(uint8_t c: complete){
+        if(!c){
+            return fetch_status::FAILED;
+        }
+    }
+    return fetch_status::DONE;
+}
@@ -0,0 +1,40 @@
+/* This file defines a striped fetch, which pulls one file down over several
+ * streams at once. A single stream only ever gets as far as one congestion
+ * window and one sender thread will take it, so the file is split into as many
+ * byte ranges as there are streams and each stream asks the server for its
+ * own range. Every range is written straight into its place in the output
+ * file as it arrives.
+ *
+ * The server has to understand range requests and be allowed to serve that
+ * many clients at once, anything older just sends the whole file over the
+ * first stream and that is what we keep.
+ */
+
+#pragma once
+
+#include "jstp_streams.hpp"
+
+//STL includes
+#include <string>
+
+//Cstd includes
+#include <cstddef>
+#include <cstdint>
+
+//How a fetch turned out
+namespace fetch_status{
+    enum Enum{DONE, DENIED, FAILED};
+};
+
+//Fetch filename from the server into the file at path, split between stripes
+//streams. The output file is only created or truncated once the server has
+//said it has the file. Length is set to the size of the file on success.
+fetch_status::Enum striped_fetch(const std::string& hostname, uint16_t port,
+                                 const std::string& filename, 
+                                 const std::string& path, size_t stripes,
+                                 size_t window, double loss, 
+                                 uint64_t& length, 
+                                 congestion_type::Enum = 
+                                     congestion_type::NONE,
+                                 recovery_mode::Enum = 
+                                     recovery_mode::GO_BACK_N);
@@ -6,8 +6,11 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <cstring>
+#include <cerrno>
 
 //STL stuff
 #include <vector>
@@ -21,8 +24,18 @@ using std::back_inserter;
 #include <utility>
 using std::swap;
 
+const size_t udp_socket::MAX_BATCH;
+const size_t udp_socket::GSO_MAX_SEGMENTS;
+const size_t udp_socket::GSO_MAX_BYTES;
+
+//The most buffers a batched send will describe to the kernel at once
+static const size_t SEND_IOV_SPACE = 1024;
+
 //Construct a socket with support for segments of up to mss in size.
-udp_socket::udp_socket(size_t mss, double p): loss_probability(p){
+udp_socket::udp_socket(size_t mss, double p): syscalls(0), gso(false),
+                                               gro(false), coalesced_left(0),
+                                               loss_probability(p),
+                                               corruption_probability(0){
 
     //Seed the random number generator with the time of day
     rand_engine.seed(time(nullptr));
@@ -32,21 +45,39 @@ udp_socket::udp_socket(size_t mss, double p): loss_probability(p){
 
     //Use the socket syscall to request a socket for use with UDP
     fd = socket(AF_INET, SOCK_DGRAM, 0);
+    owns_fd = true;
 
     //If the socket could not be created for whatever reason...
     if(fd < 0){
         //Throw an exception, TODO
     }
 
+    //Big segments quickly overrun the default kernel buffers, make sure they
+    //can hold a couple of full batches. The kernel caps this at its max.
+    int buffer_size = 2 * MAX_BATCH * max_segment_size;
+    int current;
+    socklen_t length = sizeof(current);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &current, &length);
+    if(current < buffer_size){
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, 
+                   sizeof(buffer_size));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, 
+                   sizeof(buffer_size));
+    }
+
     //Allocate space for the receiving buffer
-    recv_buffer = new uint8_t[max_segment_size];
+    recv_buffer = new uint8_t[recv_buffer_size()];
 }
 
 //Copy constructor
-udp_socket::udp_socket(udp_socket& other){
+udp_socket::udp_socket(udp_socket& other): syscalls(0), 
+                                           gso(other.gso.load()),
+                                           gro(other.gro.load()),
+                                           coalesced_left(0){
     //Importantly, we can't just copy the file descriptor, we need to duplicate
     //it.
     fd = dup(other.fd);
+    owns_fd = true;
 
     //We can copy the other parameters verbatim.
     has_peer = other.has_peer;
@@ -56,19 +87,26 @@ udp_socket::udp_socket(udp_socket& other){
     local_addr = other.local_addr;
 
     //Finally, we just need to allocate space for the recv buffer
-    recv_buffer = new uint8_t[max_segment_size];
+    recv_buffer = new uint8_t[recv_buffer_size()];
 }
 
 //Swap operation
 void udp_socket::swap(udp_socket& l, udp_socket& r){
     using std::swap;
     swap(l.fd, r.fd);
+    swap(l.owns_fd, r.owns_fd);
     swap(l.has_peer, r.has_peer);
     swap(l.bound, r.bound);
     swap(l.max_segment_size, r.max_segment_size);
     swap(l.peer_addr, r.peer_addr);
     swap(l.local_addr, r.local_addr);
     swap(l.recv_buffer, r.recv_buffer);
+    l.syscalls.store(r.syscalls.exchange(l.syscalls.load()));
+    l.gso.store(r.gso.exchange(l.gso.load()));
+    l.gro.store(r.gro.exchange(l.gro.load()));
+    swap(l.coalesced_next, r.coalesced_next);
+    swap(l.coalesced_left, r.coalesced_left);
+    swap(l.coalesced_size, r.coalesced_size);
 }
 
 //Copy assignment operator, using copy swap idiom
@@ -80,7 +118,9 @@ udp_socket& udp_socket::operator=(udp_socket other){
 //Destruct the socket, simply close the file descriptor freeing it up and delete
 //the receiving buffer.
 udp_socket::~udp_socket(){
-    close(fd);
+    if(owns_fd){
+        close(fd);
+    }
     delete [] recv_buffer;
 }
 
@@ -106,6 +146,12 @@ void udp_socket::bind_local(unsigned short port){
     bound = true;
 }
 
+//Every socket sharing the port has to ask for it, all before binding
+bool udp_socket::set_reuse_port(){
+    int on = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+}
+
 //Bind to any local port (gives an ephemeral port)
 void udp_socket::bind_local_any(){
     //This is just an alias to the previous function, calling with arg 0
@@ -168,6 +214,21 @@ void udp_socket::set_loss_probability(double prob){
     loss_probability = prob;
 }
 
+void udp_socket::set_corruption_probability(double prob){
+    corruption_probability = prob;
+}
+
+//Probing sets DF but doesn't let the kernel's idea of the path MTU stop us
+//sending bigger datagrams, otherwise go back to the default.
+void udp_socket::set_dont_fragment(bool on){
+    int mode = on ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+}
+
+size_t udp_socket::get_max_segment_size(){
+    return max_segment_size;
+}
+
 //Send arbitrary data to our peer in a single segment
 void udp_socket::send(const vector<uint8_t>& v){
 
@@ -178,60 +239,343 @@ void udp_socket::send(const vector<uint8_t>& v){
     }
     
     //Simply make the appropriate call to sendto
+    syscalls++;
     sendto(fd, v.data(), v.size() , 0, 
            (sockaddr *) &peer_addr, sizeof(peer_addr));
 }
 
+//Send several buffers to our peer as a single segment without first copying
+//them together.
+void udp_socket::send(const iovec* iov, size_t count){
+
+    //If the socket isn't bound or doesn't have a peer...
+    if(!has_peer || !bound){
+        //... then we clearly shoudln't be allowed to send anyting. 
+        //TODO throw exception. 
+    }
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &peer_addr;
+    msg.msg_namelen = sizeof(peer_addr);
+    msg.msg_iov = const_cast<iovec*>(iov);
+    msg.msg_iovlen = count;
+    syscalls++;
+    sendmsg(fd, &msg, 0);
+}
+
+//Send a batch of datagrams to our peer, as many as the kernel will take per
+//call. With GSO, a run of datagrams which are all the same size, bar a shorter
+//last one, goes to the kernel as a single message. A datagram the kernel
+//will never take, one too big for the path say, is skipped as if it was lost.
+//When the kernel is only out of room for now we stop there, and the rest goes
+//out again once the stream notices it missing.
+size_t udp_socket::send_batch(const datagram* datagrams, size_t n){
+    if(!has_peer || !bound){
+        //TODO throw exception. 
+    }
+
+    size_t done = 0, sent = 0;
+    while(done < n){
+        mmsghdr msgs[MAX_BATCH];
+        iovec iovs[SEND_IOV_SPACE];
+        char control[MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+        size_t grouped[MAX_BATCH];
+        bool offloading = gso.load();
+        bool any_offloaded = false;
+
+        //Describe every message to sendmmsg, they all go to the same peer
+        size_t msg_count = 0, iov_count = 0, next = done;
+        while(next < n && msg_count < MAX_BATCH && 
+              iov_count + datagrams[next].count <= SEND_IOV_SPACE){
+            mmsghdr& msg = msgs[msg_count];
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_hdr.msg_name = &peer_addr;
+            msg.msg_hdr.msg_namelen = sizeof(peer_addr);
+            msg.msg_hdr.msg_iov = iovs + iov_count;
+
+            //Gather the datagrams which go in this message, without GSO that
+            //is only ever the one.
+            size_t segment_size = 0, total = 0, group = 0;
+            bool full = true;
+            while(next < n && full &&
+                  iov_count + datagrams[next].count <= SEND_IOV_SPACE){
+                size_t size = 0;
+                for(size_t i = 0; i < datagrams[next].count; i++){
+                    size += datagrams[next].iov[i].iov_len;
+                }
+                if(group == 0){
+                    segment_size = size;
+                }
+                else if(!offloading || group == GSO_MAX_SEGMENTS || 
+                        size > segment_size || total + size > GSO_MAX_BYTES){
+                    break;
+                }
+                copy(datagrams[next].iov, 
+                     datagrams[next].iov + datagrams[next].count, 
+                     iovs + iov_count);
+                iov_count += datagrams[next].count;
+                full = size == segment_size;
+                total += size;
+                group++;
+                next++;
+            }
+            msg.msg_hdr.msg_iovlen = iov_count - 
+                                     (msg.msg_hdr.msg_iov - iovs);
+
+            //Tell the kernel where to cut up a message holding several
+            if(group > 1){
+                msg.msg_hdr.msg_control = control[msg_count];
+                msg.msg_hdr.msg_controllen = sizeof(control[msg_count]);
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg.msg_hdr);
+                cmsg->cmsg_level = IPPROTO_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = segment_size;
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+                any_offloaded = true;
+            }
+            grouped[msg_count] = group;
+            msg_count++;
+        }
+
+        syscalls++;
+        int result = sendmmsg(fd, msgs, msg_count, 0);
+        if(result < 0 && errno == EINTR){
+            continue;
+        }
+        if(result <= 0){
+            //Skipping these would throw away datagrams the kernel would
+            //have taken a moment later
+            if(result == 0 || errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == ENOBUFS){
+                return sent;
+            }
+
+            //The kernel can refuse GSO on a send even though the socket
+            //option was accepted, go back to plain datagrams and try again.
+            if(any_offloaded){
+                gso.store(false);
+                continue;
+            }
+
+            //Too big to ever go out, don't let it hold up the rest
+            if(errno == EMSGSIZE){
+                done += grouped[0];
+                continue;
+            }
+            return sent;
+        }
+        for(int i = 0; i < result; i++){
+            done += grouped[i];
+            sent += grouped[i];
+        }
+    }
+    return sent;
+}
+
 //Receive up to mss bytes from the network, currently discards information about
 //where this packet came from.
 vector<uint8_t> udp_socket::recv(bool timeout, timeval tv){
+    const uint8_t* data;
+    size_t count = recv_in_place(data, timeout, tv);
+    return vector<uint8_t>(data, data + count);
+}
+
+//Receive up to mss bytes into our own buffer and hand back where they are
+size_t udp_socket::recv_in_place(const uint8_t*& data, bool timeout, 
+                                 timeval tv){
+    size_t length;
+    if(recv_batch(&data, &length, 1, timeout, tv) == 0){
+        return 0;
+    }
+    return length;
+}
+
+//Receive up to n datagrams, each into its own mss sized slot of the receive
+//buffer. With GRO the kernel may coalesce several into one, so we take a
+//single message into the whole buffer and split it.
+size_t udp_socket::recv_batch(const uint8_t** data, size_t* lengths, size_t n,
+                              bool timeout, timeval tv, sockaddr_in* from){
     //If the socket isn't bound...
     if(!bound){
         //... then we clearly shoudln't be allowed to receive anything.
         //TODO throw exception. 
     }
+    n = std::min(n, MAX_BATCH);
 
-    //First, create an output vector, leave it empty for now.
-    vector<uint8_t> output;
+    //Anything left of the last coalesced datagram comes first
+    if(coalesced_left > 0){
+        return take_coalesced(data, lengths, n, from);
+    }
+    bool coalescing = gro.load();
+    size_t messages = coalescing ? 1 : n;
+    size_t slot_size = coalescing ? recv_buffer_size() : max_segment_size;
+
+    //Point each message at its slot, we keep the addresses around so we can
+    //remember who sent us the last one.
+    mmsghdr msgs[MAX_BATCH];
+    iovec iov[MAX_BATCH];
+    sockaddr_in addrs[MAX_BATCH];
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(msgs, 0, sizeof(mmsghdr) * messages);
+    for(size_t i = 0; i < messages; i++){
+        iov[i].iov_base = recv_buffer + i * slot_size;
+        iov[i].iov_len = slot_size;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+    if(coalescing){
+        msgs[0].msg_hdr.msg_control = control;
+        msgs[0].msg_hdr.msg_controllen = sizeof(control);
+    }
 
-    //If the user requested that we do our processing with a timout, we need to
-    //do a bit of extra work.
+    //With a timeout, first take anything that is already waiting, and only
+    //fall back on select if there was nothing. Without one we block until
+    //the first datagram shows up and take whatever came with it.
+    int count;
+    syscalls++;
     if(timeout){
+        count = recvmmsg(fd, msgs, messages, MSG_DONTWAIT, nullptr);
+        if(count <= 0){
+            if(!wait_readable(tv)){
+                return 0;
+            }
+            syscalls++;
+            count = recvmmsg(fd, msgs, messages, MSG_DONTWAIT, nullptr);
+        }
+    }
+    else{
+        count = recvmmsg(fd, msgs, messages, MSG_WAITFORONE, nullptr);
+    }
+    if(count <= 0){
+        return 0;
+    }
+    last_recvd_addr = addrs[count - 1];
+
+    //A coalesced datagram says how big the pieces it is made of are, one
+    //without that note is just a single datagram.
+    if(coalescing){
+        coalesced_next = recv_buffer;
+        coalesced_left = msgs[0].msg_len;
+        coalesced_size = msgs[0].msg_len;
+        for(cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[0].msg_hdr); cmsg != nullptr;
+            cmsg = CMSG_NXTHDR(&msgs[0].msg_hdr, cmsg)){
+            if(cmsg->cmsg_level == IPPROTO_UDP && 
+               cmsg->cmsg_type == UDP_GRO){
+                int gro_size;
+                memcpy(&gro_size, CMSG_DATA(cmsg), sizeof(gro_size));
+                coalesced_size = gro_size > 0 ? gro_size : coalesced_size;
+            }
+        }
+        return take_coalesced(data, lengths, n, from);
+    }
 
-        //Create a set of file descriptors we will watch for activity, in this
-        //case, just the udp socket
-        fd_set readset;
-        FD_ZERO(&readset);
-        FD_SET(fd, &readset);
-
-        //Wait up to the specified time or untill one of our watched files gets
-        //updated. Return the number of updated files.
-        int flag = select(fd + 1, &readset, nullptr, nullptr, &tv);
+    //Hand back everything the loss simulation lets through
+    size_t kept = 0;
+    for(int i = 0; i < count; i++){
+        if(!was_dropped()){
+            maybe_corrupt(recv_buffer + i * slot_size, msgs[i].msg_len);
+            data[kept] = recv_buffer + i * slot_size;
+            lengths[kept] = msgs[i].msg_len;
+            if(from){
+                from[kept] = addrs[i];
+            }
+            kept++;
+        }
+    }
+    return kept;
+}
 
-        //If the flag is 0, that means we waited our whole timeout window.
-        if(flag == 0){
-            return output; 
+//Hand out up to n of the datagrams a coalesced one was made of, the loss
+//simulation gets a say about each of them.
+size_t udp_socket::take_coalesced(const uint8_t** data, size_t* lengths, 
+                                  size_t n, sockaddr_in* from){
+    size_t kept = 0;
+    while(coalesced_left > 0 && kept < n){
+        size_t length = std::min(coalesced_size, coalesced_left);
+        if(!was_dropped()){
+            maybe_corrupt(coalesced_next, length);
+            data[kept] = coalesced_next;
+            lengths[kept] = length;
+            if(from){
+                from[kept] = last_recvd_addr;
+            }
+            kept++;
         }
-        //Otherwise, we're good to go. The recvfrom below is guarenteed not to
-        //block.
+        coalesced_next += length;
+        coalesced_left -= length;
+    }
+    return kept;
+}
+
+//Turn on whichever offloads the kernel supports. Setting the socket wide GSO
+//size to zero only checks that the option exists, the size goes with each
+//send.
+bool udp_socket::enable_offload(){
+    int zero = 0;
+    gso.store(setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &zero, 
+                         sizeof(zero)) == 0);
+    int one = 1;
+    gro.store(setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)) == 0);
+    return gso.load() && gro.load();
+}
+
+bool udp_socket::gso_enabled(){
+    return gso.load();
+}
+
+bool udp_socket::gro_enabled(){
+    return gro.load();
+}
+
+//A coalesced datagram can be as big as any UDP datagram, 64KiB covers it
+size_t udp_socket::recv_buffer_size(){
+    return std::max(max_segment_size * MAX_BATCH, (size_t)65536);
+}
+
+//Wait for the socket to have something to read for at most tv
+bool udp_socket::wait_readable(timeval tv){
+    //A zero timeout means don't wait at all, we already know nothing is there
+    if(tv.tv_sec == 0 && tv.tv_usec == 0){
+        return false;
     }
 
-    //Make a call to recv from, place the address of the person we received from
-    //into the last_recvd_addr struct
-    int len = sizeof(last_recvd_addr);
-    size_t count = recvfrom(fd, recv_buffer, max_segment_size, 0, 
-            (struct sockaddr *) &last_recvd_addr, (socklen_t *)&len);
+    //Watch just the udp socket. This is poll rather than select so it still
+    //works once a process has more than FD_SETSIZE sockets open.
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    timespec ts;
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000;
+
+    //Wait up to the specified time or untill the socket gets updated. If the
+    //result is 0 we waited our whole timeout window.
+    syscalls++;
+    return ppoll(&pfd, 1, &ts, nullptr) > 0;
+}
 
-    //If the loss simulation parameters tell us that the packet wasn't dropped
-    if(!was_dropped()){
+int udp_socket::get_fd(){
+    return fd;
+}
 
-        //... then reserve space in the output vector and copy the data before
-        //returning it.
-        output.reserve(count);
-        copy(recv_buffer, recv_buffer + count, back_inserter(output));
+//Give up our own descriptor for the other socket's, we are bound wherever it
+//is bound.
+void udp_socket::share(udp_socket& other){
+    if(owns_fd){
+        close(fd);
     }
+    fd = other.fd;
+    owns_fd = false;
+    bound = other.bound;
+    local_addr = other.local_addr;
+}
 
-    return output;
+uint64_t udp_socket::get_syscalls(){
+    return syscalls.load();
 }
 
 //Send a serializable object TODO error checking
@@ -258,3 +602,16 @@ bool udp_socket::was_dropped(){
     std::bernoulli_distribution dist(loss_probability);
     return dist(rand_engine);
 }
+
+//Flip a random bit of the datagram, if the dice say so
+void udp_socket::maybe_corrupt(uint8_t* data, size_t length){
+    if(corruption_probability == 0 || length == 0){
+        return;
+    }
+    std::bernoulli_distribution dist(corruption_probability);
+    if(dist(rand_engine)){
+        std::uniform_int_distribution<size_t> bit(0, 8 * length - 1);
+        size_t which = bit(rand_engine);
+        data[which / 8] ^= 1 << (which % 8);
+    }
+}
@@ -10,8 +10,10 @@
 #include <cstdint>
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <functional>
 #include <random>
+#include <atomic>
 
 // Abstract class representing the concept of serializability. The udp socket is
 // set up to be able to send and receive any object which is serializable given
@@ -37,6 +39,21 @@ class serializable{
 class udp_socket{
 
     public:
+        //The most datagrams moved by a single batched send or recv
+        static const size_t MAX_BATCH = 64;
+
+        //Limits on what segmentation offload hands the kernel at once, at
+        //most this many segments and this many bytes in one buffer. A
+        //coalesced receive can be just as big.
+        static const size_t GSO_MAX_SEGMENTS = 64;
+        static const size_t GSO_MAX_BYTES = 65507;
+
+        //One datagram of a batched send, count buffers sent back to back
+        struct datagram{
+            const iovec* iov;
+            size_t count;
+        };
+
         //Rule of N stuff
         udp_socket(size_t mss, double loss_probability = 0);
         udp_socket(udp_socket& other);
@@ -49,6 +66,11 @@ class udp_socket{
         void bind_local(unsigned short port);
         void bind_local_any();
 
+        //Let other sockets bind the same port as this one, the kernel then
+        //spreads incoming datagrams across them by where they come from. Has
+        //to be called before binding, returns false if the kernel said no.
+        bool set_reuse_port();
+
         //Get info about how the socket is bound
         bool is_bound();
         unsigned short bound_to();
@@ -66,6 +88,31 @@ class udp_socket{
         //Allow the setting of the loss probability at any time
         void set_loss_probability(double prob);
 
+        //Same for corruption, a datagram which isn't dropped has one of its
+        //bits flipped with this probability.
+        void set_corruption_probability(double prob);
+
+        //Set the don't fragment bit on everything we send and ignore what the
+        //kernel thinks the path MTU is, datagrams too big for the path are
+        //lost instead of fragmented. Used to probe for the path MTU.
+        void set_dont_fragment(bool);
+
+        //The largest datagram this socket can receive
+        size_t get_max_segment_size();
+
+        //The descriptor underneath, for waiting on lots of sockets at once
+        int get_fd();
+
+        //Send through another socket's descriptor instead of one of our own,
+        //which is closed. The other socket has to outlive this one and does
+        //all of the receiving, this one keeps its own peer so lots of them
+        //can each talk to somebody different through the same port.
+        void share(udp_socket& other);
+
+        //Roll the loss simulation for a datagram which reached us some other
+        //way, returns true if it should be thrown away.
+        bool was_dropped();
+
         //Primary interface, send and receive arbitrary serial data represented
         //as uint8_t vectors. Recv optionally allows a timeout to be set with a
         //proveded timeval. If the operation times out, it returns an empty
@@ -74,6 +121,40 @@ class udp_socket{
         std::vector<uint8_t> recv(bool timeout = false, 
                                   timeval tv = timeval());
 
+        //The same without any copies. The gathering send puts count buffers
+        //back to back into one segment. recv_in_place points data at the
+        //socket's own receive buffer and returns how many bytes are there, 0
+        //if it timed out, the data is only good until the next recv.
+        void send(const iovec* iov, size_t count);
+        size_t recv_in_place(const uint8_t*& data, bool timeout = false, 
+                             timeval tv = timeval());
+
+        //Batched versions which move up to MAX_BATCH datagrams per syscall.
+        //send_batch returns how many datagrams went out, it stops early if
+        //the kernel is out of buffer space. recv_batch waits like recv for
+        //the first datagram and then takes whatever else is already waiting,
+        //without blocking, up to n of them. It points data[i] at the i'th
+        //datagram and sets lengths[i], returning how many there are. If from isn't null from[i] is set to who sent it. As with
+        //recv_in_place the data is only good until the next recv.
+        size_t send_batch(const datagram* datagrams, size_t n);
+        size_t recv_batch(const uint8_t** data, size_t* lengths, size_t n,
+                          bool timeout = false, timeval tv = timeval(),
+                          sockaddr_in* from = nullptr);
+
+        //How many syscalls the socket has made for sending and receiving
+        uint64_t get_syscalls();
+
+        //Opt in to segmentation offload. With GSO on, send_batch hands the
+        //kernel runs of consecutive datagrams of the same size as a single
+        //buffer to be cut up on the way out. With GRO on, the kernel may
+        //coalesce incoming datagrams and recv_batch splits them up again, so
+        //callers see the same datagrams either way. Whichever the kernel
+        //refuses stays off, GSO also turns itself back off if a send with it
+        //fails. Returns true if both ended up on.
+        bool enable_offload();
+        bool gso_enabled();
+        bool gro_enabled();
+
         //Send and receive any sendable object. Recv returns false if it times
         //out, true otherwise.
         void send(serializable&);
@@ -82,18 +163,41 @@ class udp_socket{
 
     private:
 
-        //The file descriptor we do all our sending on
+        //The file descriptor we do all our sending on, and whether it is ours
+        //to close or shared with us by another socket
         int fd;
+        bool owns_fd;
 
         //Flags used to keep track of connection state
         bool has_peer;
         bool bound;
 
-        //The maximum segment size and a buffer of this size used for receiving
-        //raw data from the network.
+        //The maximum segment size and a buffer with room for a full batch of
+        //segments this size used for receiving raw data from the network.
         size_t max_segment_size;
         uint8_t* recv_buffer;
 
+        //Count of syscalls made, the socket is used from more than one thread
+        std::atomic<uint64_t> syscalls;
+
+        //Segmentation offload state, see enable_offload
+        std::atomic<bool> gso;
+        std::atomic<bool> gro;
+
+        //What is left of the last coalesced datagram GRO gave us, handed out
+        //by the following recvs before we go back to the kernel.
+        uint8_t* coalesced_next;
+        size_t coalesced_left;
+        size_t coalesced_size;
+        size_t take_coalesced(const uint8_t** data, size_t* lengths, size_t n,
+                              sockaddr_in* from);
+
+        //The receive buffer has to hold a full batch or a coalesced datagram
+        size_t recv_buffer_size();
+
+        //Wait up to tv for the socket to be readable, false if it never was
+        bool wait_readable(timeval tv);
+
         //The address of our peer and ourselves as well as the last person who
         //send us something.
         sockaddr_in peer_addr;
@@ -102,9 +206,8 @@ class udp_socket{
 
         //Data members and functions used for simulating packet loss:
         double loss_probability;
+        double corruption_probability;
         std::knuth_b rand_engine;
+        void maybe_corrupt(uint8_t* data, size_t length);
 
-        //This private member uses the above parameters to return true if we
-        //should drop an incoming packet.
-        bool was_dropped();
 };